@@ -29,4 +29,8 @@ void arch_pfn_add(unsigned long pfn, unsigned long mfn)
 {
 }
 
+void arch_pfn_remove(unsigned long pfn)
+{
+}
+
 #endif
@@ -8,18 +8,9 @@ void arm_start_thread(void);
 #define CALLEE_SAVED_REGISTERS 8
 
 /* Architecture specific setup of thread creation */
-struct thread* arch_create_thread(char *name, void (*function)(void *),
-                                  void *data)
+void arch_init_thread(struct thread *thread, void (*function)(void *),
+                      void *data)
 {
-    struct thread *thread;
-
-    thread = xmalloc(struct thread);
-    /* We can't use lazy allocation here since the trap handler runs on the stack */
-    thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
-    thread->name = name;
-    printk("Thread \"%s\": pointer: 0x%p, stack: 0x%p\n", name, thread,
-            thread->stack);
-
     /* Save pointer to the thread on the stack, used by current macro */
     *((unsigned long *)thread->stack) = (unsigned long)thread;
 
@@ -34,8 +25,6 @@ struct thread* arch_create_thread(char *name, void (*function)(void *),
     thread->sp = (unsigned long) sp - 4 * CALLEE_SAVED_REGISTERS;
 
     thread->ip = (unsigned long) arm_start_thread;
-
-    return thread;
 }
 
 void run_idle_thread(void)
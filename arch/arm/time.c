@@ -4,6 +4,7 @@
 #include <mini-os/traps.h>
 #include <mini-os/types.h>
 #include <mini-os/time.h>
+#include <mini-os/timer.h>
 #include <mini-os/lib.h>
 
 //#define VTIMER_DEBUG
@@ -72,6 +73,12 @@ uint64_t monotonic_clock(void)
     return ticks_to_ns(read_virtual_count() - cntvct_at_init);
 }
 
+/* The virtual counter is a register read, as cheap as a coarse clock gets */
+uint64_t monotonic_clock_coarse(void)
+{
+    return monotonic_clock();
+}
+
 int gettimeofday(struct timeval *tv, void *tz)
 {
     uint64_t nsec = monotonic_clock();
@@ -106,10 +113,20 @@ void unset_vtimer_compare(void) {
     write_timer_ctl(2);
 }
 
+/* There is no handler for the virtual timer interrupt yet, it only ends
+ * the wfi in block_domain(), so timers are run from there. */
+void arch_program_timer(s_time_t deadline)
+{
+}
+
 void block_domain(s_time_t until)
 {
-    uint64_t until_count = ns_to_ticks(until) + cntvct_at_init;
+    s_time_t next = timer_next_expiry();
+    uint64_t until_count;
     ASSERT(irqs_disabled());
+    if (next && next < until)
+        until = next;
+    until_count = ns_to_ticks(until) + cntvct_at_init;
     if (read_virtual_count() < until_count)
     {
         set_vtimer_compare(until_count);
@@ -120,6 +137,7 @@ void block_domain(s_time_t until)
         local_irq_enable();
         local_irq_disable();
     }
+    timer_run_expired();
 }
 
 void init_time(void)
@@ -140,6 +140,16 @@ void arch_pfn_add(unsigned long pfn, unsigned long mfn)
         do_exit();
     }
 }
+
+void arch_pfn_remove(unsigned long pfn)
+{
+    if ( unmap_frames((unsigned long)pfn_to_virt(pfn), 1) )
+    {
+        printk("ERROR: could not unmap ballooned pfn %lx\n", pfn);
+        do_exit();
+    }
+    phys_to_machine_mapping[pfn] = INVALID_P2M_ENTRY;
+}
 #else
 void arch_pfn_add(unsigned long pfn, unsigned long mfn)
 {
@@ -150,6 +160,14 @@ void arch_pfn_add(unsigned long pfn, unsigned long mfn)
     if ( !(*pgt & _PAGE_PSE) )
         *pgt = (pgentry_t)(mfn << PAGE_SHIFT) | _PAGE_PRESENT | _PAGE_RW;
 }
+
+void arch_pfn_remove(unsigned long pfn)
+{
+    /*
+     * The mapping can stay: the page isn't touched before it is
+     * repopulated at the same gpfn.
+     */
+}
 #endif
 
 #endif
@@ -92,18 +92,9 @@ static void stack_push(struct thread *thread, unsigned long value)
 }
 
 /* Architecture specific setup of thread creation */
-struct thread* arch_create_thread(char *name, void (*function)(void *),
-                                  void *data)
+void arch_init_thread(struct thread *thread, void (*function)(void *),
+                      void *data)
 {
-    struct thread *thread;
-    
-    thread = xmalloc(struct thread);
-    /* We can't use lazy allocation here since the trap handler runs on the stack */
-    thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
-    thread->name = name;
-    printk("Thread \"%s\": pointer: 0x%p, stack: 0x%p\n", name, thread, 
-            thread->stack);
-    
     thread->sp = (unsigned long)thread->stack + STACK_SIZE;
     /* Save pointer to the thread on the stack, used by current macro */
     *((unsigned long *)thread->stack) = (unsigned long)thread;
@@ -114,7 +105,6 @@ struct thread* arch_create_thread(char *name, void (*function)(void *),
     stack_push(thread, (unsigned long) function);
     stack_push(thread, (unsigned long) data);
     thread->ip = (unsigned long) thread_starter;
-    return thread;
 }
 
 void run_idle_thread(void)
@@ -182,6 +182,9 @@ arch_init(void *par)
 	/* Initialize SSE */
 	sse_init();
 
+	/* Pick memcpy()/memset() implementations */
+	init_string_ops();
+
 	/* Setup memory management info from start_info. */
 	arch_mm_preinit(par);
 
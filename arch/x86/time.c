@@ -38,25 +38,25 @@
 #include <mini-os/hypervisor.h>
 #include <mini-os/events.h>
 #include <mini-os/time.h>
+#include <mini-os/timer.h>
 #include <mini-os/lib.h>
+#include <xen/vcpu.h>
 
 /************************************************************************
  * Time functions
  *************************************************************************/
 
-/* These are peridically updated in shared_info, and then copied here. */
-struct shadow_time_info {
-	uint64_t tsc_timestamp;     /* TSC at last update of time vals.  */
-	uint64_t system_timestamp;  /* Time, in nanosecs, since boot.    */
-	uint32_t tsc_to_nsec_mul;
-	uint32_t tsc_to_usec_mul;
-	int tsc_shift;
-	uint32_t version;
-};
 static struct timespec shadow_ts;
 static uint32_t shadow_ts_version;
 
-static struct shadow_time_info shadow;
+/* Set by Xen in the flags byte of vcpu_time_info, which our copy of the
+ * interface still calls pad1[0], when the TSC is synchronised across
+ * CPUs and time computed from it never goes backwards */
+#define PVCLOCK_TSC_STABLE_BIT (1 << 0)
+
+static int have_rdtscp;
+/* Latest time handed out, also the coarse clock */
+static volatile uint64_t last_time;
 
 
 #ifndef rmb
@@ -72,13 +72,6 @@ static struct shadow_time_info shadow;
         }                                  \
     } while ( 0 )
 
-static inline int time_values_up_to_date(void)
-{
-	struct vcpu_time_info *src = &HYPERVISOR_shared_info->vcpu_info[0].time; 
-
-	return (shadow.version == src->version);
-}
-
 static inline int wc_values_up_to_date(void)
 {
 	shared_info_t *s= HYPERVISOR_shared_info;
@@ -123,35 +116,47 @@ static inline uint64_t scale_delta(uint64_t delta, uint32_t mul_frac, int shift)
 }
 
 
-static unsigned long get_nsec_offset(void)
+/* The TSC must not be read before the time values it is scaled against */
+static inline uint64_t pvclock_read_tsc(void)
 {
-	uint64_t now, delta;
-	rdtscll(now);
-	delta = now - shadow.tsc_timestamp;
-	return scale_delta(delta, shadow.tsc_to_nsec_mul, shadow.tsc_shift);
-}
-
+	uint32_t lo, hi, aux;
+	uint64_t tsc;
 
-static void get_time_values_from_xen(void)
-{
-	struct vcpu_time_info    *src = &HYPERVISOR_shared_info->vcpu_info[0].time;
-
- 	do {
-		shadow.version = src->version;
-		rmb();
-		shadow.tsc_timestamp     = src->tsc_timestamp;
-		shadow.system_timestamp  = src->system_time;
-		shadow.tsc_to_nsec_mul   = src->tsc_to_system_mul;
-		shadow.tsc_shift         = src->tsc_shift;
-		rmb();
+	if (have_rdtscp) {
+		__asm__ __volatile__ ("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux)
+		                      : : "memory");
+		return ((uint64_t)hi << 32) | lo;
 	}
-	while ((src->version & 1) | (shadow.version ^ src->version));
+	rmb();
+	rdtscll(tsc);
+	return tsc;
+}
 
-	shadow.tsc_to_usec_mul = shadow.tsc_to_nsec_mul / 1000;
+static inline volatile struct vcpu_time_info *pvclock_time_info(int cpu)
+{
+	return &HYPERVISOR_shared_info->vcpu_info[cpu].time;
 }
 
+/* Lock-free read of a vCPU's time record; x86 does not reorder loads, so
+ * only the compiler needs holding back around the version checks */
+static uint64_t pvclock_read(volatile struct vcpu_time_info *src,
+                             uint8_t *flags)
+{
+	uint32_t version;
+	uint64_t time;
 
+	do {
+		version = src->version;
+		barrier();
+		time = src->system_time +
+		       scale_delta(pvclock_read_tsc() - src->tsc_timestamp,
+		                   src->tsc_to_system_mul, src->tsc_shift);
+		*flags = src->pad1[0];
+		barrier();
+	} while ((version & 1) | (version ^ src->version));
 
+	return time;
+}
 
 /* monotonic_clock(): returns # of nanoseconds passed since time_init()
  *		Note: This function is required to return accurate
@@ -159,21 +164,43 @@ static void get_time_values_from_xen(void)
  */
 uint64_t monotonic_clock(void)
 {
+	unsigned long flags;
 	uint64_t time;
-	uint32_t local_time_version;
+	uint8_t pvflags;
 
-	do {
-		local_time_version = shadow.version;
-		rmb();
-		time = shadow.system_timestamp + get_nsec_offset();
-		if (!time_values_up_to_date())
-			get_time_values_from_xen();
-		rmb();
-	} while (local_time_version != shadow.version);
+	time = pvclock_read(pvclock_time_info(smp_processor_id()), &pvflags);
+	if (pvflags & PVCLOCK_TSC_STABLE_BIT) {
+		last_time = time;
+		return time;
+	}
+
+	/* Without a stable TSC, a new record can put time slightly behind
+	 * what we already handed out */
+	local_irq_save(flags);
+	if (time < last_time)
+		time = last_time;
+	else
+		last_time = time;
+	local_irq_restore(flags);
 
 	return time;
 }
 
+uint64_t monotonic_clock_coarse(void)
+{
+#ifdef __i386__
+	uint64_t time;
+
+	/* Not a single load here, so retry if torn by an update */
+	do
+		time = last_time;
+	while (time != last_time);
+	return time;
+#else
+	return last_time;
+#endif
+}
+
 static void update_wallclock(void)
 {
 	shared_info_t *s = HYPERVISOR_shared_info;
@@ -206,12 +233,39 @@ int gettimeofday(struct timeval *tv, void *tz)
 }
 
 
+/* VCPUOP_set_singleshot_timer takes the same absolute system time as
+ * set_timer_op, but leaves the periodic timer alone, which init_time()
+ * stops. Fall back to set_timer_op on hypervisors without it. */
+static int singleshot_ok = 1;
+
+void arch_program_timer(s_time_t deadline)
+{
+    struct vcpu_set_singleshot_timer single;
+
+    if (singleshot_ok) {
+        if (deadline) {
+            single.timeout_abs_ns = deadline;
+            single.flags = 0;
+            if (!HYPERVISOR_vcpu_op(VCPUOP_set_singleshot_timer, 0, &single))
+                return;
+        } else if (!HYPERVISOR_vcpu_op(VCPUOP_stop_singleshot_timer, 0, NULL)) {
+            return;
+        }
+        singleshot_ok = 0;
+    }
+    HYPERVISOR_set_timer_op(deadline);
+}
+
 void block_domain(s_time_t until)
 {
+    s_time_t next = timer_next_expiry();
+
     ASSERT(irqs_disabled());
+    if (next && next < until)
+        until = next;
     if(monotonic_clock() < until)
     {
-        HYPERVISOR_set_timer_op(until);
+        arch_program_timer(until);
 #ifdef CONFIG_PARAVIRT
         HYPERVISOR_sched_op(SCHEDOP_block, 0);
 #else
@@ -219,13 +273,13 @@ void block_domain(s_time_t until)
         asm volatile ( "hlt" : : : "memory" );
 #endif
         local_irq_disable();
-        HYPERVISOR_set_timer_op(0);
+        arch_program_timer(timer_next_expiry());
     }
 }
 
 static void timer_handler(evtchn_port_t ev, struct pt_regs *regs, void *ign)
 {
-    HYPERVISOR_set_timer_op(monotonic_clock() + MILLISECS(1));
+    timer_run_expired();
 }
 
 
@@ -233,14 +287,28 @@ static void timer_handler(evtchn_port_t ev, struct pt_regs *regs, void *ign)
 static evtchn_port_t port;
 void init_time(void)
 {
-    printk("Initialising timer interface\n");
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+        have_rdtscp = !!(edx & (1U << 27));
+    }
+    printk("Initialising timer interface%s%s\n",
+           have_rdtscp ? ", rdtscp" : "",
+           (pvclock_time_info(0)->pad1[0] & PVCLOCK_TSC_STABLE_BIT) ?
+           ", stable TSC" : "");
+    /* Only wake up when something is due */
+    HYPERVISOR_vcpu_op(VCPUOP_stop_periodic_timer, 0, NULL);
     port = bind_virq(VIRQ_TIMER, &timer_handler, NULL);
+    /* Timer callbacks should not queue behind device events */
+    evtchn_set_priority(port, EVTCHN_FIFO_PRIORITY_MAX);
     unmask_evtchn(port);
 }
 
 void fini_time(void)
 {
     /* Clear any pending timer */
-    HYPERVISOR_set_timer_op(0);
+    arch_program_timer(0);
     unbind_evtchn(port);
 }
@@ -26,6 +26,10 @@
 #include <mini-os/errno.h>
 #include <mini-os/lib.h>
 #include <mini-os/paravirt.h>
+#include <mini-os/sched.h>
+#include <mini-os/wait.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/xmalloc.h>
 #include <xen/xen.h>
 #include <xen/memory.h>
 
@@ -65,20 +69,103 @@ void mm_alloc_bitmap_remap(void)
     mm_alloc_bitmap = (unsigned long *)new_bitmap;
 }
 
-#define N_BALLOON_FRAMES 64
+#define N_BALLOON_FRAMES 512
 static unsigned long balloon_frames[N_BALLOON_FRAMES];
 
-int balloon_up(unsigned long n_pages)
+/* Ranges of pfns which have been handed back to the hypervisor. */
+struct balloon_hole {
+    unsigned long pfn;
+    unsigned long nr;
+};
+static struct balloon_hole *balloon_holes;
+static unsigned long nr_balloon_holes;
+static unsigned long max_balloon_holes;
+unsigned long nr_ballooned_pages;
+
+#define BALLOON_RETRY_MS 1000
+#define BALLOON_RETRY_MAX_MS 60000
+
+static unsigned long balloon_target;
+static DECLARE_WAIT_QUEUE_HEAD(balloon_wq);
+static int in_balloon;
+
+static long balloon_populate(unsigned long nr_extents, unsigned int order)
 {
-    unsigned long page, pfn;
-    int rc;
     struct xen_memory_reservation reservation = {
-        .domid        = DOMID_SELF
+        .domid        = DOMID_SELF,
+        .extent_order = order
     };
 
+    set_xen_guest_handle(reservation.extent_start, balloon_frames);
+    reservation.nr_extents = nr_extents;
+    return HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
+}
+
+/* Map and free pages [pfn, pfn + n), starting at frame mfn. */
+static void balloon_add_pages(unsigned long pfn, unsigned long mfn,
+                              unsigned long n)
+{
+    unsigned long i;
+
+    for ( i = 0; i < n; i++ )
+    {
+        arch_pfn_add(pfn + i, mfn + i);
+        free_page(pfn_to_virt(pfn + i));
+    }
+}
+
+/* Repopulate (part of) the most recently ballooned out range of pfns. */
+static int balloon_fill_hole(unsigned long n_pages)
+{
+    struct balloon_hole *hole = &balloon_holes[nr_balloon_holes - 1];
+    unsigned long i, end = hole->pfn + hole->nr;
+    long rc;
+
+    if ( n_pages > hole->nr )
+        n_pages = hole->nr;
+    if ( n_pages > N_BALLOON_FRAMES )
+        n_pages = N_BALLOON_FRAMES;
+
+    /* Fill from the top, so a partial success just shrinks the hole. */
+    for ( i = 0; i < n_pages; i++ )
+        balloon_frames[i] = end - 1 - i;
+    rc = balloon_populate(n_pages, 0);
+    if ( rc <= 0 )
+        return rc;
+
+    for ( i = 0; i < rc; i++ )
+        balloon_add_pages(end - 1 - i, balloon_frames[i], 1);
+
+    hole->nr -= rc;
+    if ( !hole->nr )
+        nr_balloon_holes--;
+    nr_ballooned_pages -= rc;
+
+    return rc;
+}
+
+int balloon_up(unsigned long n_pages)
+{
+    unsigned long page, pfn, mask;
+    unsigned int order = 0;
+    long rc;
+
+    if ( nr_balloon_holes )
+        return balloon_fill_hole(n_pages);
+
     if ( n_pages > nr_max_pages - nr_mem_pages )
         n_pages = nr_max_pages - nr_mem_pages;
-    if ( n_pages > N_BALLOON_FRAMES )
+    if ( n_pages > BALLOON_BATCH_PAGES )
+        n_pages = BALLOON_BATCH_PAGES;
+
+    /* Use superpage sized extents if the request allows for it. */
+    mask = (1UL << BALLOON_EXTENT_ORDER) - 1;
+    if ( n_pages > mask && !(nr_mem_pages & mask) )
+    {
+        order = BALLOON_EXTENT_ORDER;
+        n_pages &= ~mask;
+    }
+    else if ( n_pages > N_BALLOON_FRAMES )
         n_pages = N_BALLOON_FRAMES;
 
     /* Resize alloc_bitmap if necessary. */
@@ -104,28 +191,236 @@ int balloon_up(unsigned long n_pages)
         return rc;
 
     /* Get new memory from hypervisor. */
-    for ( pfn = 0; pfn < n_pages; pfn++ )
+    for ( pfn = 0; pfn < (n_pages >> order); pfn++ )
     {
-        balloon_frames[pfn] = nr_mem_pages + pfn;
+        balloon_frames[pfn] = nr_mem_pages + (pfn << order);
+    }
+    rc = balloon_populate(n_pages >> order, order);
+    if ( rc <= 0 && order )
+    {
+        /* No superpages available, retry with single pages. */
+        order = 0;
+        if ( n_pages > N_BALLOON_FRAMES )
+            n_pages = N_BALLOON_FRAMES;
+        for ( pfn = 0; pfn < n_pages; pfn++ )
+            balloon_frames[pfn] = nr_mem_pages + pfn;
+        rc = balloon_populate(n_pages, 0);
     }
-    set_xen_guest_handle(reservation.extent_start, balloon_frames);
-    reservation.nr_extents = n_pages;
-    rc = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
     if ( rc <= 0 )
         return rc;
 
     for ( pfn = 0; pfn < rc; pfn++ )
     {
-        arch_pfn_add(nr_mem_pages + pfn, balloon_frames[pfn]);
-        free_page(pfn_to_virt(nr_mem_pages + pfn));
+        balloon_add_pages(nr_mem_pages + (pfn << order), balloon_frames[pfn],
+                          1UL << order);
     }
 
-    nr_mem_pages += rc;
+    nr_mem_pages += rc << order;
 
-    return rc;
+    return rc << order;
 }
 
-static int in_balloon;
+static int balloon_add_hole(unsigned long pfn)
+{
+    struct balloon_hole *holes;
+
+    if ( nr_balloon_holes )
+    {
+        struct balloon_hole *hole = &balloon_holes[nr_balloon_holes - 1];
+
+        if ( hole->pfn + hole->nr == pfn )
+        {
+            hole->nr++;
+            return 0;
+        }
+        if ( pfn + 1 == hole->pfn )
+        {
+            hole->pfn--;
+            hole->nr++;
+            return 0;
+        }
+    }
+
+    if ( nr_balloon_holes == max_balloon_holes )
+    {
+        holes = realloc(balloon_holes, (max_balloon_holes + N_BALLOON_FRAMES) *
+                                       sizeof(*holes));
+        if ( !holes )
+            return -ENOMEM;
+        balloon_holes = holes;
+        max_balloon_holes += N_BALLOON_FRAMES;
+    }
+
+    balloon_holes[nr_balloon_holes].pfn = pfn;
+    balloon_holes[nr_balloon_holes].nr = 1;
+    nr_balloon_holes++;
+
+    return 0;
+}
+
+int balloon_down(unsigned long n_pages)
+{
+    struct xen_memory_reservation reservation = {
+        .domid        = DOMID_SELF
+    };
+    unsigned long page, pfn, i;
+    long rc;
+
+    if ( n_pages > N_BALLOON_FRAMES )
+        n_pages = N_BALLOON_FRAMES;
+
+    for ( i = 0; i < n_pages; i++ )
+    {
+        page = alloc_page();
+        if ( !page )
+            break;
+        pfn = virt_to_pfn(page);
+        if ( balloon_add_hole(pfn) )
+        {
+            free_page((void *)page);
+            break;
+        }
+        balloon_frames[i] = pfn_to_mfn(pfn);
+        arch_pfn_remove(pfn);
+    }
+    n_pages = i;
+    if ( !n_pages )
+        return 0;
+
+    set_xen_guest_handle(reservation.extent_start, balloon_frames);
+    reservation.nr_extents = n_pages;
+    rc = HYPERVISOR_memory_op(XENMEM_decrease_reservation, &reservation);
+    if ( rc != n_pages )
+    {
+        printk("balloon: decrease_reservation returned %ld for %lu pages\n",
+               rc, n_pages);
+        do_exit();
+    }
+
+    nr_ballooned_pages += n_pages;
+
+    return n_pages;
+}
+
+static inline unsigned long balloon_cur_pages(void)
+{
+    return nr_mem_pages - nr_ballooned_pages;
+}
+
+static int balloon_work_pending(void)
+{
+    unsigned long cur = balloon_cur_pages();
+
+    if ( nr_free_pages < BALLOON_LOW_WATER_PAGES && cur < nr_max_pages )
+        return 1;
+    if ( !balloon_target )
+        return 0;
+    if ( cur < balloon_target )
+        return 1;
+    return cur > balloon_target &&
+           nr_free_pages > BALLOON_HIGH_WATER_PAGES +
+                           (1UL << BALLOON_EXTENT_ORDER);
+}
+
+static void balloon_thread(void *p)
+{
+    unsigned long cur, target = 0;
+    unsigned long retry_ms = BALLOON_RETRY_MS;
+    int rc, failing = 0;
+
+    for ( ;; )
+    {
+        wait_event(balloon_wq, balloon_work_pending());
+
+        /* A new target deserves a prompt first attempt */
+        if ( balloon_target != target )
+        {
+            target = balloon_target;
+            retry_ms = BALLOON_RETRY_MS;
+        }
+
+        in_balloon = 1;
+        cur = balloon_cur_pages();
+        if ( nr_free_pages < BALLOON_LOW_WATER_PAGES )
+            rc = balloon_up(BALLOON_HIGH_WATER_PAGES - nr_free_pages);
+        else if ( cur < balloon_target )
+            rc = balloon_up(balloon_target - cur);
+        else if ( cur - balloon_target <
+                  nr_free_pages - BALLOON_HIGH_WATER_PAGES )
+            rc = balloon_down(cur - balloon_target);
+        else
+            rc = balloon_down(nr_free_pages - BALLOON_HIGH_WATER_PAGES);
+        in_balloon = 0;
+
+        if ( rc <= 0 )
+        {
+            /* The hypervisor refused: back off, but keep the target. */
+            if ( !failing )
+                printk("balloon: adjusting memory failed (%d), target %lu pages, "
+                       "retrying\n", rc, balloon_target);
+            failing = 1;
+            msleep(retry_ms);
+            retry_ms *= 2;
+            if ( retry_ms > BALLOON_RETRY_MAX_MS )
+                retry_ms = BALLOON_RETRY_MAX_MS;
+        }
+        else
+        {
+            if ( failing )
+                printk("balloon: adjusting memory works again\n");
+            failing = 0;
+            retry_ms = BALLOON_RETRY_MS;
+            /* Let the threads waiting for the memory run. */
+            schedule();
+        }
+    }
+}
+
+#ifdef CONFIG_XENBUS
+static void balloon_target_thread(void *p)
+{
+    const char *path = "memory/target";
+    xenbus_event_queue events = NULL;
+    unsigned long target;
+    char *err, *val;
+
+    err = xenbus_watch_path_token(XBT_NIL, path, path, &events);
+    if ( err )
+    {
+        printk("balloon: failed to watch %s: %s\n", path, err);
+        free(err);
+        return;
+    }
+
+    for ( ;; )
+    {
+        err = xenbus_read(XBT_NIL, path, &val);
+        if ( err )
+            free(err);
+        else
+        {
+            /* The target is given in kiB. */
+            if ( sscanf(val, "%lu", &target) == 1 )
+            {
+                balloon_target = target >> (PAGE_SHIFT - 10);
+                if ( balloon_target > nr_max_pages )
+                    balloon_target = nr_max_pages;
+                wake_up(&balloon_wq);
+            }
+            free(val);
+        }
+        xenbus_wait_for_watch(&events);
+    }
+}
+#endif
+
+void init_balloon(void)
+{
+    create_thread("balloon", balloon_thread, NULL);
+#ifdef CONFIG_XENBUS
+    create_thread("balloon-target", balloon_target_thread, NULL);
+#endif
+}
 
 int chk_free_pages(unsigned long needed)
 {
@@ -133,7 +428,12 @@ int chk_free_pages(unsigned long needed)
 
     /* No need for ballooning if plenty of space available. */
     if ( needed + BALLOON_EMERGENCY_PAGES <= nr_free_pages )
+    {
+        /* Have the balloon thread refill the reserve ahead of demand. */
+        if ( nr_free_pages - needed < BALLOON_LOW_WATER_PAGES )
+            wake_up(&balloon_wq);
         return 1;
+    }
 
     /* If we are already ballooning up just hope for the best. */
     if ( in_balloon )
@@ -143,12 +443,13 @@ int chk_free_pages(unsigned long needed)
     if ( irqs_disabled() )
         return 1;
 
+    /* The reserve is exhausted, we have to balloon up synchronously. */
     in_balloon = 1;
 
     while ( needed + BALLOON_EMERGENCY_PAGES > nr_free_pages )
     {
         n_pages = needed + BALLOON_EMERGENCY_PAGES - nr_free_pages;
-        if ( !balloon_up(n_pages) )
+        if ( balloon_up(n_pages) <= 0 )
             break;
     }
 
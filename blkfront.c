@@ -71,6 +71,8 @@ static void free_blkfront(struct blkfront_dev *dev)
 {
     mask_evtchn(dev->evtchn);
 
+    if (dev->backend)
+        free(xenbus_uncache_subtree(dev->backend));
     free(dev->backend);
 
     gnttab_end_access(dev->ring_ref);
@@ -85,6 +87,7 @@ static void free_blkfront(struct blkfront_dev *dev)
 struct blkfront_dev *init_blkfront(char *_nodename, struct blkfront_info *info)
 {
     xenbus_transaction_t xbt;
+    struct xenbus_batch batch;
     char* err;
     char* message=NULL;
     struct blkif_sring *s;
@@ -128,22 +131,17 @@ again:
         free(err);
     }
 
-    err = xenbus_printf(xbt, nodename, "ring-ref","%u",
+    xenbus_batch_init(&batch, xbt);
+    xenbus_batch_printf(&batch, nodename, "ring-ref","%u",
                 dev->ring_ref);
-    if (err) {
-        message = "writing ring-ref";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename,
+    xenbus_batch_printf(&batch, nodename,
                 "event-channel", "%u", dev->evtchn);
-    if (err) {
-        message = "writing event-channel";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename,
+    xenbus_batch_printf(&batch, nodename,
                 "protocol", "%s", XEN_IO_PROTO_ABI_NATIVE);
+    err = xenbus_batch_submit(&batch);
+    xenbus_batch_free(&batch);
     if (err) {
-        message = "writing protocol";
+        message = "writing ring-ref, event-channel and protocol";
         goto abort_transaction;
     }
 
@@ -181,6 +179,15 @@ done:
 
     printk("backend at %s\n", dev->backend);
 
+    /* The backend state is polled on every state change, here and in
+       shutdown_blkfront() */
+    msg = xenbus_cache_subtree(dev->backend);
+    if (msg) {
+        printk("Error %s when caching the backend path %s\n", msg, dev->backend);
+        free(msg);
+        msg = NULL;
+    }
+
     dev->handle = strtoul(strrchr(nodename, '/')+1, NULL, 0);
 
     {
@@ -212,21 +219,31 @@ done:
             goto error;
         }
 
+        xenbus_batch_init(&batch, XBT_NIL);
+
         snprintf(path, sizeof(path), "%s/info", dev->backend);
-        dev->info.info = xenbus_read_integer(path);
+        xenbus_batch_read(&batch, path);
 
         snprintf(path, sizeof(path), "%s/sectors", dev->backend);
-        // FIXME: read_integer returns an int, so disk size limited to 1TB for now
-        dev->info.sectors = xenbus_read_integer(path);
+        xenbus_batch_read(&batch, path);
 
         snprintf(path, sizeof(path), "%s/sector-size", dev->backend);
-        dev->info.sector_size = xenbus_read_integer(path);
+        xenbus_batch_read(&batch, path);
 
         snprintf(path, sizeof(path), "%s/feature-barrier", dev->backend);
-        dev->info.barrier = xenbus_read_integer(path);
+        xenbus_batch_read(&batch, path);
 
         snprintf(path, sizeof(path), "%s/feature-flush-cache", dev->backend);
-        dev->info.flush = xenbus_read_integer(path);
+        xenbus_batch_read(&batch, path);
+
+        free(xenbus_batch_submit(&batch));
+        dev->info.info = xenbus_batch_read_integer(&batch, 0);
+        // FIXME: read_integer returns an int, so disk size limited to 1TB for now
+        dev->info.sectors = xenbus_batch_read_integer(&batch, 1);
+        dev->info.sector_size = xenbus_batch_read_integer(&batch, 2);
+        dev->info.barrier = xenbus_batch_read_integer(&batch, 3);
+        dev->info.flush = xenbus_batch_read_integer(&batch, 4);
+        xenbus_batch_free(&batch);
 
         *info = dev->info;
     }
@@ -42,6 +42,8 @@
 #include <mini-os/os.h>
 #include <mini-os/lib.h>
 #include <mini-os/xenbus.h>
+#include <mini-os/sched.h>
+#include <mini-os/time.h>
 #include <xen/io/console.h>
 
 
@@ -80,63 +82,278 @@ void xencons_tx(void)
 #endif
 
 
-void console_print(struct consfront_dev *dev, char *data, int length)
+/*
+ * printk() does not write to the console directly.  Each message is
+ * formatted on the caller's stack and stored as a record in log_buf, a
+ * ring which producers claim space in with a compare-and-swap on
+ * log_head, so it can be used from any thread or interrupt handler
+ * without taking a lock.  The "console" thread drains committed records
+ * in batches, issuing one console_io hypercall and one ring notification
+ * per batch.  Until that thread is running, and on the way down, the
+ * ring is drained synchronously by the caller.
+ */
+#define LOG_BUF_SIZE        16384           /* power of two */
+#define LOG_BATCH_SIZE      4096
+#define LOG_LINE_MAX        1024
+
+#define LOG_COMMITTED       0x01
+#define LOG_PAD             0x02
+
+struct log_record {
+    uint16_t size;                          /* header + text, 8 byte aligned */
+    uint16_t len;
+    uint8_t level;
+    uint8_t flags;
+    uint16_t _pad;
+    s_time_t stamp;
+    char text[];
+};
+
+static char log_buf[LOG_BUF_SIZE] __attribute__((aligned(8)));
+static unsigned long log_head, log_tail;
+static unsigned long log_dropped;
+static char log_batch[LOG_BATCH_SIZE];
+static unsigned long log_draining;
+static int console_thread_running;
+static DECLARE_WAIT_QUEUE_HEAD(console_log_queue);
+
+static int console_loglevel = CONSOLE_LOGLEVEL_DEFAULT;
+static int console_timestamps;
+
+void console_set_loglevel(int level)
 {
-    char *curr_char, saved_char;
-    char copied_str[length+1];
-    char *copied_ptr;
-    int part_len;
-    int (*ring_send_fn)(struct consfront_dev *dev, const char *data, unsigned length);
+    console_loglevel = level;
+}
+
+void console_set_timestamps(int on)
+{
+    console_timestamps = on;
+}
 
+static inline int log_cmpxchg(unsigned long *ptr, unsigned long old,
+                              unsigned long new)
+{
+    return __atomic_compare_exchange_n(ptr, &old, new, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline struct log_record *log_record_at(unsigned long idx)
+{
+    return (struct log_record *)&log_buf[idx & (LOG_BUF_SIZE - 1)];
+}
+
+/* Claim room for a record of @size bytes, or return NULL if full. */
+static struct log_record *log_reserve(unsigned size)
+{
+    unsigned long head, tail, off, pad;
+    struct log_record *rec;
+
+    do {
+        head = log_head;
+        tail = log_tail;
+        rmb();
+        off = head & (LOG_BUF_SIZE - 1);
+        pad = off + size > LOG_BUF_SIZE ? LOG_BUF_SIZE - off : 0;
+        if (head + pad + size - tail > LOG_BUF_SIZE)
+            return NULL;
+    } while (!log_cmpxchg(&log_head, head, head + pad + size));
+
+    /* Records never wrap: skip the tail end of the buffer. */
+    if (pad) {
+        rec = log_record_at(head);
+        rec->size = pad;
+        wmb();
+        rec->flags = LOG_PAD | LOG_COMMITTED;
+    }
+
+    return log_record_at(head + pad);
+}
+
+static inline int log_pending(void)
+{
+    return log_tail != log_head &&
+           (log_record_at(log_tail)->flags & LOG_COMMITTED);
+}
+
+/* Move committed records into log_batch.  Returns the batch length. */
+static int log_fill_batch(void)
+{
+    struct log_record *rec;
+    unsigned long flags;
+    unsigned long dropped;
+    unsigned int size;
+    int len = 0;
+
+    local_irq_save(flags);
+
+    dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_SEQ_CST);
+    if (dropped) {
+        len = snprintf(log_batch, LOG_BATCH_SIZE,
+                       "** %lu printk messages dropped **\n", dropped);
+    }
+
+    while (log_pending()) {
+        rec = log_record_at(log_tail);
+        rmb();
+        if (!(rec->flags & LOG_PAD) && rec->level <= console_loglevel) {
+            if (len + rec->len + 20 > LOG_BATCH_SIZE)
+                break;
+            if (console_timestamps)
+                len += snprintf(log_batch + len, LOG_BATCH_SIZE - len,
+                                "[%5lu.%06lu] ",
+                                (unsigned long)(rec->stamp / 1000000000ULL),
+                                (unsigned long)(rec->stamp % 1000000000ULL) /
+                                1000);
+            memcpy(log_batch + len, rec->text, rec->len);
+            len += rec->len;
+        }
+        /* A later record may start anywhere in here, so none of the old
+         * text may be left to pass for its flags */
+        size = rec->size;
+        memset(rec, 0, size);
+        wmb();
+        log_tail += size;
+    }
+
+    local_irq_restore(flags);
+
+    return len;
+}
+
+static void console_write(char *data, int length)
+{
+#ifndef USE_XEN_CONSOLE
     if(!console_initialised)
-        ring_send_fn = xencons_ring_send_no_notify;
+#endif
+        (void)HYPERVISOR_console_io(CONSOLEIO_write, length, data);
+
+    console_print(NULL, data, length);
+}
+
+static void log_drain(void)
+{
+    int len;
+
+    /* A nested drain (e.g. a crash while draining) would clobber log_batch */
+    if (!log_cmpxchg(&log_draining, 0, 1))
+        return;
+    while ((len = log_fill_batch()) > 0)
+        console_write(log_batch, len);
+    __atomic_store_n(&log_draining, 0, __ATOMIC_SEQ_CST);
+}
+
+void console_flush(void)
+{
+    log_drain();
+    /* We may be crashing in a handler, where the notification is deferred */
+    notify_flush();
+}
+
+static void console_thread(void *p)
+{
+    console_thread_running = 1;
+    for (;;) {
+        wait_event(console_log_queue, log_pending());
+        log_drain();
+    }
+}
+
+void init_console_thread(void)
+{
+    create_thread("console", console_thread, NULL);
+}
+
+/* Before init_console() the backend may not be listening, so output is
+   queued on a best-effort basis.  Afterwards none of it is dropped. */
+static void console_send(struct consfront_dev *dev, const char *data,
+                         unsigned len, int notify)
+{
+    if (!console_initialised)
+        xencons_ring_send_no_notify(dev, data, len);
     else
-        ring_send_fn = xencons_ring_send;
+        xencons_ring_send_wait(dev, data, len, notify);
+}
 
-    copied_ptr = copied_str;
-    memcpy(copied_ptr, data, length);
-    for(curr_char = copied_ptr; curr_char < copied_ptr+length-1; curr_char++)
-    {
-        if(*curr_char == '\n')
-        {
-            *curr_char = '\r';
-            saved_char = *(curr_char+1);
-            *(curr_char+1) = '\n';
-            part_len = curr_char - copied_ptr + 2;
-            ring_send_fn(dev, copied_ptr, part_len);
-            *(curr_char+1) = saved_char;
-            copied_ptr = curr_char+1;
-            length -= part_len - 1;
+void console_print(struct consfront_dev *dev, char *data, int length)
+{
+    char buf[256];
+    int i, n = 0;
+
+    /* Translate \n into \r\n and notify the backend once at the end */
+    for (i = 0; i < length; i++) {
+        if (data[i] == '\n')
+            buf[n++] = '\r';
+        buf[n++] = data[i];
+        if (n >= sizeof(buf) - 1) {
+            console_send(dev, buf, n, 0);
+            n = 0;
         }
     }
 
-    if (copied_ptr[length-1] == '\n') {
-        copied_ptr[length-1] = '\r';
-        copied_ptr[length] = '\n';
-        length++;
+    console_send(dev, buf, n, 1);
+}
+
+static int printk_level(const char **fmt)
+{
+    const char *f = *fmt;
+
+    if (f[0] == '<' && f[1] >= '0' && f[1] <= '7' && f[2] == '>') {
+        *fmt = f + 3;
+        return f[1] - '0';
     }
-    
-    ring_send_fn(dev, copied_ptr, length);
+    return CONSOLE_LOGLEVEL_MESSAGE;
 }
 
 void print(int direct, const char *fmt, va_list args)
 {
-    static char   buf[1024];
-    
-    (void)vsnprintf(buf, sizeof(buf), fmt, args);
+    char buf[LOG_LINE_MAX];
+    struct log_record *rec;
+    unsigned size;
+    int level, len;
+
+    level = printk_level(&fmt);
+    if (level > console_loglevel)
+        return;
+
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    if (len >= sizeof(buf))
+        len = sizeof(buf) - 1;
 
     if(direct)
     {
-        (void)HYPERVISOR_console_io(CONSOLEIO_write, strlen(buf), buf);
+        (void)HYPERVISOR_console_io(CONSOLEIO_write, len, buf);
         return;
-    } else {
-#ifndef USE_XEN_CONSOLE
-    if(!console_initialised)
-#endif    
-            (void)HYPERVISOR_console_io(CONSOLEIO_write, strlen(buf), buf);
-        
-        console_print(NULL, buf, strlen(buf));
     }
+
+    size = (sizeof(*rec) + len + 7) & ~7;
+    rec = log_reserve(size);
+    if (!rec) {
+        if (console_thread_running) {
+            /* A printk from an event handler may interrupt this */
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_SEQ_CST);
+            return;
+        }
+        /* Nothing is draining the log yet, so make room ourselves */
+        log_drain();
+        rec = log_reserve(size);
+        if (!rec) {
+            console_write(buf, len);
+            return;
+        }
+    }
+
+    rec->size = size;
+    rec->len = len;
+    rec->level = level;
+    rec->stamp = NOW();
+    memcpy(rec->text, buf, len);
+    wmb();
+    rec->flags = LOG_COMMITTED;
+
+    if (console_thread_running)
+        wake_up(&console_log_queue);
+    else
+        log_drain();
 }
 
 void printk(const char *fmt, ...)
@@ -81,6 +81,36 @@ int xencons_ring_send_no_notify(struct consfront_dev *dev, const char *data, uns
     return sent;
 }
 
+/* Queue all of data, however little room the ring has: when it fills up,
+ * kick the backend and poll until it has consumed some of the output.
+ * The backend is notified at the end only if notify is set. */
+int xencons_ring_send_wait(struct consfront_dev *dev, const char *data,
+                           unsigned len, int notify)
+{
+    struct xencons_interface *intf;
+    unsigned sent = 0;
+
+    intf = dev ? dev->ring : xencons_interface();
+    if (!intf)
+        return 0;
+
+    for (;;) {
+        sent += xencons_ring_send_no_notify(dev, data + sent, len - sent);
+        if (sent == len)
+            break;
+        notify_daemon(dev);
+        /* The kick may have been deferred by a notify batch */
+        notify_flush();
+        while (intf->out_prod - intf->out_cons >= sizeof(intf->out))
+            HYPERVISOR_sched_op(SCHEDOP_yield, 0);
+    }
+
+    if (notify)
+        notify_daemon(dev);
+
+    return sent;
+}
+
 int xencons_ring_send(struct consfront_dev *dev, const char *data, unsigned len)
 {
     int sent;
@@ -20,22 +20,77 @@
 #include <mini-os/mm.h>
 #include <mini-os/hypervisor.h>
 #include <mini-os/events.h>
+#include <mini-os/time.h>
 #include <mini-os/lib.h>
+#include <mini-os/errno.h>
+#include <mini-os/xmalloc.h>
 #include <xen/xsm/flask_op.h>
 
+/* Ports with a statically allocated action, available from boot */
 #define NR_EVS 1024
 
+#ifdef CONFIG_EVTCHN_FIFO
+#define MAX_EVS EVTCHN_FIFO_NR_CHANNELS
+#else
+#define MAX_EVS EVTCHN_2L_NR_CHANNELS
+#endif
+
+/* Actions of higher ports are allocated in chunks as they are bound */
+#define EVS_PER_CHUNK 256
+
 /* this represents a event handler. Chaining or sharing is not allowed */
 typedef struct _ev_action_t {
 	evtchn_handler_t handler;
 	void *data;
-    uint32_t count;
+    struct evtchn_stats stats;
 } ev_action_t;
 
-static ev_action_t ev_actions[NR_EVS];
+static ev_action_t ev_actions_static[NR_EVS];
+static ev_action_t *ev_actions[MAX_EVS / EVS_PER_CHUNK];
 void default_handler(evtchn_port_t port, struct pt_regs *regs, void *data);
 
-static unsigned long bound_ports[NR_EVS/(8*sizeof(unsigned long))];
+static unsigned long bound_ports[MAX_EVS/(8*sizeof(unsigned long))];
+
+static ev_action_t *ev_action(evtchn_port_t port)
+{
+    ev_action_t *chunk;
+
+    if ( port >= MAX_EVS )
+        return NULL;
+    chunk = ev_actions[port / EVS_PER_CHUNK];
+    return chunk ? &chunk[port % EVS_PER_CHUNK] : NULL;
+}
+
+static void init_ev_actions(ev_action_t *chunk)
+{
+    int i;
+
+    for ( i = 0; i < EVS_PER_CHUNK; i++ )
+    {
+        chunk[i].handler = default_handler;
+        chunk[i].data = NULL;
+        memset(&chunk[i].stats, 0, sizeof(chunk[i].stats));
+    }
+}
+
+/* Like ev_action(), but allocates the action's chunk if needed */
+static ev_action_t *get_ev_action(evtchn_port_t port)
+{
+    ev_action_t *chunk;
+
+    if ( port >= MAX_EVS )
+        return NULL;
+    if ( !ev_actions[port / EVS_PER_CHUNK] )
+    {
+        chunk = xmalloc_array(ev_action_t, EVS_PER_CHUNK);
+        if ( !chunk )
+            return NULL;
+        init_ev_actions(chunk);
+        wmb();
+        ev_actions[port / EVS_PER_CHUNK] = chunk;
+    }
+    return ev_action(port);
+}
 
 void unbind_all_ports(void)
 {
@@ -44,7 +99,7 @@ void unbind_all_ports(void)
     shared_info_t *s = HYPERVISOR_shared_info;
     vcpu_info_t   *vcpu_info = &s->vcpu_info[cpu];
 
-    for ( i = 0; i < NR_EVS; i++ )
+    for ( i = 0; i < MAX_EVS; i++ )
     {
         if ( i == console_evtchn || i == xenbus_evtchn )
             continue;
@@ -65,35 +120,61 @@ void unbind_all_ports(void)
 int do_event(evtchn_port_t port, struct pt_regs *regs)
 {
     ev_action_t  *action;
+    s_time_t      start, time;
 
     clear_evtchn(port);
 
-    if ( port >= NR_EVS )
+    action = ev_action(port);
+    if ( !action )
     {
         printk("WARN: do_event(): Port number too large: %d\n", port);
         return 1;
     }
 
-    action = &ev_actions[port];
-    action->count++;
-
+    start = NOW();
     /* call the handler */
 	action->handler(port, regs, action->data);
+    time = NOW() - start;
+
+    action->stats.events++;
+    action->stats.time_total += time;
+    if ( time > action->stats.time_max )
+        action->stats.time_max = time;
 
     return 1;
 
 }
 
+static int close_port(evtchn_port_t port)
+{
+    struct evtchn_close close;
+
+    close.port = port;
+    return HYPERVISOR_event_channel_op(EVTCHNOP_close, &close);
+}
+
+/* Returns port, or -1 if no handler could be set up for it */
 evtchn_port_t bind_evtchn(evtchn_port_t port, evtchn_handler_t handler,
 						  void *data)
 {
- 	if ( ev_actions[port].handler != default_handler )
+    ev_action_t *action = get_ev_action(port);
+
+    if ( !action )
+    {
+        printk("ERROR: no room for a handler for port %d\n", port);
+        return -1;
+    }
+#ifdef CONFIG_EVTCHN_FIFO
+    if ( evtchn_fifo && evtchn_fifo_setup(port) )
+        return -1;
+#endif
+ 	if ( action->handler != default_handler )
         printk("WARN: Handler for port %d already registered, replacing\n",
                port);
 
-	ev_actions[port].data = data;
+	action->data = data;
 	wmb();
-	ev_actions[port].handler = handler;
+	action->handler = handler;
 	set_bit(port, bound_ports);
 
 	return port;
@@ -101,21 +182,23 @@ evtchn_port_t bind_evtchn(evtchn_port_t port, evtchn_handler_t handler,
 
 void unbind_evtchn(evtchn_port_t port )
 {
-    struct evtchn_close close;
+    ev_action_t *action = ev_action(port);
     int rc;
 
-    if ( ev_actions[port].handler == default_handler )
+    if ( !action || action->handler == default_handler )
         printk("WARN: No handler for port %d when unbinding\n", port);
     mask_evtchn(port);
     clear_evtchn(port);
 
-    ev_actions[port].handler = default_handler;
-    wmb();
-    ev_actions[port].data = NULL;
+    if ( action )
+    {
+        action->handler = default_handler;
+        wmb();
+        action->data = NULL;
+    }
     clear_bit(port, bound_ports);
 
-    close.port = port;
-    rc = HYPERVISOR_event_channel_op(EVTCHNOP_close, &close);
+    rc = close_port(port);
     if ( rc )
         printk("WARN: close_port %d failed rc=%d. ignored\n", port, rc);
 }
@@ -135,7 +218,11 @@ evtchn_port_t bind_virq(uint32_t virq, evtchn_handler_t handler, void *data)
 		printk("Failed to bind virtual IRQ %d with rc=%d\n", virq, rc);
 		return -1;
     }
-    bind_evtchn(op.port, handler, data);
+    if ( bind_evtchn(op.port, handler, data) == (evtchn_port_t)-1 )
+    {
+        close_port(op.port);
+        return -1;
+    }
 	return op.port;
 }
 
@@ -154,7 +241,11 @@ evtchn_port_t bind_pirq(uint32_t pirq, int will_share,
 		printk("Failed to bind physical IRQ %d with rc=%d\n", pirq, rc);
 		return -1;
 	}
-	bind_evtchn(op.port, handler, data);
+    if ( bind_evtchn(op.port, handler, data) == (evtchn_port_t)-1 )
+    {
+        close_port(op.port);
+        return -1;
+    }
 	return op.port;
 }
 
@@ -166,11 +257,13 @@ void init_events(void)
     int i;
 
     /* initialize event handler */
-    for ( i = 0; i < NR_EVS; i++ )
-	{
-        ev_actions[i].handler = default_handler;
-        mask_evtchn(i);
+    for ( i = 0; i < NR_EVS / EVS_PER_CHUNK; i++ )
+    {
+        ev_actions[i] = &ev_actions_static[i * EVS_PER_CHUNK];
+        init_ev_actions(ev_actions[i]);
     }
+    for ( i = 0; i < EVTCHN_2L_NR_CHANNELS; i++ )
+        mask_evtchn(i);
 
     arch_init_events();
 }
@@ -183,13 +276,190 @@ void fini_events(void)
     arch_fini_events();
 }
 
+int evtchn_get_stats(evtchn_port_t port, struct evtchn_stats *stats)
+{
+    ev_action_t *action = ev_action(port);
+
+    if ( !action )
+        return -EINVAL;
+    *stats = action->stats;
+    return 0;
+}
+
+/* Ports awaiting notification, each once, sent when the batch ends */
+static evtchn_port_t notify_pending[NOTIFY_BATCH_MAX];
+static unsigned int notify_nr_pending;
+static unsigned int notify_batch_depth;
+static struct notify_stats notify_stats;
+#ifdef CONFIG_PARAVIRT
+static multicall_entry_t notify_call[NOTIFY_BATCH_MAX];
+static evtchn_send_t notify_op[NOTIFY_BATCH_MAX];
+#endif
+
+static int notify_send(evtchn_port_t port)
+{
+    evtchn_send_t op;
+
+    op.port = port;
+    notify_stats.sends++;
+    notify_stats.hypercalls++;
+    return HYPERVISOR_event_channel_op(EVTCHNOP_send, &op);
+}
+
+/* Called with interrupts disabled */
+static void notify_flush_pending(void)
+{
+    unsigned int i, n = notify_nr_pending;
+#ifdef CONFIG_PARAVIRT
+    int rc;
+#endif
+
+    notify_nr_pending = 0;
+    if ( n == 1 )
+        notify_send(notify_pending[0]);
+    if ( n <= 1 )
+        return;
+
+#ifdef CONFIG_PARAVIRT
+    for ( i = 0; i < n; i++ )
+    {
+        notify_op[i].port = notify_pending[i];
+        notify_call[i].op = __HYPERVISOR_event_channel_op;
+        notify_call[i].args[0] = EVTCHNOP_send;
+        notify_call[i].args[1] = (unsigned long)&notify_op[i];
+    }
+    notify_stats.sends += n;
+    notify_stats.hypercalls++;
+    rc = HYPERVISOR_multicall(notify_call, n);
+    if ( rc )
+        printk("WARN: notify multicall failed, rc=%d\n", rc);
+#else
+    for ( i = 0; i < n; i++ )
+        notify_send(notify_pending[i]);
+#endif
+}
+
+int notify_remote_via_evtchn(evtchn_port_t port)
+{
+    unsigned long flags;
+    unsigned int i;
+
+    local_irq_save(flags);
+    notify_stats.requests++;
+    if ( !notify_batch_depth )
+    {
+        local_irq_restore(flags);
+        return notify_send(port);
+    }
+
+    for ( i = 0; i < notify_nr_pending; i++ )
+        if ( notify_pending[i] == port )
+            goto out;
+    if ( notify_nr_pending == NOTIFY_BATCH_MAX )
+        notify_flush_pending();
+    notify_pending[notify_nr_pending++] = port;
+out:
+    local_irq_restore(flags);
+    return 0;
+}
+
+void notify_batch_begin(void)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    notify_batch_depth++;
+    local_irq_restore(flags);
+}
+
+void notify_batch_end(void)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if ( --notify_batch_depth == 0 )
+        notify_flush_pending();
+    local_irq_restore(flags);
+}
+
+void notify_flush(void)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    notify_flush_pending();
+    local_irq_restore(flags);
+}
+
+void notify_get_stats(struct notify_stats *stats)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    *stats = notify_stats;
+    local_irq_restore(flags);
+}
+
+void evtchn_dump_stats(void)
+{
+    struct notify_stats ns;
+    ev_action_t *action;
+    struct evtchn_stats *st;
+    uint64_t events = 0;
+    evtchn_port_t port;
+
+    for ( port = 0; port < MAX_EVS; port++ )
+        if ( (action = ev_action(port)) )
+            events += action->stats.events;
+
+    printk("events: %lu upcalls, %llu events, %llu.%02llu per upcall\n",
+           evtchn_upcalls, (unsigned long long)events,
+           (unsigned long long)(evtchn_upcalls ? events / evtchn_upcalls : 0),
+           (unsigned long long)(evtchn_upcalls ?
+                                events * 100 / evtchn_upcalls % 100 : 0));
+    for ( port = 0; port < MAX_EVS; port++ )
+    {
+        action = ev_action(port);
+        if ( !action || !action->stats.events )
+            continue;
+        st = &action->stats;
+        printk("  port %u: %llu events (%llu%%), handler avg %llu max %llu us\n",
+               port, (unsigned long long)st->events,
+               (unsigned long long)(st->events * 100 / events),
+               (unsigned long long)NSEC_TO_USEC(st->time_total / st->events),
+               (unsigned long long)NSEC_TO_USEC(st->time_max));
+    }
+
+    notify_get_stats(&ns);
+    printk("notify: %llu requests, %llu sends, %llu hypercalls, %llu saved\n",
+           (unsigned long long)ns.requests, (unsigned long long)ns.sends,
+           (unsigned long long)ns.hypercalls,
+           (unsigned long long)(ns.requests - ns.hypercalls));
+}
+
+int evtchn_set_priority(evtchn_port_t port, unsigned int priority)
+{
+#ifdef CONFIG_EVTCHN_FIFO
+    evtchn_set_priority_t op;
+
+    if ( evtchn_fifo )
+    {
+        op.port = port;
+        op.priority = priority;
+        return HYPERVISOR_event_channel_op(EVTCHNOP_set_priority, &op);
+    }
+#endif
+    return -ENOSYS;
+}
+
 void default_handler(evtchn_port_t port, struct pt_regs *regs, void *ignore)
 {
     printk("[Port %d] - event received\n", port);
 }
 
 /* Create a port available to the pal for exchanging notifications.
-   Returns the result of the hypervisor call. */
+   Returns the result of the hypervisor call, or -ENOMEM if no handler
+   could be bound to the new port. */
 
 /* Unfortunate confusion of terminology: the port is unbound as far
    as Xen is concerned, but we automatically bind a handler to it
@@ -210,11 +480,17 @@ int evtchn_alloc_unbound(domid_t pal, evtchn_handler_t handler,
 		return rc;
     }
     *port = bind_evtchn(op.port, handler, data);
+    if ( *port == (evtchn_port_t)-1 )
+    {
+        close_port(op.port);
+        return -ENOMEM;
+    }
     return rc;
 }
 
 /* Connect to a port so as to allow the exchange of notifications with
-   the pal. Returns the result of the hypervisor call. */
+   the pal. Returns the result of the hypervisor call, or -ENOMEM if no
+   handler could be bound to the local port. */
 
 int evtchn_bind_interdomain(domid_t pal, evtchn_port_t remote_port,
 			    evtchn_handler_t handler, void *data,
@@ -233,6 +509,11 @@ int evtchn_bind_interdomain(domid_t pal, evtchn_port_t remote_port,
     }
     port = op.local_port;
     *local_port = bind_evtchn(port, handler, data);
+    if ( *local_port == (evtchn_port_t)-1 )
+    {
+        close_port(port);
+        return -ENOMEM;
+    }
     return rc;
 }
 
@@ -0,0 +1,215 @@
+/* -*-  Mode:C; c-basic-offset:4; tab-width:4 -*-
+ *
+ * FIFO event channel ABI
+ *
+ * Instead of the 2-level pending bitmap, Xen links pending ports into one
+ * of 16 queues by priority, using the link bits of per-port event words.
+ * The event words live in pages we hand to Xen as ports are bound, so the
+ * number of ports is only limited by EVTCHN_FIFO_NR_CHANNELS, and the
+ * upcall always serves the highest priority queue first, in FIFO order
+ * within a queue, rather than scanning from port 0.
+ *
+ * Only vCPU 0 is used, so there is a single control block.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/mm.h>
+#include <mini-os/hypervisor.h>
+#include <mini-os/events.h>
+#include <mini-os/errno.h>
+#include <mini-os/lib.h>
+
+#define EVENT_WORDS_PER_PAGE (PAGE_SIZE / sizeof(event_word_t))
+#define MAX_EVENT_ARRAY_PAGES (EVTCHN_FIFO_NR_CHANNELS / EVENT_WORDS_PER_PAGE)
+
+int evtchn_fifo;
+
+static evtchn_fifo_control_block_t *control_block;
+static event_word_t *event_array[MAX_EVENT_ARRAY_PAGES];
+static unsigned int event_array_pages;
+/* Where we got to in each queue, 0 once we reached its tail */
+static uint32_t queue_head[EVTCHN_FIFO_MAX_QUEUES];
+
+static inline int port_covered(evtchn_port_t port)
+{
+    return port < event_array_pages * EVENT_WORDS_PER_PAGE;
+}
+
+static inline volatile event_word_t *event_word(evtchn_port_t port)
+{
+    return event_array[port / EVENT_WORDS_PER_PAGE] +
+           port % EVENT_WORDS_PER_PAGE;
+}
+
+static int expand_event_array(void)
+{
+    evtchn_expand_array_t op;
+    event_word_t *page;
+    unsigned int i;
+    int rc;
+
+    if (event_array_pages == MAX_EVENT_ARRAY_PAGES)
+        return -ENOSPC;
+    page = (event_word_t *)alloc_page();
+    if (!page)
+        return -ENOMEM;
+    /* Ports start out masked, as they do with the 2-level ABI */
+    for (i = 0; i < EVENT_WORDS_PER_PAGE; i++)
+        page[i] = 1U << EVTCHN_FIFO_MASKED;
+
+    op.array_gfn = virt_to_mfn(page);
+    rc = HYPERVISOR_event_channel_op(EVTCHNOP_expand_array, &op);
+    if (rc) {
+        free_page(page);
+        return rc;
+    }
+    event_array[event_array_pages++] = page;
+    return 0;
+}
+
+int evtchn_fifo_setup(evtchn_port_t port)
+{
+    int rc;
+
+    while (!port_covered(port)) {
+        if ((rc = expand_event_array())) {
+            printk("ERROR: no event word for port %u, rc=%d\n", port, rc);
+            return rc;
+        }
+    }
+    return 0;
+}
+
+void init_evtchn_fifo(void)
+{
+    evtchn_init_control_t init;
+    int rc;
+
+    control_block = (evtchn_fifo_control_block_t *)alloc_page();
+    memset(control_block, 0, PAGE_SIZE);
+
+    init.control_gfn = virt_to_mfn(control_block);
+    init.offset = 0;
+    init.vcpu = 0;
+    rc = HYPERVISOR_event_channel_op(EVTCHNOP_init_control, &init);
+    if (rc) {
+        printk("FIFO event channels unavailable (rc=%d), using 2-level\n", rc);
+        free_page(control_block);
+        control_block = NULL;
+        return;
+    }
+    evtchn_fifo = 1;
+    BUG_ON(evtchn_fifo_setup(0));
+    printk("Using FIFO event channels, %u link bits\n", init.link_bits);
+}
+
+void evtchn_fifo_mask(evtchn_port_t port)
+{
+    if (port_covered(port))
+        synch_set_bit(EVTCHN_FIFO_MASKED, event_word(port));
+}
+
+void evtchn_fifo_unmask(evtchn_port_t port)
+{
+    volatile event_word_t *word;
+    evtchn_unmask_t op;
+
+    if (!port_covered(port))
+        return;
+    word = event_word(port);
+    synch_clear_bit(EVTCHN_FIFO_MASKED, word);
+    /* Xen links a port that became pending while masked on unmask */
+    if (synch_test_bit(EVTCHN_FIFO_PENDING, word)) {
+        op.port = port;
+        HYPERVISOR_event_channel_op(EVTCHNOP_unmask, &op);
+    }
+}
+
+void evtchn_fifo_clear(evtchn_port_t port)
+{
+    if (port_covered(port))
+        synch_clear_bit(EVTCHN_FIFO_PENDING, event_word(port));
+}
+
+/* Take the port off the queue, returning the next port in it or 0 */
+static evtchn_port_t clear_linked(volatile event_word_t *word)
+{
+    event_word_t new, old, w;
+
+    w = *word;
+    do {
+        old = w;
+        new = w & ~((1U << EVTCHN_FIFO_LINKED) | EVTCHN_FIFO_LINK_MASK);
+    } while ((w = synch_cmpxchg(word, old, new)) != old);
+
+    return w & EVTCHN_FIFO_LINK_MASK;
+}
+
+static void consume_one_event(unsigned int q, uint32_t *ready,
+                              struct pt_regs *regs)
+{
+    evtchn_port_t port, head = queue_head[q];
+    volatile event_word_t *word;
+
+    /* Reached the tail last time, so pick up the queue anew */
+    if (head == 0) {
+        rmb();
+        head = control_block->head[q];
+    }
+
+    port = head;
+    if (!port_covered(port)) {
+        printk("WARN: FIFO queue %u links unknown port %u\n", q, port);
+        queue_head[q] = 0;
+        *ready &= ~(1U << q);
+        return;
+    }
+    word = event_word(port);
+    head = clear_linked(word);
+    if (head == 0)
+        *ready &= ~(1U << q);
+
+    if (synch_test_bit(EVTCHN_FIFO_PENDING, word) &&
+        !synch_test_bit(EVTCHN_FIFO_MASKED, word))
+        do_event(port, regs);
+
+    queue_head[q] = head;
+}
+
+/* One event at a time from the highest priority ready queue, so a newly
+ * ready urgent queue overtakes the rest at the next event */
+void evtchn_fifo_handle_events(struct pt_regs *regs, unsigned int budget)
+{
+    vcpu_info_t *vcpu_info = &HYPERVISOR_shared_info->vcpu_info[0];
+    uint32_t ready;
+    unsigned int q;
+
+    ready = xchg(&control_block->ready, 0);
+    while (ready) {
+        consume_one_event(__ffs(ready), &ready, regs);
+        ready |= xchg(&control_block->ready, 0);
+        if (ready && --budget == 0)
+            break;
+    }
+    if (!ready)
+        return;
+
+    /* Out of budget: queue_head[] remembers where each queue got to, and
+     * the upcall is raised again as soon as we return */
+    while (ready) {
+        q = __ffs(ready);
+        ready &= ~(1U << q);
+        synch_set_bit(q, &control_block->ready);
+    }
+    vcpu_info->evtchn_upcall_pending = 1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -14,6 +14,7 @@
 #include <mini-os/xmalloc.h>
 #include <mini-os/fbfront.h>
 #include <mini-os/lib.h>
+#include <mini-os/sched.h>
 
 DECLARE_WAIT_QUEUE_HEAD(kbdfront_queue);
 
@@ -318,6 +319,17 @@ DECLARE_WAIT_QUEUE_HEAD(fbfront_queue);
 
 
 
+/* Damage rectangles kept before they are merged together */
+#define FBFRONT_DAMAGE_RECTS 8
+/* Damage covering more than 1/FBFRONT_DAMAGE_FULL of the screen becomes
+ * one full screen update */
+#define FBFRONT_DAMAGE_FULL 2
+#define FBFRONT_DEFAULT_FPS 60
+
+struct fbfront_rect {
+    int x1, y1, x2, y2;         /* x2 and y2 are exclusive */
+};
+
 struct fbfront_dev {
     domid_t dom;
 
@@ -328,6 +340,16 @@ struct fbfront_dev {
     char *backend;
     int request_update;
 
+    /* Damage not sent to the backend yet, flushed by the flusher thread
+     * at most every flush_interval */
+    struct fbfront_rect damage[FBFRONT_DAMAGE_RECTS];
+    int nr_damage;
+    s_time_t flush_interval;
+    s_time_t next_flush;
+    struct thread *flusher;
+    int closing;
+    struct wait_queue_head damage_queue;
+
     int width;
     int height;
     int depth;
@@ -404,6 +426,8 @@ int fbfront_receive(struct fbfront_dev *dev, union xenfb_in_event *buf, int n)
     return i;
 }
 
+static void fbfront_flusher(void *p);
+
 struct fbfront_dev *init_fbfront(char *_nodename, unsigned long *mfns, int width, int height, int depth, int stride, int n)
 {
     xenbus_transaction_t xbt;
@@ -428,6 +452,8 @@ struct fbfront_dev *init_fbfront(char *_nodename, unsigned long *mfns, int width
 #ifdef HAVE_LIBC
     dev->fd = -1;
 #endif
+    dev->flush_interval = SECONDS(1) / FBFRONT_DEFAULT_FPS;
+    init_waitqueue_head(&dev->damage_queue);
 
     snprintf(path, sizeof(path), "%s/backend-id", nodename);
     dev->dom = xenbus_read_integer(path); 
@@ -559,6 +585,8 @@ done:
     }
     unmask_evtchn(dev->evtchn);
 
+    dev->flusher = create_thread("fbfront-flush", fbfront_flusher, dev);
+
     printk("************************** FBFRONT\n");
 
     return dev;
@@ -589,9 +617,117 @@ static void fbfront_out_event(struct fbfront_dev *dev, union xenfb_out_event *ev
     notify_remote_via_evtchn(dev->evtchn);
 }
 
-void fbfront_update(struct fbfront_dev *dev, int x, int y, int width, int height)
+static int rect_area(const struct fbfront_rect *r)
 {
+    return (r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static void rect_union(struct fbfront_rect *r, const struct fbfront_rect *o)
+{
+    if (o->x1 < r->x1) r->x1 = o->x1;
+    if (o->y1 < r->y1) r->y1 = o->y1;
+    if (o->x2 > r->x2) r->x2 = o->x2;
+    if (o->y2 > r->y2) r->y2 = o->y2;
+}
+
+/* Whether the rectangles overlap or share an edge */
+static int rect_touch(const struct fbfront_rect *a, const struct fbfront_rect *b)
+{
+    return a->x1 <= b->x2 && b->x1 <= a->x2 && a->y1 <= b->y2 && b->y1 <= a->y2;
+}
+
+static void fbfront_add_damage(struct fbfront_dev *dev, struct fbfront_rect *r)
+{
+    struct fbfront_rect u;
+    int i, best = 0, best_cost = -1, cost, area = 0;
+
+    /* Merge with whatever it touches, and again with whatever the union
+     * now touches */
+    for (i = 0; i < dev->nr_damage; ) {
+        if (rect_touch(&dev->damage[i], r)) {
+            rect_union(r, &dev->damage[i]);
+            dev->damage[i] = dev->damage[--dev->nr_damage];
+            i = 0;
+        } else
+            i++;
+    }
+
+    if (dev->nr_damage == FBFRONT_DAMAGE_RECTS) {
+        /* No room left, merge into the rectangle which grows the least */
+        for (i = 0; i < dev->nr_damage; i++) {
+            u = dev->damage[i];
+            rect_union(&u, r);
+            cost = rect_area(&u) - rect_area(&dev->damage[i]);
+            if (best_cost < 0 || cost < best_cost) {
+                best = i;
+                best_cost = cost;
+            }
+        }
+        rect_union(r, &dev->damage[best]);
+        dev->damage[best] = dev->damage[--dev->nr_damage];
+    }
+    dev->damage[dev->nr_damage++] = *r;
+
+    for (i = 0; i < dev->nr_damage; i++)
+        area += rect_area(&dev->damage[i]);
+    if (area * FBFRONT_DAMAGE_FULL > dev->width * dev->height) {
+        dev->damage[0].x1 = dev->damage[0].y1 = 0;
+        dev->damage[0].x2 = dev->width;
+        dev->damage[0].y2 = dev->height;
+        dev->nr_damage = 1;
+    }
+}
+
+void fbfront_flush(struct fbfront_dev *dev)
+{
+    struct fbfront_rect damage[FBFRONT_DAMAGE_RECTS];
     struct xenfb_update update;
+    int i, n;
+
+    /* Sending may block on the ring, take the damage first */
+    n = dev->nr_damage;
+    memcpy(damage, dev->damage, n * sizeof(*damage));
+    dev->nr_damage = 0;
+    dev->next_flush = NOW() + dev->flush_interval;
+
+    for (i = 0; i < n; i++) {
+        update.type = XENFB_TYPE_UPDATE;
+        update.x = damage[i].x1;
+        update.y = damage[i].y1;
+        update.width = damage[i].x2 - damage[i].x1;
+        update.height = damage[i].y2 - damage[i].y1;
+        fbfront_out_event(dev, (union xenfb_out_event *) &update);
+    }
+}
+
+static void fbfront_flusher(void *p)
+{
+    struct fbfront_dev *dev = p;
+
+    while (1) {
+        wait_event(dev->damage_queue, dev->nr_damage || dev->closing);
+        if (dev->closing)
+            break;
+        if (NOW() < dev->next_flush) {
+            wait_event_deadline(dev->damage_queue, dev->closing, dev->next_flush);
+            continue;
+        }
+        fbfront_flush(dev);
+    }
+
+    dev->flusher = NULL;
+    wake_up(&dev->damage_queue);
+}
+
+void fbfront_set_frame_rate(struct fbfront_dev *dev, int fps)
+{
+    dev->flush_interval = fps > 0 ? SECONDS(1) / fps : 0;
+    dev->next_flush = NOW() + dev->flush_interval;
+}
+
+void fbfront_update(struct fbfront_dev *dev, int x, int y, int width, int height)
+{
+    struct fbfront_rect r;
 
     if (dev->request_update <= 0)
         return;
@@ -613,18 +749,25 @@ void fbfront_update(struct fbfront_dev *dev, int x, int y, int width, int height
     if (width <= 0 || height <= 0)
         return;
 
-    update.type = XENFB_TYPE_UPDATE;
-    update.x = x;
-    update.y = y;
-    update.width = width;
-    update.height = height;
-    fbfront_out_event(dev, (union xenfb_out_event *) &update);
+    r.x1 = x;
+    r.y1 = y;
+    r.x2 = x + width;
+    r.y2 = y + height;
+    fbfront_add_damage(dev, &r);
+
+    if (!dev->flush_interval)
+        fbfront_flush(dev);
+    else if (dev->nr_damage == 1)
+        wake_up(&dev->damage_queue);
 }
 
 void fbfront_resize(struct fbfront_dev *dev, int width, int height, int stride, int depth, int offset)
 {
     struct xenfb_resize resize;
 
+    /* Pending damage is in the old geometry */
+    fbfront_flush(dev);
+
     resize.type = XENFB_TYPE_RESIZE;
     dev->width  = resize.width = width;
     dev->height = resize.height = height;
@@ -644,6 +787,11 @@ void shutdown_fbfront(struct fbfront_dev *dev)
 
     printk("close fb: backend at %s\n",dev->backend);
 
+    fbfront_flush(dev);
+    dev->closing = 1;
+    wake_up(&dev->damage_queue);
+    wait_event(dev->damage_queue, dev->flusher == NULL);
+
     snprintf(path, sizeof(path), "%s/state", dev->backend);
     snprintf(nodename, sizeof(nodename), "%s/state", dev->nodename);
     if ((err = xenbus_switch_state(XBT_NIL, nodename, XenbusStateClosing)) != NULL) {
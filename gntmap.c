@@ -7,8 +7,9 @@
  * (host address, grant handle) pairs. Grant handles come from a hypervisor map
  * operation and are needed for the corresponding unmap.
  *
- * This is a rather naive implementation in terms of performance. If we start
- * using it frequently, there's definitely some low-hanging fruit here.
+ * Entries are found by address through hash chains, free entries are kept
+ * on a list and the table doubles in size when it fills up. Maps and unmaps
+ * are issued to the hypervisor in batches of GNTMAP_BATCH.
  *
  *
  * Permission is hereby granted, free of charge, to any person obtaining a copy
@@ -47,11 +48,16 @@
 #endif
 
 
-#define DEFAULT_MAX_GRANTS 128
+/* Entries allocated when a map is first used, the table doubles from there */
+#define DEFAULT_NR_GRANTS 128
+
+/* Grant operations issued per hypercall */
+#define GNTMAP_BATCH 32
 
 struct gntmap_entry {
     unsigned long host_addr;
     grant_handle_t handle;
+    int next;       /* Next entry in the hash chain or in the free list */
 };
 
 static inline int
@@ -60,19 +66,81 @@ gntmap_entry_used(struct gntmap_entry *entry)
     return entry->host_addr != 0;
 }
 
+static inline int
+gntmap_hash(struct gntmap *map, unsigned long addr)
+{
+    /* nentries is not a power of two once capped at max_entries */
+    return (addr >> PAGE_SHIFT) % map->nentries;
+}
+
+/* Resize the entry table to count entries and rebuild the hash chains
+ * and free list around the entries in use */
+static int
+gntmap_resize(struct gntmap *map, int count)
+{
+    struct gntmap_entry *entries;
+    int *buckets;
+    int i, h;
+
+    entries = realloc(map->entries, count * sizeof(*entries));
+    if (entries == NULL)
+        return -ENOMEM;
+    map->entries = entries;
+    memset(entries + map->nentries, 0,
+           (count - map->nentries) * sizeof(*entries));
+
+    buckets = realloc(map->buckets, count * sizeof(*buckets));
+    if (buckets == NULL)
+        return -ENOMEM;
+    map->buckets = buckets;
+    map->nentries = count;
+
+    for (i = 0; i < count; i++)
+        buckets[i] = -1;
+    map->free = -1;
+    for (i = count - 1; i >= 0; i--) {
+        if (gntmap_entry_used(&entries[i])) {
+            h = gntmap_hash(map, entries[i].host_addr);
+            entries[i].next = buckets[h];
+            buckets[h] = i;
+        } else {
+            entries[i].next = map->free;
+            map->free = i;
+        }
+    }
+    return 0;
+}
+
 static struct gntmap_entry*
 gntmap_find_free_entry(struct gntmap *map)
 {
-    int i;
-
-    for (i = 0; i < map->nentries; i++) {
-        if (!gntmap_entry_used(&map->entries[i]))
-            return &map->entries[i];
+    int count;
+
+    if (map->nused == map->nentries) {
+        count = map->nentries ? map->nentries * 2 : DEFAULT_NR_GRANTS;
+        if (map->max_entries && count > map->max_entries)
+            count = map->max_entries;
+        if (count <= map->nentries || gntmap_resize(map, count)) {
+            DEBUG("(map=%p): all %d entries full",
+                   map, map->nentries);
+            return NULL;
+        }
     }
 
-    DEBUG("(map=%p): all %d entries full",
-           map, map->nentries);
-    return NULL;
+    return &map->entries[map->free];
+}
+
+/* Take the entry returned by gntmap_find_free_entry() once it is mapped */
+static void
+gntmap_entry_insert(struct gntmap *map, struct gntmap_entry *entry)
+{
+    int i = entry - map->entries;
+    int h = gntmap_hash(map, entry->host_addr);
+
+    map->free = entry->next;
+    entry->next = map->buckets[h];
+    map->buckets[h] = i;
+    map->nused++;
 }
 
 static struct gntmap_entry*
@@ -80,104 +148,98 @@ gntmap_find_entry(struct gntmap *map, unsigned long addr)
 {
     int i;
 
-    for (i = 0; i < map->nentries; i++) {
+    if (map->nentries == 0)
+        return NULL;
+
+    for (i = map->buckets[gntmap_hash(map, addr)]; i >= 0; i = map->entries[i].next) {
         if (map->entries[i].host_addr == addr)
             return &map->entries[i];
     }
     return NULL;
 }
 
+static void
+gntmap_entry_remove(struct gntmap *map, struct gntmap_entry *entry)
+{
+    int i = entry - map->entries;
+    int *p;
+
+    for (p = &map->buckets[gntmap_hash(map, entry->host_addr)]; *p != i;
+         p = &map->entries[*p].next)
+        ;
+    *p = entry->next;
+
+    entry->host_addr = 0;
+    entry->next = map->free;
+    map->free = i;
+    map->nused--;
+}
+
 int
 gntmap_set_max_grants(struct gntmap *map, int count)
 {
     DEBUG("(map=%p, count=%d)", map, count);
 
-    if (map->nentries != 0)
+    if (map->nentries > count)
         return -EBUSY;
 
-    map->entries = xmalloc_array(struct gntmap_entry, count);
-    if (map->entries == NULL)
-        return -ENOMEM;
-
-    memset(map->entries, 0, sizeof(struct gntmap_entry) * count);
-    map->nentries = count;
+    map->max_entries = count;
     return 0;
 }
 
+/* Unmap count pages starting at start_address, which must all be mapped */
 static int
-_gntmap_map_grant_ref(struct gntmap_entry *entry, 
-                      unsigned long host_addr,
-                      uint32_t domid,
-                      uint32_t ref,
-                      int writable)
+_gntmap_unmap_grant_refs(struct gntmap *map, unsigned long start_address, int count)
 {
-    struct gnttab_map_grant_ref op;
-    int rc;
-
-    op.ref = (grant_ref_t) ref;
-    op.dom = (domid_t) domid;
-    op.host_addr = (uint64_t) host_addr;
-    op.flags = GNTMAP_host_map;
-    if (!writable)
-        op.flags |= GNTMAP_readonly;
-
-    rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &op, 1);
-    if (rc != 0 || op.status != GNTST_okay) {
-        printk("GNTTABOP_map_grant_ref failed: "
-               "returned %d, status %" PRId16 "\n",
-               rc, op.status);
-        return rc != 0 ? rc : op.status;
-    }
+    struct gnttab_unmap_grant_ref op[GNTMAP_BATCH];
+    struct gntmap_entry *ent[GNTMAP_BATCH];
+    int i, n, rc, ret = 0;
+
+    while (count > 0) {
+        n = count < GNTMAP_BATCH ? count : GNTMAP_BATCH;
+        for (i = 0; i < n; i++) {
+            ent[i] = gntmap_find_entry(map, start_address + PAGE_SIZE * i);
+            op[i].host_addr    = (uint64_t) ent[i]->host_addr;
+            op[i].dev_bus_addr = 0;
+            op[i].handle       = ent[i]->handle;
+        }
 
-    entry->host_addr = host_addr;
-    entry->handle = op.handle;
-    return 0;
-}
+        rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, op, n);
+        for (i = 0; i < n; i++) {
+            if (rc != 0 || op[i].status != GNTST_okay) {
+                printk("GNTTABOP_unmap_grant_ref failed: "
+                       "returned %d, status %" PRId16 "\n",
+                       rc, op[i].status);
+                if (!ret)
+                    ret = rc != 0 ? rc : op[i].status;
+                continue;
+            }
+            gntmap_entry_remove(map, ent[i]);
+        }
 
-static int
-_gntmap_unmap_grant_ref(struct gntmap_entry *entry)
-{
-    struct gnttab_unmap_grant_ref op;
-    int rc;
-
-    op.host_addr    = (uint64_t) entry->host_addr;
-    op.dev_bus_addr = 0;
-    op.handle       = entry->handle;
-
-    rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &op, 1);
-    if (rc != 0 || op.status != GNTST_okay) {
-        printk("GNTTABOP_unmap_grant_ref failed: "
-               "returned %d, status %" PRId16 "\n",
-               rc, op.status);
-        return rc != 0 ? rc : op.status;
+        start_address += PAGE_SIZE * n;
+        count -= n;
     }
 
-    entry->host_addr = 0;
-    return 0;
+    return ret;
 }
 
 int
 gntmap_munmap(struct gntmap *map, unsigned long start_address, int count)
 {
-    int i, rc;
-    struct gntmap_entry *ent;
+    int i;
 
     DEBUG("(map=%p, start_address=%lx, count=%d)",
            map, start_address, count);
 
     for (i = 0; i < count; i++) {
-        ent = gntmap_find_entry(map, start_address + PAGE_SIZE * i);
-        if (ent == NULL) {
+        if (gntmap_find_entry(map, start_address + PAGE_SIZE * i) == NULL) {
             printk("gntmap: tried to munmap unknown page\n");
             return -EINVAL;
         }
-
-        rc = _gntmap_unmap_grant_ref(ent);
-        if (rc != 0)
-            return rc;
     }
 
-    return 0;
+    return _gntmap_unmap_grant_refs(map, start_address, count);
 }
 
 void*
@@ -188,9 +250,10 @@ gntmap_map_grant_refs(struct gntmap *map,
                       uint32_t *refs,
                       int writable)
 {
+    struct gnttab_map_grant_ref op[GNTMAP_BATCH];
     unsigned long addr;
     struct gntmap_entry *ent;
-    int i;
+    int i, n, done, rc, failed;
 
     DEBUG("(map=%p, count=%" PRIu32 ", "
            "domids=%p [%" PRIu32 "...], domids_stride=%d, "
@@ -199,22 +262,56 @@ gntmap_map_grant_refs(struct gntmap *map,
            domids, domids == NULL ? 0 : domids[0], domids_stride,
            refs, refs == NULL ? 0 : refs[0], writable);
 
-    (void) gntmap_set_max_grants(map, DEFAULT_MAX_GRANTS);
+    if (map->max_entries && map->nused + count > map->max_entries)
+        return NULL;
 
     addr = allocate_ondemand((unsigned long) count, 1);
     if (addr == 0)
         return NULL;
 
-    for (i = 0; i < count; i++) {
-        ent = gntmap_find_free_entry(map);
-        if (ent == NULL ||
-            _gntmap_map_grant_ref(ent,
-                                  addr + PAGE_SIZE * i,
-                                  domids[i * domids_stride],
-                                  refs[i],
-                                  writable) != 0) {
-
-            (void) gntmap_munmap(map, addr, i);
+    for (done = 0; done < count; done += n) {
+        n = count - done < GNTMAP_BATCH ? count - done : GNTMAP_BATCH;
+        for (i = 0; i < n; i++) {
+            op[i].ref = (grant_ref_t) refs[done + i];
+            op[i].dom = (domid_t) domids[(done + i) * domids_stride];
+            op[i].host_addr = (uint64_t) (addr + PAGE_SIZE * (done + i));
+            op[i].flags = GNTMAP_host_map;
+            if (!writable)
+                op[i].flags |= GNTMAP_readonly;
+        }
+
+        rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, op, n);
+
+        /* Record what got mapped, even after a failure, so it can be undone */
+        failed = 0;
+        for (i = 0; i < n; i++) {
+            if (rc != 0 || op[i].status != GNTST_okay) {
+                printk("GNTTABOP_map_grant_ref failed: "
+                       "returned %d, status %" PRId16 "\n",
+                       rc, op[i].status);
+                failed = 1;
+                continue;
+            }
+            ent = gntmap_find_free_entry(map);
+            if (ent == NULL) {
+                struct gnttab_unmap_grant_ref unmap = {
+                    .host_addr = op[i].host_addr,
+                    .handle = op[i].handle,
+                };
+                HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &unmap, 1);
+                failed = 1;
+                continue;
+            }
+            ent->host_addr = op[i].host_addr;
+            ent->handle = op[i].handle;
+            gntmap_entry_insert(map, ent);
+        }
+
+        if (failed) {
+            for (i = 0; i < done + n; i++) {
+                if (gntmap_find_entry(map, addr + PAGE_SIZE * i))
+                    (void) _gntmap_unmap_grant_refs(map, addr + PAGE_SIZE * i, 1);
+            }
             return NULL;
         }
     }
@@ -227,6 +324,10 @@ gntmap_init(struct gntmap *map)
 {
     DEBUG("(map=%p)", map);
     map->nentries = 0;
+    map->nused = 0;
+    map->max_entries = 0;
+    map->free = -1;
+    map->buckets = NULL;
     map->entries = NULL;
 }
 
@@ -241,10 +342,13 @@ gntmap_fini(struct gntmap *map)
     for (i = 0; i < map->nentries; i++) {
         ent = &map->entries[i];
         if (gntmap_entry_used(ent))
-            (void) _gntmap_unmap_grant_ref(ent);
+            (void) _gntmap_unmap_grant_refs(map, ent->host_addr, 1);
     }
 
     xfree(map->entries);
+    xfree(map->buckets);
     map->entries = NULL;
+    map->buckets = NULL;
     map->nentries = 0;
+    map->nused = 0;
 }
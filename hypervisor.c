@@ -80,15 +80,93 @@ shared_info_t *map_shared_info(void *p)
 }
 #endif
 
+/*
+ * Where the 2-level scan resumes: the port after the last one served, so a
+ * port that keeps firing can't starve the ones after it.
+ */
+static unsigned int current_word_idx, current_bit_idx;
+
+unsigned long evtchn_upcalls;
+
+#define BITS_PER_EVTCHN_WORD (sizeof(unsigned long) * 8)
+/* Bits of w from bit idx up */
+#define MASK_LSBS(w, idx) ((w) & (~0UL << (idx)))
+
+static void evtchn_2l_handle_events(struct pt_regs *regs, unsigned int budget)
+{
+    int            cpu = 0;
+    shared_info_t *s = HYPERVISOR_shared_info;
+    vcpu_info_t   *vcpu_info = &s->vcpu_info[cpu];
+    unsigned long  pending_words, words, pending_bits, bits;
+    unsigned int   start_word_idx, start_bit_idx, word_idx, bit_idx, i;
+
+    pending_words = xchg(&vcpu_info->evtchn_pending_sel, 0);
+    start_word_idx = current_word_idx;
+    start_bit_idx = current_bit_idx;
+    word_idx = start_word_idx;
+
+    for ( i = 0; pending_words != 0; i++ )
+    {
+        words = MASK_LSBS(pending_words, word_idx);
+        /* Nothing at or after word_idx, wrap around */
+        if ( words == 0 )
+        {
+            word_idx = 0;
+            continue;
+        }
+        word_idx = __ffs(words);
+
+        pending_bits = active_evtchns(cpu, s, word_idx);
+        /* Resume in the middle of the start word the first time round */
+        bit_idx = (word_idx == start_word_idx && i == 0) ? start_bit_idx : 0;
+
+        do
+        {
+            bits = MASK_LSBS(pending_bits, bit_idx);
+            if ( bits == 0 )
+                break;
+            bit_idx = __ffs(bits);
+
+            do_event(word_idx * BITS_PER_EVTCHN_WORD + bit_idx, regs);
+
+            bit_idx = (bit_idx + 1) % BITS_PER_EVTCHN_WORD;
+            current_bit_idx = bit_idx;
+            current_word_idx = bit_idx ? word_idx
+                                       : (word_idx + 1) % BITS_PER_EVTCHN_WORD;
+            if ( --budget == 0 )
+                goto out_of_budget;
+        } while ( bit_idx != 0 );
+
+        /* The start word stays pending the first time round, as its ports
+         * before start_bit_idx have not been looked at yet */
+        if ( word_idx != start_word_idx || i != 0 )
+            pending_words &= ~(1UL << word_idx);
+        word_idx = (word_idx + 1) % BITS_PER_EVTCHN_WORD;
+    }
+    return;
+
+out_of_budget:
+    /* Give the unserved words back; the upcall is raised again as soon as
+     * we return, and resumes after the last port served */
+    while ( pending_words != 0 )
+    {
+        word_idx = __ffs(pending_words);
+        pending_words &= ~(1UL << word_idx);
+        synch_set_bit(word_idx, &vcpu_info->evtchn_pending_sel);
+    }
+    vcpu_info->evtchn_upcall_pending = 1;
+}
+
 void do_hypervisor_callback(struct pt_regs *regs)
 {
-    unsigned long  l1, l2, l1i, l2i;
-    unsigned int   port;
     int            cpu = 0;
     shared_info_t *s = HYPERVISOR_shared_info;
     vcpu_info_t   *vcpu_info = &s->vcpu_info[cpu];
 
     in_callback = 1;
+    evtchn_upcalls++;
+    /* Handlers' notifications go out together once all are done */
+    notify_batch_begin();
    
     vcpu_info->evtchn_upcall_pending = 0;
     /* NB x86. No need for a barrier here -- XCHG is a barrier on x86. */
@@ -96,22 +174,14 @@ void do_hypervisor_callback(struct pt_regs *regs)
     /* Clear master flag /before/ clearing selector flag. */
     wmb();
 #endif
-    l1 = xchg(&vcpu_info->evtchn_pending_sel, 0);
-    while ( l1 != 0 )
-    {
-        l1i = __ffs(l1);
-        l1 &= ~(1UL << l1i);
-        
-        while ( (l2 = active_evtchns(cpu, s, l1i)) != 0 )
-        {
-            l2i = __ffs(l2);
-            l2 &= ~(1UL << l2i);
-
-            port = (l1i * (sizeof(unsigned long) * 8)) + l2i;
-            do_event(port, regs);
-        }
-    }
+#ifdef CONFIG_EVTCHN_FIFO
+    if ( evtchn_fifo )
+        evtchn_fifo_handle_events(regs, EVTCHN_BUDGET);
+    else
+#endif
+        evtchn_2l_handle_events(regs, EVTCHN_BUDGET);
 
+    notify_batch_end();
     in_callback = 0;
 }
 
@@ -143,6 +213,13 @@ void force_evtchn_callback(void)
 inline void mask_evtchn(uint32_t port)
 {
     shared_info_t *s = HYPERVISOR_shared_info;
+#ifdef CONFIG_EVTCHN_FIFO
+    if ( evtchn_fifo )
+    {
+        evtchn_fifo_mask(port);
+        return;
+    }
+#endif
     synch_set_bit(port, &s->evtchn_mask[0]);
 }
 
@@ -151,6 +228,13 @@ inline void unmask_evtchn(uint32_t port)
     shared_info_t *s = HYPERVISOR_shared_info;
     vcpu_info_t *vcpu_info = &s->vcpu_info[smp_processor_id()];
 
+#ifdef CONFIG_EVTCHN_FIFO
+    if ( evtchn_fifo )
+    {
+        evtchn_fifo_unmask(port);
+        return;
+    }
+#endif
     synch_clear_bit(port, &s->evtchn_mask[0]);
 
     /*
@@ -172,5 +256,12 @@ inline void unmask_evtchn(uint32_t port)
 inline void clear_evtchn(uint32_t port)
 {
     shared_info_t *s = HYPERVISOR_shared_info;
+#ifdef CONFIG_EVTCHN_FIFO
+    if ( evtchn_fifo )
+    {
+        evtchn_fifo_clear(port);
+        return;
+    }
+#endif
     synch_clear_bit(port, &s->evtchn_pending[0]);
 }
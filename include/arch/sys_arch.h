@@ -16,18 +16,33 @@
 typedef struct semaphore *sys_sem_t;
 #define SYS_SEM_NULL ((sys_sem_t) NULL)
 
+/* A slot's seq equals the position it will next be posted at while it is
+ * free, and that position + 1 once the message is in */
+struct mbox_slot {
+    volatile unsigned int seq;
+    void *msg;
+};
+
+/* Bounded ring of messages. Posters and fetchers claim positions with
+ * cmpxchg instead of taking a lock, and only sleep on a full or an empty
+ * ring respectively. */
 struct mbox {
-    int count;
-    void **messages;
-    struct semaphore read_sem;
-    struct semaphore write_sem;
-    int writer;
-    int reader;
+    unsigned int mask;          /* number of slots - 1, a power of two */
+    volatile unsigned int head; /* next position to fetch */
+    volatile unsigned int tail; /* next position to post */
+    struct wait_queue_head read_wait;
+    struct wait_queue_head write_wait;
+    struct mbox_slot slots[];
 };
 
 typedef struct mbox *sys_mbox_t;
 #define SYS_MBOX_NULL ((sys_mbox_t) 0)
 
+/* Fetch up to max messages, waiting as sys_arch_mbox_fetch() does for the
+ * first one only. Returns how many were fetched, 0 on timeout. */
+int sys_arch_mbox_fetch_batch(sys_mbox_t mbox, void **msgs, int max,
+                              uint32_t timeout);
+
 typedef struct thread *sys_thread_t;
 
 typedef unsigned long sys_prot_t;
@@ -32,19 +32,35 @@
  */
 #define BALLOON_EMERGENCY_PAGES   64
 
+/*
+ * The balloon thread tries to keep between the low and high water mark
+ * pages free, so allocations don't have to wait for the hypervisor.
+ */
+#define BALLOON_LOW_WATER_PAGES   256
+#define BALLOON_HIGH_WATER_PAGES  1024
+
+/* Populate memory in superpage sized extents where possible. */
+#define BALLOON_EXTENT_ORDER      9
+#define BALLOON_BATCH_PAGES       (64UL << BALLOON_EXTENT_ORDER)
+
 extern unsigned long nr_max_pages;
 extern unsigned long nr_mem_pages;
+extern unsigned long nr_ballooned_pages;
 
 void get_max_pages(void);
+void init_balloon(void);
 int balloon_up(unsigned long n_pages);
+int balloon_down(unsigned long n_pages);
 
 void mm_alloc_bitmap_remap(void);
 void arch_pfn_add(unsigned long pfn, unsigned long mfn);
+void arch_pfn_remove(unsigned long pfn);
 int chk_free_pages(unsigned long needed);
 
 #else /* CONFIG_BALLOON */
 
 static inline void get_max_pages(void) { }
+static inline void init_balloon(void) { }
 static inline void mm_alloc_bitmap_remap(void) { }
 static inline int chk_free_pages(unsigned long needed)
 {
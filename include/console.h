@@ -63,6 +63,20 @@ struct consfront_dev {
 
 extern uint32_t console_evtchn;
 
+/* printk levels: prefix the format string, e.g. printk(KERN_ERR "...") */
+#define KERN_EMERG      "<0>"
+#define KERN_ALERT      "<1>"
+#define KERN_CRIT       "<2>"
+#define KERN_ERR        "<3>"
+#define KERN_WARNING    "<4>"
+#define KERN_NOTICE     "<5>"
+#define KERN_INFO       "<6>"
+#define KERN_DEBUG      "<7>"
+
+/* Level of messages without a prefix, and default console filter */
+#define CONSOLE_LOGLEVEL_MESSAGE    4
+#define CONSOLE_LOGLEVEL_DEFAULT    7
+
 void print(int direct, const char *fmt, va_list args);
 void printk(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void xprintk(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
@@ -74,6 +88,10 @@ void xencons_tx(void);
 
 void get_console(void *p);
 void init_console(void);
+void init_console_thread(void);
+void console_flush(void);
+void console_set_loglevel(int level);
+void console_set_timestamps(int on);
 void console_print(struct consfront_dev *dev, char *data, int length);
 void fini_console(struct consfront_dev *dev);
 
@@ -83,6 +101,8 @@ struct consfront_dev *xencons_ring_init(void);
 struct consfront_dev *init_consfront(char *_nodename);
 int xencons_ring_send(struct consfront_dev *dev, const char *data, unsigned len);
 int xencons_ring_send_no_notify(struct consfront_dev *dev, const char *data, unsigned len);
+int xencons_ring_send_wait(struct consfront_dev *dev, const char *data,
+                           unsigned len, int notify);
 int xencons_ring_avail(struct consfront_dev *dev);
 int xencons_ring_recv(struct consfront_dev *dev, char *data, unsigned len);
 void free_consfront(struct consfront_dev *dev);
@@ -24,6 +24,31 @@
 
 typedef void (*evtchn_handler_t)(evtchn_port_t, struct pt_regs *, void *);
 
+/* Events handled per upcall before the rest wait for the next one */
+#ifndef EVTCHN_BUDGET
+#define EVTCHN_BUDGET 64
+#endif
+
+struct evtchn_stats {
+    uint64_t events;        /* handler runs */
+    uint64_t time_total;    /* in the handler, ns */
+    uint64_t time_max;
+};
+
+/* Upcalls so far, each handling one or more events */
+extern unsigned long evtchn_upcalls;
+
+/* Notified ports deferred before a batch flushes them early */
+#ifndef NOTIFY_BATCH_MAX
+#define NOTIFY_BATCH_MAX 16
+#endif
+
+struct notify_stats {
+    uint64_t requests;      /* notify_remote_via_evtchn() calls */
+    uint64_t sends;         /* ports actually sent, after deduplication */
+    uint64_t hypercalls;    /* a multicall counts once */
+};
+
 /* prototypes */
 void arch_init_events(void);
 
@@ -47,13 +72,37 @@ int evtchn_bind_interdomain(domid_t pal, evtchn_port_t remote_port,
 int evtchn_get_peercontext(evtchn_port_t local_port, char *ctx, int size);
 void unbind_all_ports(void);
 
-static inline int notify_remote_via_evtchn(evtchn_port_t port)
-{
-    evtchn_send_t op;
-    op.port = port;
-    return HYPERVISOR_event_channel_op(EVTCHNOP_send, &op);
-}
+/*
+ * Inside a notify batch (every event upcall and tasklet pass is one), the
+ * send is deferred and a port notified several times is sent only once,
+ * when the outermost batch ends or the current thread schedules. Deferred
+ * sends return 0.
+ */
+int notify_remote_via_evtchn(evtchn_port_t port);
+void notify_batch_begin(void);
+void notify_batch_end(void);
+/* Send the deferred notifications now, even inside a batch */
+void notify_flush(void);
 
 void fini_events(void);
 
+int evtchn_get_stats(evtchn_port_t port, struct evtchn_stats *stats);
+void evtchn_dump_stats(void);
+void notify_get_stats(struct notify_stats *stats);
+
+/* Lower is more urgent, see EVTCHN_FIFO_PRIORITY_*. Only the FIFO ABI has
+ * priorities, -ENOSYS otherwise. */
+int evtchn_set_priority(evtchn_port_t port, unsigned int priority);
+
+#ifdef CONFIG_EVTCHN_FIFO
+/* Set if init_evtchn_fifo() switched us to the FIFO ABI */
+extern int evtchn_fifo;
+void init_evtchn_fifo(void);
+int evtchn_fifo_setup(evtchn_port_t port);
+void evtchn_fifo_mask(evtchn_port_t port);
+void evtchn_fifo_unmask(evtchn_port_t port);
+void evtchn_fifo_clear(evtchn_port_t port);
+void evtchn_fifo_handle_events(struct pt_regs *regs, unsigned int budget);
+#endif
+
 #endif /* _EVENTS_H_ */
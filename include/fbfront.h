@@ -40,7 +40,12 @@ int fbfront_open(struct fbfront_dev *dev);
 
 int fbfront_receive(struct fbfront_dev *dev, union xenfb_in_event *buf, int n);
 extern struct wait_queue_head fbfront_queue;
+/* Updates are merged and sent at most fps times a second (60 by default),
+ * fps 0 sends every update right away. fbfront_flush() sends pending
+ * updates now. */
 void fbfront_update(struct fbfront_dev *dev, int x, int y, int width, int height);
+void fbfront_flush(struct fbfront_dev *dev);
+void fbfront_set_frame_rate(struct fbfront_dev *dev, int fps);
 void fbfront_resize(struct fbfront_dev *dev, int width, int height, int stride, int depth, int offset);
 
 void shutdown_fbfront(struct fbfront_dev *dev);
@@ -9,6 +9,10 @@
  */
 struct gntmap {
     int nentries;
+    int nused;
+    int max_entries;            /* 0 if the table may grow without limit */
+    int free;                   /* First free entry, if nused < nentries */
+    int *buckets;               /* nentries hash chains keyed by address */
     struct gntmap_entry *entries;
 };
 
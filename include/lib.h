@@ -67,6 +67,10 @@
 #include <sys/queue.h>
 #include <stdio.h>
 #include <string.h>
+
+static inline void init_string_ops(void)
+{
+}
 #else
 /* string and memory manipulation */
 
@@ -124,6 +128,9 @@ extern int sscanf(const char *, const char *, ...)
 extern int vsscanf(const char *, const char *, va_list)
         __attribute__ ((format (scanf, 2, 0)));
 
+/* Select the fastest memcpy()/memset() variants for this cpu. */
+void init_string_ops(void);
+
 #endif
 
 #include <mini-os/console.h>
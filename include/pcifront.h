@@ -13,6 +13,20 @@ int pcifront_conf_write(struct pcifront_dev *dev,
                         unsigned int dom,
                         unsigned int bus, unsigned int slot, unsigned int fun,
                         unsigned int off, unsigned int size, unsigned int val);
+
+/* One config space access of a pcifront_conf_batch() */
+struct pcifront_conf_op {
+    unsigned int write;         /* 0 to read, 1 to write */
+    unsigned int off, size;
+    unsigned int val;           /* Value to write, or value read */
+    int err;                    /* XEN_PCI_ERR_* result */
+};
+/* Perform ops in order on one device, without letting other accesses in
+ * between. Returns the first error, 0 if all ops succeeded. */
+int pcifront_conf_batch(struct pcifront_dev *dev,
+                        unsigned int dom,
+                        unsigned int bus, unsigned int slot, unsigned int fun,
+                        struct pcifront_conf_op *ops, int n);
 int pcifront_enable_msi(struct pcifront_dev *dev,
                         unsigned int dom,
                         unsigned int bus, unsigned int slot, unsigned int fun);
@@ -1,47 +1,112 @@
 #ifndef _POSIX_PTHREAD_H
 #define _POSIX_PTHREAD_H
 
+#ifdef HAVE_LIBC
 #include <stdlib.h>
+#endif
+#include <sys/time.h>
+#include <mini-os/waittypes.h>
 
-/* Let's be single-threaded for now.  */
+/* Threads are Mini-OS threads, scheduled cooperatively. Thread-local
+ * storage through __thread is not supported, use keys instead. */
 
+#define PTHREAD_KEYS_MAX 64
+#define PTHREAD_DESTRUCTOR_ITERATIONS 4
+
+struct thread;
+typedef struct pthread *pthread_t;
+
+#define PTHREAD_CREATE_JOINABLE 0
+#define PTHREAD_CREATE_DETACHED 1
 typedef struct {
-    void *ptr;
-} *pthread_key_t;
-static inline int pthread_key_create(pthread_key_t *key, void (*destr_function)(void*))
-{
-    *key = malloc(sizeof(**key));
-    (*key)->ptr = NULL;
-    return 0;
-}
-static inline int pthread_setspecific(pthread_key_t key, const void *pointer)
-{
-    key->ptr = (void*) pointer;
-    return 0;
-}
-static inline void *pthread_getspecific(pthread_key_t key)
-{
-    return key->ptr;
-}
-static inline int pthread_key_delete(pthread_key_t key)
+    int detachstate;
+} pthread_attr_t;
+int pthread_attr_init(pthread_attr_t *attr);
+int pthread_attr_destroy(pthread_attr_t *attr);
+int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate);
+int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate);
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg);
+int pthread_join(pthread_t thread, void **retval);
+int pthread_detach(pthread_t thread);
+void pthread_exit(void *retval) __attribute__((noreturn));
+pthread_t pthread_self(void);
+static inline int pthread_equal(pthread_t t1, pthread_t t2)
 {
-    free(key);
-    return 0;
+    return t1 == t2;
 }
 
 
 
-typedef struct {} pthread_mutexattr_t;
-static inline int pthread_mutexattr_init(pthread_mutexattr_t *mattr) { return 0; }
+typedef unsigned int pthread_key_t;
+int pthread_key_create(pthread_key_t *key, void (*destr_function)(void*));
+int pthread_key_delete(pthread_key_t key);
+int pthread_setspecific(pthread_key_t key, const void *pointer);
+void *pthread_getspecific(pthread_key_t key);
+
+
+
 #define PTHREAD_MUTEX_NORMAL 0
 #define PTHREAD_MUTEX_RECURSIVE 1
-static inline int pthread_mutexattr_settype(pthread_mutexattr_t *mattr, int kind) { return 0; }
-static inline int pthread_mutexattr_destroy(pthread_mutexattr_t *mattr) { return 0; }
-typedef struct {} pthread_mutex_t;
-#define PTHREAD_MUTEX_INITIALIZER {}
-static inline int pthread_mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *mattr) { return 0; }
-static inline int pthread_mutex_lock(pthread_mutex_t *mutex) { return 0; }
-static inline int pthread_mutex_unlock(pthread_mutex_t *mutex) { return 0; }
+#define PTHREAD_MUTEX_ERRORCHECK 2
+#define PTHREAD_MUTEX_DEFAULT PTHREAD_MUTEX_NORMAL
+typedef struct {
+    int type;
+} pthread_mutexattr_t;
+int pthread_mutexattr_init(pthread_mutexattr_t *mattr);
+int pthread_mutexattr_settype(pthread_mutexattr_t *mattr, int kind);
+int pthread_mutexattr_destroy(pthread_mutexattr_t *mattr);
+
+typedef struct {
+    int type;
+    struct thread *owner;
+    unsigned int count;
+    struct wait_queue_head wait;
+} pthread_mutex_t;
+/* The zeroed wait queue head gets its tail pointer on first contention */
+#define PTHREAD_MUTEX_INITIALIZER { PTHREAD_MUTEX_NORMAL, 0, 0, { 0, 0 } }
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *mattr);
+int pthread_mutex_destroy(pthread_mutex_t *mutex);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+
+
+typedef struct {} pthread_condattr_t;
+typedef struct {
+    unsigned int waiters;
+    unsigned int wakeups;
+    struct wait_queue_head wait;
+} pthread_cond_t;
+#define PTHREAD_COND_INITIALIZER { 0, 0, { 0, 0 } }
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+int pthread_cond_destroy(pthread_cond_t *cond);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
+
+
+
+/* Waiting writers hold off new readers */
+typedef struct {} pthread_rwlockattr_t;
+typedef struct {
+    unsigned int readers;
+    unsigned int writers_waiting;
+    struct thread *writer;
+    struct wait_queue_head wait;
+} pthread_rwlock_t;
+#define PTHREAD_RWLOCK_INITIALIZER { 0, 0, 0, { 0, 0 } }
+int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr);
+int pthread_rwlock_destroy(pthread_rwlock_t *rwlock);
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock);
 
 
 
@@ -49,15 +114,7 @@ typedef struct {
     int done;
 } pthread_once_t;
 #define PTHREAD_ONCE_INIT { 0 }
-
-static inline int pthread_once(pthread_once_t *once_control, void (*init_routine)(void))
-{
-    if (!once_control->done) {
-        once_control->done = 1;
-        init_routine();
-    }
-    return 0;
-}
+int pthread_once(pthread_once_t *once_control, void (*init_routine)(void));
 
 #define __thread
 
@@ -3,6 +3,7 @@
 
 #include <sys/time.h>
 #define CLOCK_MONOTONIC	2
+#define CLOCK_MONOTONIC_COARSE	6
 #include_next <time.h>
 
 int nanosleep(const struct timespec *req, struct timespec *rem);
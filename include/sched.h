@@ -8,6 +8,8 @@
 #include <sys/reent.h>
 #endif
 
+struct pthread;
+
 struct thread
 {
     char *name;
@@ -18,6 +20,7 @@ struct thread
     MINIOS_TAILQ_ENTRY(struct thread) thread_list;
     uint32_t flags;
     s_time_t wakeup_time;
+    struct pthread *pthread;    /* Set once the thread uses pthreads */
 #ifdef HAVE_LIBC
     struct _reent reent;
 #endif
@@ -27,21 +30,29 @@ extern struct thread *idle_thread;
 void idle_thread_fn(void *unused);
 
 #define RUNNABLE_FLAG   0x00000001
+/* Woken urgent threads go to the front of the run queue */
+#define URGENT_FLAG     0x00000002
 
 #define is_runnable(_thread)    (_thread->flags & RUNNABLE_FLAG)
 #define set_runnable(_thread)   (_thread->flags |= RUNNABLE_FLAG)
 #define clear_runnable(_thread) (_thread->flags &= ~RUNNABLE_FLAG)
+#define is_urgent(_thread)      (_thread->flags & URGENT_FLAG)
+#define set_urgent(_thread)     (_thread->flags |= URGENT_FLAG)
 
 #define switch_threads(prev, next) arch_switch_threads(prev, next)
  
     /* Architecture specific setup of thread creation. */
-struct thread* arch_create_thread(char *name, void (*function)(void *),
-                                  void *data);
+void arch_init_thread(struct thread *thread, void (*function)(void *),
+                      void *data);
 
 void init_sched(void);
 void run_idle_thread(void);
 struct thread* create_thread(char *name, void (*function)(void *), void *data);
 void exit_thread(void) __attribute__((noreturn));
+/* Runs the pthread key destructors of thread and frees its pthread */
+void pthread_release(struct thread *thread);
+void set_thread_pool_max(unsigned int max);
+void set_thread_quiet(int quiet);
 void schedule(void);
 
 #ifdef __INSIDE_MINIOS__
@@ -16,12 +16,14 @@ struct semaphore
 };
 
 /*
- * the semaphore definition
+ * Reader/writer semaphore. Releasing it hands it straight to the waiters:
+ * the last reader out prefers a waiting writer, a writer prefers the
+ * readers queued behind it, and new readers wait while a writer does.
  */
 struct rw_semaphore {
-	signed long		count;
-	spinlock_t		wait_lock;
-	int			debug;
+	int activity;	/* readers inside, -1 for a writer, 0 if free */
+	struct wait_queue_head read_wait;
+	struct wait_queue_head write_wait;
 };
 
 #define __SEMAPHORE_INITIALIZER(name, n)                            \
@@ -61,50 +63,135 @@ static inline int trydown(struct semaphore *sem)
     return ret;
 }
 
+/* up() hands the count to the first waiter, if any, instead of making it
+ * available to whoever runs first */
 static void inline down(struct semaphore *sem)
 {
     unsigned long flags;
-    while (1) {
-        wait_event(sem->wait, sem->count > 0);
-        local_irq_save(flags);
-        if (sem->count > 0)
-            break;
-        local_irq_restore(flags);
-    }
-    sem->count--;
+    local_irq_save(flags);
+    if (sem->count > 0)
+        sem->count--;
+    else
+        wait_handoff(sem->wait, flags);
+    local_irq_restore(flags);
+}
+
+/* Returns 1 if the semaphore was taken, 0 if the deadline passed first */
+static inline int down_deadline(struct semaphore *sem, s_time_t deadline)
+{
+    unsigned long flags;
+    int ret = 1;
+    local_irq_save(flags);
+    if (sem->count > 0)
+        sem->count--;
+    else
+        wait_handoff_deadline(sem->wait, flags, deadline, ret);
     local_irq_restore(flags);
+    return ret;
 }
 
 static void inline up(struct semaphore *sem)
 {
     unsigned long flags;
     local_irq_save(flags);
-    sem->count++;
-    wake_up(&sem->wait);
+    if (!wake_up_one(&sem->wait))
+        sem->count++;
     local_irq_restore(flags);
 }
 
-/* FIXME! Thre read/write semaphores are unimplemented! */
+#define __RWSEM_INITIALIZER(name)                                   \
+{                                                                   \
+    .activity       = 0,                                            \
+    .read_wait      = __WAIT_QUEUE_HEAD_INITIALIZER((name).read_wait), \
+    .write_wait     = __WAIT_QUEUE_HEAD_INITIALIZER((name).write_wait) \
+}
+
+#define DECLARE_RWSEM(name) \
+    struct rw_semaphore name = __RWSEM_INITIALIZER(name)
+
 static inline void init_rwsem(struct rw_semaphore *sem)
 {
-  sem->count = 1;
+    sem->activity = 0;
+    init_waitqueue_head(&sem->read_wait);
+    init_waitqueue_head(&sem->write_wait);
 }
 
-static inline void down_read(struct rw_semaphore *sem)
+/* Called with interrupts disabled once sem has become free */
+static inline void __rwsem_hand_off(struct rw_semaphore *sem, int readers_first)
 {
+    if (!(readers_first && !MINIOS_STAILQ_EMPTY(&sem->read_wait)) &&
+        wake_up_one(&sem->write_wait)) {
+        sem->activity = -1;
+        return;
+    }
+    while (wake_up_one(&sem->read_wait))
+        sem->activity++;
+}
+
+static inline int down_read_trylock(struct rw_semaphore *sem)
+{
+    unsigned long flags;
+    int ret = 0;
+    local_irq_save(flags);
+    if (sem->activity >= 0 && MINIOS_STAILQ_EMPTY(&sem->write_wait)) {
+        sem->activity++;
+        ret = 1;
+    }
+    local_irq_restore(flags);
+    return ret;
 }
 
+static inline void down_read(struct rw_semaphore *sem)
+{
+    unsigned long flags;
+    local_irq_save(flags);
+    if (sem->activity >= 0 && MINIOS_STAILQ_EMPTY(&sem->write_wait))
+        sem->activity++;
+    else
+        wait_handoff(sem->read_wait, flags);
+    local_irq_restore(flags);
+}
 
 static inline void up_read(struct rw_semaphore *sem)
 {
+    unsigned long flags;
+    local_irq_save(flags);
+    if (!--sem->activity)
+        __rwsem_hand_off(sem, 0);
+    local_irq_restore(flags);
 }
 
-static inline void up_write(struct rw_semaphore *sem)
+static inline int down_write_trylock(struct rw_semaphore *sem)
 {
+    unsigned long flags;
+    int ret = 0;
+    local_irq_save(flags);
+    if (!sem->activity) {
+        sem->activity = -1;
+        ret = 1;
+    }
+    local_irq_restore(flags);
+    return ret;
 }
 
 static inline void down_write(struct rw_semaphore *sem)
 {
+    unsigned long flags;
+    local_irq_save(flags);
+    if (!sem->activity)
+        sem->activity = -1;
+    else
+        wait_handoff(sem->write_wait, flags);
+    local_irq_restore(flags);
+}
+
+static inline void up_write(struct rw_semaphore *sem)
+{
+    unsigned long flags;
+    local_irq_save(flags);
+    sem->activity = 0;
+    __rwsem_hand_off(sem, 1);
+    local_irq_restore(flags);
 }
 
 #endif /* _SEMAPHORE_H */
@@ -0,0 +1,50 @@
+#ifndef __TASKLET_H__
+#define __TASKLET_H__
+
+#include <mini-os/list.h>
+#include <mini-os/time.h>
+
+/*
+ * Tasklets defer work out of event channel handlers. tasklet_schedule()
+ * may be called from a handler; the tasklet then runs once, soon after, in
+ * the "tasklet" thread, which the scheduler prefers over all other threads.
+ * Tasklets run with interrupts enabled but should not sleep, as that holds
+ * up every other tasklet.
+ */
+
+#define TASKLET_STATE_SCHED  0x1    /* queued to run */
+#define TASKLET_STATE_RUN    0x2    /* running right now */
+#define TASKLET_STATE_LISTED 0x4    /* on the list dumped by tasklet_dump_stats */
+
+struct tasklet_stats {
+    uint64_t runs;
+    s_time_t latency_total;     /* from tasklet_schedule() to running, in ns */
+    s_time_t latency_max;
+    s_time_t time_total;        /* running, in ns */
+    s_time_t time_max;
+};
+
+struct tasklet {
+    const char *name;
+    void (*func)(void *data);
+    void *data;
+    unsigned int state;
+    s_time_t queued;
+    struct tasklet_stats stats;
+    MINIOS_STAILQ_ENTRY(struct tasklet) queue;
+    MINIOS_TAILQ_ENTRY(struct tasklet) list;
+};
+
+#define DECLARE_TASKLET(tname, tfunc, tdata) \
+    struct tasklet tname = { .name = #tname, .func = tfunc, .data = tdata }
+
+void init_tasklets(void);
+void tasklet_init(struct tasklet *t, const char *name,
+                  void (*func)(void *data), void *data);
+void tasklet_schedule(struct tasklet *t);
+/* Wait until t is neither queued nor running. It must not be scheduled
+ * again once this has returned. */
+void tasklet_kill(struct tasklet *t);
+void tasklet_dump_stats(void);
+
+#endif /* __TASKLET_H__ */
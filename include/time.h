@@ -31,6 +31,9 @@
  */
 typedef int64_t s_time_t;
 #define NOW()                   ((s_time_t)monotonic_clock())
+/* Only as recent as the last NOW(), which the scheduler calls at every
+ * switch, but cheap enough for timestamps and statistics */
+#define NOW_COARSE()            ((s_time_t)monotonic_clock_coarse())
 #define SECONDS(_s)             (((s_time_t)(_s))  * 1000000000UL )
 #define TENTHS(_ts)             (((s_time_t)(_ts)) * 100000000UL )
 #define HUNDREDTHS(_hs)         (((s_time_t)(_hs)) * 10000000UL )
@@ -58,6 +61,9 @@ void     fini_time(void);
 s_time_t get_s_time(void);
 s_time_t get_v_time(void);
 uint64_t monotonic_clock(void);
+uint64_t monotonic_clock_coarse(void);
 void     block_domain(s_time_t until);
+/* Have the timer event fire at deadline, or never if it is 0 */
+void     arch_program_timer(s_time_t deadline);
 
 #endif /* _MINIOS_TIME_H_ */
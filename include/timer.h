@@ -0,0 +1,42 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <mini-os/list.h>
+#include <mini-os/time.h>
+
+/*
+ * One-shot callback timers. The earliest pending timer is programmed into
+ * the hypervisor's single-shot timer, so callbacks run from the timer event
+ * handler close to their expiry time. Callbacks run with interrupts
+ * disabled and must not sleep; anything longer belongs in a tasklet.
+ * timer_add() and timer_del() may be called from any context, including
+ * from a callback to re-arm its own timer.
+ */
+
+struct timer {
+    s_time_t expires;           /* NOW() based, in ns */
+    void (*func)(void *data);
+    void *data;
+    int pending;
+    MINIOS_TAILQ_ENTRY(struct timer) list;
+};
+
+#define DECLARE_TIMER(tname, tfunc, tdata) \
+    struct timer tname = { .func = tfunc, .data = tdata }
+
+void init_timer(struct timer *t, void (*func)(void *data), void *data);
+/* (Re)arm t to expire at expires, replacing any earlier expiry */
+void timer_add(struct timer *t, s_time_t expires);
+/* Returns 1 if t was pending */
+int timer_del(struct timer *t);
+static inline int timer_pending(struct timer *t)
+{
+    return t->pending != 0;
+}
+
+/* For the arch timer code: the earliest expiry, or 0 if none is pending */
+s_time_t timer_next_expiry(void);
+/* For the arch timer code: run expired timers and reprogram the next one */
+void timer_run_expired(void);
+
+#endif /* __TIMER_H__ */
@@ -42,6 +42,15 @@ void shutdown_tpm_tis(struct tpm_chip* tpm);
 int tpm_tis_request_locality(struct tpm_chip* tpm, int locality);
 int tpm_tis_cmd(struct tpm_chip* tpm, uint8_t* req, size_t reqlen, uint8_t** resp, size_t* resplen);
 
+/* Prints the number of commands and their latency for each ordinal seen */
+void tpm_tis_dump_stats(struct tpm_chip* tpm);
+
+#ifdef CONFIG_TEST
+/* Checks the FIFO and polling code on a fake register page. Returns the
+ * number of failed checks. */
+int tpm_tis_selftest(void);
+#endif
+
 #ifdef HAVE_LIBC
 #include <sys/stat.h>
 #include <fcntl.h>
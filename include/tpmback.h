@@ -47,14 +47,25 @@ struct tpmcmd {
    unsigned int handle;	/* Handle of the frontend */
    void *opaque;        /* Opaque pointer taken from the tpmback instance */
 
-   uint8_t* req;			/* tpm command bits, allocated by driver, DON'T FREE IT */
+   uint8_t* req;			/* tpm command bits, allocated by driver, DON'T FREE IT.
+				   See tpmback_set_zero_copy() */
    unsigned int req_len;		/* Size of the command in buf - set by tpmback driver */
    unsigned int resp_len;	/* Size of the outgoing command,
 				   you set this before passing the cmd object to tpmback_resp */
-   uint8_t* resp;		/* Buffer for response - YOU MUST ALLOCATE IT, YOU MUST ALSO FREE IT */
+   uint8_t* resp;		/* Buffer for response - YOU MUST ALLOCATE IT, YOU MUST ALSO FREE IT.
+				   It may also be req itself, to answer in place */
 };
 typedef struct tpmcmd tpmcmd_t;
 
+/* Per frontend request statistics, times are in nanoseconds */
+struct tpmback_stats {
+   uint64_t requests;		/* Responses sent */
+   int64_t wait_total;		/* Time from submission until a handler picked the request up */
+   int64_t wait_max;
+   int64_t service_total;	/* Time from pick up until the response was sent */
+   int64_t service_max;
+};
+
 /* Initialize the tpm backend driver */
 void init_tpmback(void (*open_cb)(domid_t, unsigned int), void (*close_cb)(domid_t, unsigned int));
 
@@ -99,6 +110,20 @@ void* tpmback_get_opaque(domid_t domid, unsigned int handle);
 /* Returns zero if successful, nonzero on failure (no such frontend) */
 int tpmback_set_opaque(domid_t domid, unsigned int handle, void* opaque);
 
+/* Hand the commands of domid/handle out in place, with req pointing into
+ * the frontend's shared pages, instead of copying them first. The
+ * frontend can still write to those pages while the command is handled,
+ * so only enable this if the handler copies whatever it validates.
+ * Returns zero if successful, nonzero on failure (no such frontend) */
+int tpmback_set_zero_copy(domid_t domid, unsigned int handle, int enable);
+
+/* Copies the request statistics of domid/handle into stats.
+ * Returns zero if successful, nonzero on failure (no such frontend) */
+int tpmback_get_stats(domid_t domid, unsigned int handle, struct tpmback_stats* stats);
+
+/* Prints the request statistics of all frontends */
+void tpmback_dump_stats(void);
+
 /* Get the XSM context of the given domain (using the tpmback event channel) */
 int tpmback_get_peercontext(domid_t domid, unsigned int handle, void* buffer, int buflen);
 #endif
@@ -33,8 +33,15 @@
 #include <xen/io/xenbus.h>
 #include <xen/io/tpmif.h>
 
+/* The shared area is 1 << TPMFRONT_PAGE_ORDER pages: the shared page
+ * itself, followed by extra pages for commands and responses which do not
+ * fit in a single page (tpmif nr_extra_pages). */
+#define TPMFRONT_PAGE_ORDER 2
+#define TPMFRONT_NR_EXTRA_PAGES ((1 << TPMFRONT_PAGE_ORDER) - 1)
+
 struct tpmfront_dev {
    grant_ref_t ring_ref;
+   grant_ref_t extra_refs[TPMFRONT_NR_EXTRA_PAGES];
    evtchn_port_t evtchn;
 
    tpmif_shared_page_t *page;
@@ -48,6 +55,10 @@ struct tpmfront_dev {
    uint8_t waiting;
    struct wait_queue_head waitq;
 
+   /* Serialises tpmfront_cmd callers: the protocol has one command slot */
+   uint8_t busy;
+   struct wait_queue_head busyq;
+
    uint8_t* respbuf;
    size_t resplen;
 
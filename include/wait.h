@@ -9,6 +9,7 @@
 struct wait_queue name = {                         \
     .thread       = get_current(),                 \
     .waiting      = 0,                             \
+    .exclusive    = 0,                             \
 }
 
 
@@ -21,6 +22,7 @@ static inline void init_waitqueue_entry(struct wait_queue *q, struct thread *thr
 {
     q->thread = thread;
     q->waiting = 0;
+    q->exclusive = 0;
 }
 
 static inline void add_wait_queue(struct wait_queue_head *h, struct wait_queue *q)
@@ -31,6 +33,20 @@ static inline void add_wait_queue(struct wait_queue_head *h, struct wait_queue *
     }
 }
 
+/* Exclusive waiters queue up behind the others, in arrival order. A zeroed
+ * head (as from a static initializer) has no tail pointer yet, which only
+ * matters here, as add_wait_queue() inserts at the head. */
+static inline void add_wait_queue_exclusive(struct wait_queue_head *h, struct wait_queue *q)
+{
+    if (!q->waiting) {
+        q->exclusive = 1;
+        if (!h->stqh_last)
+            MINIOS_STAILQ_INIT(h);
+        MINIOS_STAILQ_INSERT_TAIL(h, q, thread_list);
+        q->waiting = 1;
+    }
+}
+
 static inline void remove_wait_queue(struct wait_queue_head *h, struct wait_queue *q)
 {
     if (q->waiting) {
@@ -49,6 +65,32 @@ static inline void wake_up(struct wait_queue_head *head)
     local_irq_restore(flags);
 }
 
+/*
+ * Wake every non-exclusive waiter but only the first exclusive one. That
+ * one is also taken off the queue, which tells it that it was picked, and
+ * its thread is returned. Returns NULL if there was no exclusive waiter.
+ */
+static inline struct thread *wake_up_one(struct wait_queue_head *head)
+{
+    unsigned long flags;
+    struct wait_queue *curr, *tmp;
+    struct thread *thread = NULL;
+    local_irq_save(flags);
+    MINIOS_STAILQ_FOREACH_SAFE(curr, head, thread_list, tmp)
+    {
+        if (!curr->exclusive) {
+            wake(curr->thread);
+            continue;
+        }
+        remove_wait_queue(head, curr);
+        thread = curr->thread;
+        wake(thread);
+        break;
+    }
+    local_irq_restore(flags);
+    return thread;
+}
+
 #define add_waiter(w, wq) do {  \
     unsigned long flags;        \
     local_irq_save(flags);      \
@@ -90,6 +132,36 @@ static inline void wake_up(struct wait_queue_head *head)
 
 #define wait_event(wq, condition) wait_event_deadline(wq, condition, 0) 
 
+/*
+ * Sleep as an exclusive waiter on wq until wake_up_one() picks us, so that
+ * whatever the waker releases is handed over directly instead of being up
+ * for grabs. Must be entered with interrupts saved in flags, which are
+ * disabled again on return. granted is 0 if the deadline passed first.
+ */
+#define wait_handoff_deadline(wq, flags, deadline, granted) do { \
+    DEFINE_WAIT(__wait);                                        \
+    granted = 1;                                                \
+    add_wait_queue_exclusive(&wq, &__wait);                     \
+    while (__wait.waiting) {                                    \
+        if ((deadline) && NOW() >= (deadline)) {                \
+            remove_wait_queue(&wq, &__wait);                    \
+            granted = 0;                                        \
+            break;                                              \
+        }                                                       \
+        get_current()->wakeup_time = deadline;                  \
+        clear_runnable(get_current());                          \
+        local_irq_restore(flags);                               \
+        schedule();                                             \
+        local_irq_save(flags);                                  \
+    }                                                           \
+} while (0)
+
+#define wait_handoff(wq, flags) do {                            \
+    int __granted;                                              \
+    wait_handoff_deadline(wq, flags, 0, __granted);             \
+    (void)__granted;                                            \
+} while (0)
+
 
 
 #endif /* __WAIT_H__ */
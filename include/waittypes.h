@@ -7,6 +7,7 @@ struct thread;
 struct wait_queue
 {
     int waiting;
+    int exclusive;
     struct thread *thread;
     MINIOS_STAILQ_ENTRY(struct wait_queue) thread_list;
 };
@@ -655,6 +655,15 @@ static inline void cpuid(uint32_t leaf,
                   : "0" (leaf));
 }
 
+static inline void cpuid_count(uint32_t leaf, uint32_t subleaf,
+                               uint32_t *eax, uint32_t *ebx,
+                               uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile ("cpuid"
+                  : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                  : "0" (leaf), "2" (subleaf));
+}
+
 #undef ADDR
 
 #ifdef CONFIG_PARAVIRT
@@ -28,20 +28,39 @@ static inline void get_xenbus(void *p)
    set to a malloc'd copy of the value. */
 char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value);
 
+/* As xenbus_read, but copies the nul terminated value into buf without
+   allocating.  Fails with "E2BIG" if it does not fit in len bytes. */
+char *xenbus_read_into(xenbus_transaction_t xbt, const char *path,
+                       char *buf, unsigned len);
+
 /* Watch event queue */
 struct xenbus_event {
     /* Keep these two as this for xs.c */
     char *path;
     char *token;
     struct xenbus_event *next;
+    /* Private to xenbus.c */
+    struct xenbus_event **queue;
+    struct xenbus_event *hash_next;
 };
+/* Points to the newest event of a circular list, NULL when empty.  Use
+   xenbus_dequeue_event to take events off in arrival order. */
 typedef struct xenbus_event *xenbus_event_queue;
 
 char *xenbus_watch_path_token(xenbus_transaction_t xbt, const char *path, const char *token, xenbus_event_queue *events);
 char *xenbus_unwatch_path_token(xenbus_transaction_t xbt, const char *path, const char *token);
 extern struct wait_queue_head xenbus_watch_queue;
 void xenbus_wait_for_watch(xenbus_event_queue *queue);
+/* Returns the next event of queue, to be released with free(). */
 char **xenbus_wait_for_watch_return(xenbus_event_queue *queue);
+/* As xenbus_wait_for_watch_return, but the event may come from a fixed
+   pool: release it with xenbus_free_event, or convert it with
+   xenbus_event_unpool before handing it to code using free().  The same
+   goes for xenbus_dequeue_event. */
+char **xenbus_wait_for_watch_borrow(xenbus_event_queue *queue);
+void xenbus_free_event(char **path);
+struct xenbus_event *xenbus_dequeue_event(xenbus_event_queue *queue);
+char **xenbus_event_unpool(char **path);
 char* xenbus_wait_for_value(const char *path, const char *value, xenbus_event_queue *queue);
 char *xenbus_wait_for_state_change(const char* path, XenbusState *state, xenbus_event_queue *queue);
 char *xenbus_switch_state(xenbus_transaction_t xbt, const char* path, XenbusState state);
@@ -53,6 +72,13 @@ extern xenbus_event_queue xenbus_events;
 #define xenbus_unwatch_path(xbt, path) xenbus_unwatch_path_token(xbt, path, XENBUS_WATCH_PATH_TOKEN)
 
 
+/* Serve XBT_NIL reads at or below path from a local cache.  The cache
+   is kept coherent by a watch on path, so it suits keys which are read
+   more often than they change.  Returns a malloc'd error string on
+   failure. */
+char *xenbus_cache_subtree(const char *path);
+char *xenbus_uncache_subtree(const char *path);
+
 /* Associates a value with a path.  Returns a malloc'd error string on
    failure. */
 char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value);
@@ -71,6 +97,55 @@ xenbus_msg_reply(int type,
                  struct write_req *io,
                  int nr_reqs);
 
+/* Asynchronous form of xenbus_msg_reply.  xenbus_msg_send puts the
+   request on the ring and returns its id without waiting.
+   xenbus_msg_wait blocks until the reply for that id has arrived and
+   returns it; the reply is malloced and should be freed by the caller.
+   Several requests may be in flight from one thread at a time. */
+int xenbus_msg_send(int type,
+                    xenbus_transaction_t trans,
+                    struct write_req *io,
+                    int nr_reqs);
+int xenbus_msg_ready(int id);
+struct xsd_sockmsg *xenbus_msg_wait(int id);
+
+/* A batch of operations which are written to the ring back-to-back by
+   xenbus_batch_submit, so that all of them cost about one round-trip.
+   Each xenbus_batch_* builder returns the index of its operation, to be
+   passed to xenbus_batch_result once the batch has been submitted. */
+#define XENBUS_BATCH_MAX 16
+
+struct xenbus_batch_op {
+    int type;
+    int id;
+    char *path;
+    char *value;
+    struct xsd_sockmsg *reply;
+};
+
+struct xenbus_batch {
+    xenbus_transaction_t xbt;
+    int nr_ops;
+    struct xenbus_batch_op ops[XENBUS_BATCH_MAX];
+};
+
+void xenbus_batch_init(struct xenbus_batch *batch, xenbus_transaction_t xbt);
+int xenbus_batch_read(struct xenbus_batch *batch, const char *path);
+int xenbus_batch_write(struct xenbus_batch *batch, const char *path,
+                       const char *value);
+int xenbus_batch_rm(struct xenbus_batch *batch, const char *path);
+int xenbus_batch_printf(struct xenbus_batch *batch, const char *node,
+                        const char *path, const char *fmt, ...)
+                   __attribute__((__format__(printf, 4, 5)));
+/* Returns a malloc'd copy of the first error, or NULL. */
+char *xenbus_batch_submit(struct xenbus_batch *batch);
+/* Returns a malloc'd error string on failure and sets *value to NULL.
+   On success, *value is set to a malloc'd copy of the value. */
+char *xenbus_batch_result(struct xenbus_batch *batch, int op, char **value);
+/* Returns -1 on error. */
+int xenbus_batch_read_integer(struct xenbus_batch *batch, int op);
+void xenbus_batch_free(struct xenbus_batch *batch);
+
 /* Removes the value associated with a path.  Returns a malloc'd error
    string on failure. */
 char *xenbus_rm(xenbus_transaction_t xbt, const char *path);
@@ -81,6 +156,12 @@ char *xenbus_rm(xenbus_transaction_t xbt, const char *path);
    is NULL terminated.  May block. */
 char *xenbus_ls(xenbus_transaction_t xbt, const char *prefix, char ***contents);
 
+/* Call fn(name, arg) for each entry of a directory without allocating,
+   stopping early if fn returns non-zero.  name is only valid during
+   the call.  Returns a malloc'd error string on failure.  May block. */
+char *xenbus_ls_iter(xenbus_transaction_t xbt, const char *prefix,
+                     int (*fn)(const char *name, void *arg), void *arg);
+
 /* Reads permissions associated with a path.  Returns a malloc'd error
    string on failure and sets *value to NULL.  On success, *value is
    set to a malloc'd copy of the value. */
@@ -116,6 +197,10 @@ char* xenbus_printf(xenbus_transaction_t xbt,
 /* Utility function to figure out our domain id */
 domid_t xenbus_get_self_id(void);
 
+/* Print and clear the per request type round-trip time histograms */
+void xenbus_dump_stats(void);
+void xenbus_reset_stats(void);
+
 #ifdef CONFIG_XENBUS
 /* Reset the XenBus system. */
 void fini_xenbus(void);
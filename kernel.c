@@ -36,6 +36,7 @@
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/sched.h>
+#include <mini-os/tasklet.h>
 #include <mini-os/xenbus.h>
 #include <mini-os/gnttab.h>
 #include <mini-os/netfront.h>
@@ -43,6 +44,7 @@
 #include <mini-os/fbfront.h>
 #include <mini-os/pcifront.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/balloon.h>
 #include <fcntl.h>
 #include <xen/features.h>
 #include <xen/version.h>
@@ -129,6 +131,11 @@ void start_kernel(void)
     /* Init memory management. */
     init_mm();
 
+#ifdef CONFIG_EVTCHN_FIFO
+    /* Switch event channel ABI before anything binds a port */
+    init_evtchn_fifo();
+#endif
+
     /* Init time and timers. */
     init_time();
 
@@ -140,10 +147,19 @@ void start_kernel(void)
     
     /* Init scheduler. */
     init_sched();
+
+    /* Run deferred work from event handlers */
+    init_tasklets();
+
+    /* Drain printk output asynchronously from now on */
+    init_console_thread();
  
     /* Init XenBus */
     init_xenbus();
 
+    /* Start tracking the memory target */
+    init_balloon();
+
 #ifdef CONFIG_XENBUS
     create_thread("shutdown", shutdown_thread, NULL);
 #endif
@@ -159,6 +175,8 @@ void stop_kernel(void)
 {
     /* TODO: fs import */
 
+    console_flush();
+
     local_irq_disable();
 
     /* Reset grant tables */
@@ -191,6 +209,7 @@ void do_exit(void)
 {
     printk("Do_exit called!\n");
     arch_do_exit();
+    console_flush();
     for( ;; )
     {
         struct sched_shutdown sched_shutdown = { .reason = SHUTDOWN_crash };
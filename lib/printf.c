@@ -65,6 +65,15 @@
 #define MAXNBUF	65
 
 static char const hex2ascii_data[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+static char const hex2ascii_upper[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+/* Two decimal digits at a time, halving the number of divisions. */
+static char const digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
 /*
  * Put a NUL-terminated ASCII number (base <= 36) in a buffer in reverse
  * order; return an optional length and a pointer to the last character
@@ -74,14 +83,51 @@ static char const hex2ascii_data[] = "0123456789abcdefghijklmnopqrstuvwxyz";
 static char *
 ksprintn(char *nbuf, uintmax_t num, int base, int *lenp, int upper)
 {
-	char *p, c;
+	const char *digits = upper ? hex2ascii_upper : hex2ascii_data;
+	const char *d;
+	unsigned long lnum;
+	char *p;
 
 	p = nbuf;
 	*p = '\0';
-	do {
-		c = hex2ascii_data[num % base];
-		*++p = upper ? toupper(c) : c;
-	} while (num /= base);
+	switch (base) {
+	case 10:
+		/* Stick to native word divisions where the value allows it. */
+		while (num > ULONG_MAX) {
+			d = &digit_pairs[(num % 100) * 2];
+			num /= 100;
+			*++p = d[1];
+			*++p = d[0];
+		}
+		lnum = num;
+		while (lnum >= 100) {
+			d = &digit_pairs[(lnum % 100) * 2];
+			lnum /= 100;
+			*++p = d[1];
+			*++p = d[0];
+		}
+		if (lnum >= 10) {
+			d = &digit_pairs[lnum * 2];
+			*++p = d[1];
+			*++p = d[0];
+		} else
+			*++p = digits[lnum];
+		break;
+	case 16:
+		do {
+			*++p = digits[num & 0xf];
+		} while (num >>= 4);
+		break;
+	case 8:
+		do {
+			*++p = digits[num & 7];
+		} while (num >>= 3);
+		break;
+	default:
+		do {
+			*++p = digits[num % base];
+		} while (num /= base);
+	}
 	if (lenp)
 		*lenp = p - nbuf;
 	return (p);
@@ -316,7 +362,24 @@ strtouq(const char *nptr, char **endptr, int base)
 int
 vsnprintf(char *str, size_t size, char const *fmt, va_list ap)
 {
-#define PCHAR(c) { if (size >= 2) { *str++ = c; size--; } retval++; }
+#define PCHAR(c) {                                                       \
+        int __c = (c);                                                  \
+        if (size >= 2) {                                                \
+                *str++ = __c;                                           \
+                size--;                                                 \
+        }                                                               \
+        retval++;                                                       \
+}
+#define PSTR(s, len) {                                                  \
+        size_t __len = (len);                                           \
+        if (size >= 2) {                                                \
+                size_t __n = __len < size - 1 ? __len : size - 1;       \
+                memcpy(str, s, __n);                                    \
+                str += __n;                                             \
+                size -= __n;                                            \
+        }                                                               \
+        retval += __len;                                                \
+}
         char nbuf[MAXNBUF];
         const char *p, *percent;
         int ch, n;
@@ -335,15 +398,59 @@ vsnprintf(char *str, size_t size, char const *fmt, va_list ap)
         for (;;) {
                 padc = ' ';
                 width = 0;
-                while ((ch = (u_char)*fmt++) != '%' || stop) {
-                        if (ch == '\0') {
-                                if (size >= 1)
-                                        *str++ = '\0';
-                                return (retval);
-                        }
-                        PCHAR(ch);
+                /* Copy the literal text up to the next conversion in one go. */
+                for (p = fmt; *p && (*p != '%' || stop); p++)
+                        continue;
+                PSTR(fmt, p - fmt);
+                fmt = p;
+                if ((ch = (u_char)*fmt++) == '\0') {
+                        if (size >= 1)
+                                *str++ = '\0';
+                        return (retval);
                 }
                 percent = fmt - 1;
+
+                /*
+                 * Fast path for the common conversions without flags,
+                 * width or precision: %s, %d, %u, %x, %ld, %lu and %lx.
+                 */
+                ch = (u_char)*fmt;
+                lflag = 0;
+                if (ch == 'l') {
+                        lflag = 1;
+                        ch = (u_char)fmt[1];
+                }
+                switch (ch) {
+                case 's':
+                        if (lflag)
+                                break;
+                        fmt++;
+                        p = va_arg(ap, char *);
+                        if (p == NULL)
+                                p = "(null)";
+                        PSTR(p, strlen(p));
+                        continue;
+                case 'd':
+                        fmt += lflag + 1;
+                        num = lflag ? va_arg(ap, long) : va_arg(ap, int);
+                        if ((intmax_t)num < 0) {
+                                PCHAR('-');
+                                num = -(intmax_t)num;
+                        }
+                        p = ksprintn(nbuf, num, 10, &n, 0);
+                        while (*p)
+                                PCHAR(*p--);
+                        continue;
+                case 'u':
+                case 'x':
+                        fmt += lflag + 1;
+                        num = lflag ? va_arg(ap, u_long) : va_arg(ap, u_int);
+                        p = ksprintn(nbuf, num, ch == 'u' ? 10 : 16, &n, 0);
+                        while (*p)
+                                PCHAR(*p--);
+                        continue;
+                }
+
                 qflag = 0; lflag = 0; ladjust = 0; sharpflag = 0; neg = 0;
                 sign = 0; dot = 0; dwidth = 0; upper = 0;
                 cflag = 0; hflag = 0; jflag = 0; tflag = 0; zflag = 0;
@@ -466,8 +573,7 @@ reswitch:       switch (ch = (u_char)*fmt++) {
                         if (!ladjust && width > 0)
                                 while (width--)
                                         PCHAR(padc);
-                        while (n--)
-                                PCHAR(*p++);
+                        PSTR(p, n);
                         if (ladjust && width > 0)
                                 while (width--)
                                         PCHAR(padc);
@@ -583,6 +689,7 @@ number:
                         break;
                 }
         }
+#undef PSTR
 #undef PCHAR
 }
 
@@ -0,0 +1,493 @@
+/*
+ * POSIX threads on top of Mini-OS threads
+ *
+ * Scheduling is cooperative on a single CPU, so the state below only needs
+ * protecting against interrupt handlers, and only where it is shared with
+ * wait queues.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/sched.h>
+#include <mini-os/wait.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/lib.h>
+#include <errno.h>
+#include <mini-os/posix/pthread.h>
+
+struct pthread {
+    struct thread *thread;
+    void *(*start_routine)(void *);
+    void *arg;
+    void *retval;
+    int detached;
+    int exited;
+    struct wait_queue_head join_wait;
+    const void *specific[PTHREAD_KEYS_MAX];
+    unsigned int specific_gen[PTHREAD_KEYS_MAX];
+};
+
+/* A value only belongs to a key if it was set with the key's current
+ * generation, so values of deleted keys never show up in new ones */
+static struct {
+    int used;
+    unsigned int gen;
+    void (*destr)(void *);
+} keys[PTHREAD_KEYS_MAX];
+
+static struct pthread *alloc_pthread(void)
+{
+    struct pthread *p = xmalloc(struct pthread);
+
+    if (!p)
+        return NULL;
+    memset(p, 0, sizeof(*p));
+    init_waitqueue_head(&p->join_wait);
+    return p;
+}
+
+/* Threads not created through pthread_create get their pthread the first
+ * time they need one */
+pthread_t pthread_self(void)
+{
+    struct thread *thread = get_current();
+
+    if (!thread->pthread) {
+        thread->pthread = alloc_pthread();
+        BUG_ON(!thread->pthread);
+        thread->pthread->thread = thread;
+        thread->pthread->detached = 1;
+    }
+    return thread->pthread;
+}
+
+int pthread_attr_init(pthread_attr_t *attr)
+{
+    attr->detachstate = PTHREAD_CREATE_JOINABLE;
+    return 0;
+}
+
+int pthread_attr_destroy(pthread_attr_t *attr)
+{
+    return 0;
+}
+
+int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate)
+{
+    if (detachstate != PTHREAD_CREATE_JOINABLE &&
+        detachstate != PTHREAD_CREATE_DETACHED)
+        return EINVAL;
+    attr->detachstate = detachstate;
+    return 0;
+}
+
+int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate)
+{
+    *detachstate = attr->detachstate;
+    return 0;
+}
+
+static void pthread_start(void *data)
+{
+    struct pthread *p = data;
+
+    get_current()->pthread = p;
+    pthread_exit(p->start_routine(p->arg));
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg)
+{
+    struct pthread *p = alloc_pthread();
+
+    if (!p)
+        return EAGAIN;
+    p->start_routine = start_routine;
+    p->arg = arg;
+    p->detached = attr && attr->detachstate == PTHREAD_CREATE_DETACHED;
+    p->thread = create_thread("pthread", pthread_start, p);
+    *thread = p;
+    return 0;
+}
+
+static void run_key_destructors(struct pthread *p)
+{
+    int i, n, again;
+    const void *value;
+
+    for (n = 0; n < PTHREAD_DESTRUCTOR_ITERATIONS; n++) {
+        again = 0;
+        for (i = 0; i < PTHREAD_KEYS_MAX; i++) {
+            value = p->specific[i];
+            if (!value || !keys[i].used || !keys[i].destr ||
+                p->specific_gen[i] != keys[i].gen)
+                continue;
+            p->specific[i] = NULL;
+            keys[i].destr((void *) value);
+            again = 1;
+        }
+        if (!again)
+            break;
+    }
+}
+
+/* Called by exit_thread() for every thread which has a pthread, also the
+ * ones which got it from pthread_self() and never call pthread_exit() */
+void pthread_release(struct thread *thread)
+{
+    struct pthread *p = thread->pthread;
+
+    /* Destructors may still use their thread's keys */
+    run_key_destructors(p);
+
+    thread->pthread = NULL;
+    p->thread = NULL;
+    if (p->detached) {
+        xfree(p);
+    } else {
+        p->exited = 1;
+        wake_up(&p->join_wait);
+    }
+}
+
+void pthread_exit(void *retval)
+{
+    pthread_self()->retval = retval;
+    exit_thread();
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+    if (thread == get_current()->pthread)
+        return EDEADLK;
+    if (thread->detached)
+        return EINVAL;
+
+    wait_event(thread->join_wait, thread->exited);
+
+    if (retval)
+        *retval = thread->retval;
+    xfree(thread);
+    return 0;
+}
+
+int pthread_detach(pthread_t thread)
+{
+    if (thread->detached)
+        return EINVAL;
+    if (thread->exited)
+        xfree(thread);
+    else
+        thread->detached = 1;
+    return 0;
+}
+
+
+
+int pthread_key_create(pthread_key_t *key, void (*destr_function)(void*))
+{
+    int i;
+
+    for (i = 0; i < PTHREAD_KEYS_MAX; i++) {
+        if (!keys[i].used)
+            break;
+    }
+    if (i == PTHREAD_KEYS_MAX)
+        return EAGAIN;
+
+    keys[i].used = 1;
+    keys[i].gen++;
+    keys[i].destr = destr_function;
+    *key = i;
+    return 0;
+}
+
+int pthread_key_delete(pthread_key_t key)
+{
+    if (key >= PTHREAD_KEYS_MAX || !keys[key].used)
+        return EINVAL;
+    keys[key].used = 0;
+    keys[key].destr = NULL;
+    return 0;
+}
+
+int pthread_setspecific(pthread_key_t key, const void *pointer)
+{
+    if (key >= PTHREAD_KEYS_MAX || !keys[key].used)
+        return EINVAL;
+    pthread_self()->specific[key] = pointer;
+    pthread_self()->specific_gen[key] = keys[key].gen;
+    return 0;
+}
+
+void *pthread_getspecific(pthread_key_t key)
+{
+    struct pthread *p = get_current()->pthread;
+
+    if (key >= PTHREAD_KEYS_MAX || !keys[key].used || !p ||
+        p->specific_gen[key] != keys[key].gen)
+        return NULL;
+    return (void *) p->specific[key];
+}
+
+
+
+int pthread_mutexattr_init(pthread_mutexattr_t *mattr)
+{
+    mattr->type = PTHREAD_MUTEX_DEFAULT;
+    return 0;
+}
+
+int pthread_mutexattr_settype(pthread_mutexattr_t *mattr, int kind)
+{
+    if (kind != PTHREAD_MUTEX_NORMAL && kind != PTHREAD_MUTEX_RECURSIVE &&
+        kind != PTHREAD_MUTEX_ERRORCHECK)
+        return EINVAL;
+    mattr->type = kind;
+    return 0;
+}
+
+int pthread_mutexattr_destroy(pthread_mutexattr_t *mattr)
+{
+    return 0;
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *mattr)
+{
+    mutex->type = mattr ? mattr->type : PTHREAD_MUTEX_DEFAULT;
+    mutex->owner = NULL;
+    mutex->count = 0;
+    init_waitqueue_head(&mutex->wait);
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+    if (mutex->owner)
+        return EBUSY;
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    struct thread *self = get_current();
+    unsigned long flags;
+    int ret = 0;
+
+    local_irq_save(flags);
+    if (!mutex->owner) {
+        mutex->owner = self;
+        mutex->count = 1;
+    } else if (mutex->owner == self && mutex->type == PTHREAD_MUTEX_RECURSIVE) {
+        mutex->count++;
+    } else {
+        ret = EBUSY;
+    }
+    local_irq_restore(flags);
+    return ret;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    struct thread *self = get_current();
+    unsigned long flags;
+
+    if (mutex->owner == self && mutex->type == PTHREAD_MUTEX_ERRORCHECK)
+        return EDEADLK;
+
+    local_irq_save(flags);
+    if (!mutex->owner) {
+        mutex->owner = self;
+        mutex->count = 1;
+    } else if (mutex->owner == self && mutex->type == PTHREAD_MUTEX_RECURSIVE) {
+        mutex->count++;
+    } else {
+        /* pthread_mutex_unlock() makes us the owner before waking us */
+        wait_handoff(mutex->wait, flags);
+        mutex->count = 1;
+    }
+    local_irq_restore(flags);
+    return 0;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    unsigned long flags;
+
+    if (mutex->owner != get_current())
+        return EPERM;
+
+    local_irq_save(flags);
+    if (!--mutex->count)
+        mutex->owner = wake_up_one(&mutex->wait);
+    local_irq_restore(flags);
+    return 0;
+}
+
+
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    cond->waiters = 0;
+    cond->wakeups = 0;
+    init_waitqueue_head(&cond->wait);
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    if (cond->waiters)
+        return EBUSY;
+    return 0;
+}
+
+static int cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                     s_time_t deadline)
+{
+    unsigned int count;
+    int ret;
+
+    if (mutex->owner != get_current())
+        return EPERM;
+
+    /* Release the mutex entirely, even if it is held recursively */
+    count = mutex->count;
+    mutex->count = 1;
+    cond->waiters++;
+    pthread_mutex_unlock(mutex);
+
+    wait_event_deadline(cond->wait, cond->wakeups, deadline);
+    if (cond->wakeups) {
+        cond->wakeups--;
+        ret = 0;
+    } else {
+        ret = ETIMEDOUT;
+    }
+    cond->waiters--;
+
+    pthread_mutex_lock(mutex);
+    mutex->count = count;
+    return ret;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    return cond_wait(cond, mutex, 0);
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime)
+{
+    struct timeval now;
+    s_time_t delta;
+
+    /* abstime is wall clock time, turn it into system time */
+    gettimeofday(&now, NULL);
+    delta = SECONDS(abstime->tv_sec - now.tv_sec) +
+            abstime->tv_nsec - (s_time_t) now.tv_usec * 1000;
+    if (delta < 1)
+        delta = 1;
+    return cond_wait(cond, mutex, NOW() + delta);
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    if (cond->wakeups < cond->waiters) {
+        cond->wakeups++;
+        wake_up(&cond->wait);
+    }
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    if (cond->wakeups < cond->waiters) {
+        cond->wakeups = cond->waiters;
+        wake_up(&cond->wait);
+    }
+    return 0;
+}
+
+
+
+int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr)
+{
+    rwlock->readers = 0;
+    rwlock->writers_waiting = 0;
+    rwlock->writer = NULL;
+    init_waitqueue_head(&rwlock->wait);
+    return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rwlock)
+{
+    if (rwlock->readers || rwlock->writer)
+        return EBUSY;
+    return 0;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)
+{
+    if (rwlock->writer || rwlock->writers_waiting)
+        return EBUSY;
+    rwlock->readers++;
+    return 0;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)
+{
+    if (rwlock->writer == get_current())
+        return EDEADLK;
+    while (pthread_rwlock_tryrdlock(rwlock))
+        wait_event(rwlock->wait, !rwlock->writer && !rwlock->writers_waiting);
+    return 0;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)
+{
+    if (rwlock->writer || rwlock->readers)
+        return EBUSY;
+    rwlock->writer = get_current();
+    return 0;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)
+{
+    if (rwlock->writer == get_current())
+        return EDEADLK;
+    rwlock->writers_waiting++;
+    while (rwlock->writer || rwlock->readers)
+        wait_event(rwlock->wait, !rwlock->writer && !rwlock->readers);
+    rwlock->writers_waiting--;
+    rwlock->writer = get_current();
+    return 0;
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock)
+{
+    if (rwlock->writer) {
+        if (rwlock->writer != get_current())
+            return EPERM;
+        rwlock->writer = NULL;
+    } else if (rwlock->readers) {
+        rwlock->readers--;
+    } else {
+        return EPERM;
+    }
+    wake_up(&rwlock->wait);
+    return 0;
+}
+
+
+
+int pthread_once(pthread_once_t *once_control, void (*init_routine)(void))
+{
+    /* 0: not run yet, 1: running, 2: done */
+    if (once_control->done == 0) {
+        once_control->done = 1;
+        init_routine();
+        once_control->done = 2;
+    }
+    while (once_control->done == 1)
+        schedule();
+    return 0;
+}
@@ -62,12 +62,122 @@ int ffsll (long long int lli)
 #include <mini-os/lib.h>
 #include <mini-os/xmalloc.h>
 
+/*
+ * The memory functions below work a word at a time where alignment
+ * allows it and fall back to the plain byte loops for the rest.
+ */
+typedef unsigned long __attribute__((__may_alias__)) word_t;
+
+#define WORD_SIZE       sizeof(word_t)
+#define WORD_MASK       (WORD_SIZE - 1)
+#define WORD_ONES       (~0UL / 0xff)
+#define WORD_HIGHS      (WORD_ONES * 0x80)
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+#define word_aligned(p) (!((unsigned long)(p) & WORD_MASK))
+
+#if defined(__i386__) || defined(__x86_64__)
+/*
+ * Copies of at least this size use the string instructions.  With ERMS
+ * (enhanced rep movsb/stosb) a plain byte rep is as fast as anything
+ * else and has no alignment requirements.
+ */
+#define REP_THRESHOLD   256
+#define ERMS_THRESHOLD  64
+
+#ifdef __x86_64__
+#define REP_MOVS_WORD   "rep movsq"
+#define REP_STOS_WORD   "rep stosq"
+#else
+#define REP_MOVS_WORD   "rep movsl"
+#define REP_STOS_WORD   "rep stosl"
+#endif
+
+static int have_erms;
+
+void init_string_ops(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7)
+        return;
+    cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+    have_erms = !!(ebx & (1U << 9));
+}
+
+static inline int arch_memcpy(void *dest, const void *src, size_t count)
+{
+    unsigned long d0, d1, d2;
+
+    if (have_erms && count >= ERMS_THRESHOLD) {
+        asm volatile ("rep movsb"
+                      : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+                      : "0" (count), "1" (dest), "2" (src)
+                      : "memory");
+        return 1;
+    }
+    if (count < REP_THRESHOLD)
+        return 0;
+    asm volatile (REP_MOVS_WORD "\n\t"
+                  "mov %4, %0\n\t"
+                  "rep movsb"
+                  : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+                  : "0" (count / WORD_SIZE), "r" (count & WORD_MASK),
+                    "1" (dest), "2" (src)
+                  : "memory");
+    return 1;
+}
+
+static inline int arch_memset(void *s, unsigned long fill, size_t count)
+{
+    unsigned long d0, d1;
+
+    if (have_erms && count >= ERMS_THRESHOLD) {
+        asm volatile ("rep stosb"
+                      : "=&c" (d0), "=&D" (d1)
+                      : "0" (count), "1" (s), "a" (fill)
+                      : "memory");
+        return 1;
+    }
+    if (count < REP_THRESHOLD)
+        return 0;
+    asm volatile (REP_STOS_WORD "\n\t"
+                  "mov %3, %0\n\t"
+                  "rep stosb"
+                  : "=&c" (d0), "=&D" (d1)
+                  : "0" (count / WORD_SIZE), "r" (count & WORD_MASK),
+                    "1" (s), "a" (fill)
+                  : "memory");
+    return 1;
+}
+#else
+void init_string_ops(void)
+{
+}
+
+#define arch_memcpy(dest, src, count)   0
+#define arch_memset(s, fill, count)     0
+#endif
+
 int memcmp(const void * cs,const void * ct,size_t count)
 {
 	const unsigned char *su1, *su2;
 	signed char res = 0;
 
-	for( su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
+	su1 = cs;
+	su2 = ct;
+	/* Skip equal words, the byte loop finds the difference. */
+	if (word_aligned(su1) && word_aligned(su2)) {
+		while (count >= WORD_SIZE &&
+		       *(const word_t *)su1 == *(const word_t *)su2) {
+			su1 += WORD_SIZE;
+			su2 += WORD_SIZE;
+			count -= WORD_SIZE;
+		}
+	}
+
+	for( ; 0 < count; ++su1, ++su2, count--)
 		if ((res = *su1 - *su2) != 0)
 			break;
 	return res;
@@ -78,6 +188,21 @@ void * memcpy(void * dest,const void *src,size_t count)
 	char *tmp = (char *) dest;
     const char *s = src;
 
+    if (arch_memcpy(dest, src, count))
+        return dest;
+
+    if (((unsigned long)tmp & WORD_MASK) == ((unsigned long)s & WORD_MASK)) {
+        while (count && !word_aligned(s)) {
+            *tmp++ = *s++;
+            count--;
+        }
+        for (; count >= WORD_SIZE; count -= WORD_SIZE) {
+            *(word_t *)tmp = *(const word_t *)s;
+            tmp += WORD_SIZE;
+            s += WORD_SIZE;
+        }
+    }
+
 	while (count--)
 		*tmp++ = *s++;
 
@@ -100,6 +225,20 @@ int strncmp(const char * cs,const char * ct,size_t count)
 int strcmp(const char * cs,const char * ct)
 {
         register signed char __res;
+        word_t w;
+
+        /* Skip equal words holding no NUL, the byte loop finds the end.
+         * Aligned words never cross into an unmapped page. */
+        if (((unsigned long)cs & WORD_MASK) == ((unsigned long)ct & WORD_MASK)) {
+                for (; !word_aligned(cs); cs++, ct++)
+                        if ((__res = *cs - *ct) != 0 || !*cs)
+                                return __res;
+                while ((w = *(const word_t *)cs) == *(const word_t *)ct &&
+                       !WORD_HAS_ZERO(w)) {
+                        cs += WORD_SIZE;
+                        ct += WORD_SIZE;
+                }
+        }
 
         while (1) {
                 if ((__res = *cs - *ct++) != 0 || !*cs++)
@@ -131,6 +270,19 @@ char * strncpy(char * dest,const char *src,size_t count)
 void * memset(void * s,int c,size_t count)
 {
         char *xs = (char *) s;
+        unsigned long fill = WORD_ONES * (unsigned char)c;
+
+        if (arch_memset(s, fill, count))
+                return s;
+
+        while (count && !word_aligned(xs)) {
+                *xs++ = c;
+                count--;
+        }
+        for (; count >= WORD_SIZE; count -= WORD_SIZE) {
+                *(word_t *)xs = fill;
+                xs += WORD_SIZE;
+        }
 
         while (count--)
                 *xs++ = c;
@@ -163,8 +315,17 @@ char * strcat(char * dest, const char * src)
 size_t strlen(const char * s)
 {
 	const char *sc;
+	const word_t *w;
+
+	for (sc = s; !word_aligned(sc); ++sc)
+		if (*sc == '\0')
+			return sc - s;
+
+	/* An aligned word never crosses a page, so reading past the end is safe. */
+	for (w = (const word_t *)sc; !WORD_HAS_ZERO(*w); w++)
+		/* nothing */;
 
-	for (sc = s; *sc != '\0'; ++sc)
+	for (sc = (const char *)w; *sc != '\0'; ++sc)
 		/* nothing */;
 	return sc - s;
 }
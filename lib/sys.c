@@ -1300,7 +1300,7 @@ unsigned int sleep(unsigned int seconds)
 int clock_gettime(clockid_t clk_id, struct timespec *tp)
 {
     switch (clk_id) {
-	case CLOCK_MONOTONIC:
+	case CLOCK_REALTIME:
 	{
 	    struct timeval tv;
 
@@ -1311,9 +1311,11 @@ int clock_gettime(clockid_t clk_id, struct timespec *tp)
 
 	    break;
 	}
-	case CLOCK_REALTIME:
+	case CLOCK_MONOTONIC:
+	case CLOCK_MONOTONIC_COARSE:
 	{
-	    uint64_t nsec = monotonic_clock();
+	    uint64_t nsec = clk_id == CLOCK_MONOTONIC ?
+		monotonic_clock() : monotonic_clock_coarse();
 
 	    tp->tv_sec = nsec / 1000000000ULL;
 	    tp->tv_nsec = nsec % 1000000000ULL;
@@ -29,11 +29,10 @@ struct xs_handle *xs_daemon_open()
 void xs_daemon_close(struct xs_handle *h)
 {
     int fd = _xs_fileno(h);
-    struct xenbus_event *event, *next;
-    for (event = files[fd].xenbus.events; event; event = next)
+    struct xenbus_event *event;
+    while ((event = xenbus_dequeue_event(&files[fd].xenbus.events)))
     {
-        next = event->next;
-        free(event);
+        xenbus_free_event(&event->path);
     }
     files[fd].type = FTYPE_NONE;
 }
@@ -179,11 +178,11 @@ char **xs_read_watch(struct xs_handle *h, unsigned int *num)
 {
     int fd = _xs_fileno(h);
     struct xenbus_event *event;
-    event = files[fd].xenbus.events;
-    files[fd].xenbus.events = event->next;
+    event = xenbus_dequeue_event(&files[fd].xenbus.events);
     printk("xs_read_watch() -> %s %s\n", event->path, event->token);
     *num = 2;
-    return (char **) &event->path;
+    /* The caller frees the event */
+    return xenbus_event_unpool(&event->path);
 }
 
 bool xs_unwatch(struct xs_handle *h, const char *path, const char *token)
@@ -18,17 +18,16 @@ int ___lock_init(_LOCK_T *lock)
     return 0;
 }
 
+/* Releasing a contended lock hands it to the longest waiter, which then
+ * owns it on wakeup */
 int ___lock_acquire(_LOCK_T *lock)
 {
     unsigned long flags;
-    while(1) {
-        wait_event(lock->wait, !lock->busy);
-        local_irq_save(flags);
-        if (!lock->busy)
-            break;
-        local_irq_restore(flags);
-    }
-    lock->busy = 1;
+    local_irq_save(flags);
+    if (!lock->busy)
+        lock->busy = 1;
+    else
+        wait_handoff(lock->wait, flags);
     local_irq_restore(flags);
     return 0;
 }
@@ -50,8 +49,7 @@ int ___lock_release(_LOCK_T *lock)
 {
     unsigned long flags;
     local_irq_save(flags);
-    lock->busy = 0;
-    wake_up(&lock->wait);
+    lock->busy = wake_up_one(&lock->wait) != NULL;
     local_irq_restore(flags);
     return 0;
 }
@@ -68,14 +66,11 @@ int ___lock_acquire_recursive(_LOCK_RECURSIVE_T *lock)
 {
     unsigned long flags;
     if (lock->owner != get_current()) {
-        while (1) {
-            wait_event(lock->wait, lock->owner == NULL);
-            local_irq_save(flags);
-            if (lock->owner == NULL)
-                break;
-            local_irq_restore(flags);
-        }
-        lock->owner = get_current();
+        local_irq_save(flags);
+        if (lock->owner == NULL)
+            lock->owner = get_current();
+        else
+            wait_handoff(lock->wait, flags);
         local_irq_restore(flags);
     }
     lock->count++;
@@ -103,8 +98,7 @@ int ___lock_release_recursive(_LOCK_RECURSIVE_T *lock)
     if (--lock->count)
         return 0;
     local_irq_save(flags);
-    lock->owner = NULL;
-    wake_up(&lock->wait);
+    lock->owner = wake_up_one(&lock->wait);
     local_irq_restore(flags);
     return 0;
 }
@@ -52,9 +52,6 @@ void sys_sem_signal(sys_sem_t sem)
  * (i.e., it was already signaled), the function may return zero. */
 uint32_t sys_arch_sem_wait(sys_sem_t sem, uint32_t timeout)
 {
-    /* Slightly more complicated than the normal minios semaphore:
-     * need to wake on timeout *or* signal */
-    sys_prot_t prot;
     int64_t then = NOW();
     int64_t deadline;
 
@@ -63,40 +60,33 @@ uint32_t sys_arch_sem_wait(sys_sem_t sem, uint32_t timeout)
     else
 	deadline = then + MILLISECS(timeout);
 
-    while(1) {
-        wait_event_deadline(sem->wait, (sem->count > 0), deadline);
-
-        prot = sys_arch_protect();
-	/* Atomically check that we can proceed */
-	if (sem->count > 0 || (deadline && NOW() >= deadline))
-	    break;
-        sys_arch_unprotect(prot);
-    }
-
-    if (sem->count > 0) {
-        sem->count--;
-        sys_arch_unprotect(prot);
-        return NSEC_TO_MSEC(NOW() - then); 
-    }
-    
-    sys_arch_unprotect(prot);
-    return SYS_ARCH_TIMEOUT;
+    if (!down_deadline(sem, deadline))
+        return SYS_ARCH_TIMEOUT;
+    return NSEC_TO_MSEC(NOW() - then);
 }
 
+#define MBOX_DEFAULT_SIZE 32
+
 /* Creates an empty mailbox. */
 sys_mbox_t sys_mbox_new(int size)
 {
-    struct mbox *mbox = xmalloc(struct mbox);
+    struct mbox *mbox;
+    unsigned int slots = 2, i;
+
     if (!size)
-        size = 32;
-    else if (size == 1)
-        size = 2;
-    mbox->count = size;
-    mbox->messages = xmalloc_array(void*, size);
-    init_SEMAPHORE(&mbox->read_sem, 0);
-    mbox->reader = 0;
-    init_SEMAPHORE(&mbox->write_sem, size);
-    mbox->writer = 0;
+        size = MBOX_DEFAULT_SIZE;
+    while (slots < (unsigned int)size)
+        slots <<= 1;
+
+    mbox = _xmalloc(sizeof(*mbox) + slots * sizeof(struct mbox_slot),
+                    __alignof__(struct mbox));
+    mbox->mask = slots - 1;
+    mbox->head = 0;
+    mbox->tail = 0;
+    init_waitqueue_head(&mbox->read_wait);
+    init_waitqueue_head(&mbox->write_wait);
+    for (i = 0; i < slots; i++)
+        mbox->slots[i].seq = i;
     return mbox;
 }
 
@@ -105,24 +95,38 @@ sys_mbox_t sys_mbox_new(int size)
  * programming error in lwIP and the developer should be notified. */
 void sys_mbox_free(sys_mbox_t mbox)
 {
-    ASSERT(mbox->reader == mbox->writer);
-    xfree(mbox->messages);
+    ASSERT(mbox->head == mbox->tail);
     xfree(mbox);
 }
 
-/* Posts the "msg" to the mailbox, internal version that actually does the
- * post. */
-static void do_mbox_post(sys_mbox_t mbox, void *msg)
+/* Posts the "msg" to the mailbox unless it is full, internal version that
+ * actually does the post. Returns 1 if posted. */
+static int do_mbox_post(sys_mbox_t mbox, void *msg)
 {
-    /* The caller got a semaphore token, so we are now allowed to increment
-     * writer, but we still need to prevent concurrency between writers
-     * (interrupt handler vs main) */
-    sys_prot_t prot = sys_arch_protect();
-    mbox->messages[mbox->writer] = msg;
-    mbox->writer = (mbox->writer + 1) % mbox->count;
-    ASSERT(mbox->reader != mbox->writer);
-    sys_arch_unprotect(prot);
-    up(&mbox->read_sem);
+    struct mbox_slot *slot;
+    unsigned int pos = mbox->tail;
+    int diff;
+
+    /* Posts may come from interrupt handlers as well as threads */
+    for (;;) {
+        slot = &mbox->slots[pos & mbox->mask];
+        diff = (int)(slot->seq - pos);
+        if (diff < 0)
+            return 0;
+        if (diff == 0 && synch_cmpxchg(&mbox->tail, pos, pos + 1) == pos)
+            break;
+        pos = mbox->tail;
+    }
+    slot->msg = msg;
+    wmb();
+    slot->seq = pos + 1;
+    mb();
+
+    /* A fetcher only ever waits for the message at head, so the other
+     * posts need not wake anyone */
+    if (mbox->head == pos && !MINIOS_STAILQ_EMPTY(&mbox->read_wait))
+        wake_up(&mbox->read_wait);
+    return 1;
 }
 
 /* Posts the "msg" to the mailbox. */
@@ -130,8 +134,7 @@ void sys_mbox_post(sys_mbox_t mbox, void *msg)
 {
     if (mbox == SYS_MBOX_NULL)
         return;
-    down(&mbox->write_sem);
-    do_mbox_post(mbox, msg);
+    wait_event(mbox->write_wait, do_mbox_post(mbox, msg));
 }
 
 /* Try to post the "msg" to the mailbox. */
@@ -139,29 +142,41 @@ err_t sys_mbox_trypost(sys_mbox_t mbox, void *msg)
 {
     if (mbox == SYS_MBOX_NULL)
         return ERR_BUF;
-    if (!trydown(&mbox->write_sem))
+    if (!do_mbox_post(mbox, msg))
         return ERR_MEM;
-    do_mbox_post(mbox, msg);
     return ERR_OK;
 }
 
 /*
- * Fetch a message from a mailbox. Internal version that actually does the
- * fetch.
+ * Fetch a message from a mailbox unless it is empty. Internal version that
+ * actually does the fetch. Returns 1 if fetched.
  */
-static void do_mbox_fetch(sys_mbox_t mbox, void **msg)
+static int do_mbox_fetch(sys_mbox_t mbox, void **msg)
 {
-    sys_prot_t prot;
-    /* The caller got a semaphore token, so we are now allowed to increment
-     * reader, but we may still need to prevent concurrency between readers.
-     * FIXME: can there be concurrent readers? */
-    prot = sys_arch_protect();
-    ASSERT(mbox->reader != mbox->writer);
+    struct mbox_slot *slot;
+    unsigned int pos = mbox->head;
+    int diff;
+
+    for (;;) {
+        slot = &mbox->slots[pos & mbox->mask];
+        diff = (int)(slot->seq - (pos + 1));
+        if (diff < 0)
+            return 0;
+        if (diff == 0 && synch_cmpxchg(&mbox->head, pos, pos + 1) == pos)
+            break;
+        pos = mbox->head;
+    }
+    rmb();
     if (msg != NULL)
-        *msg = mbox->messages[mbox->reader];
-    mbox->reader = (mbox->reader + 1) % mbox->count;
-    sys_arch_unprotect(prot);
-    up(&mbox->write_sem);
+        *msg = slot->msg;
+    mb();
+    /* Free for the post one lap later */
+    slot->seq = pos + mbox->mask + 1;
+    mb();
+
+    if (!MINIOS_STAILQ_EMPTY(&mbox->write_wait))
+        wake_up(&mbox->write_wait);
+    return 1;
 }
 
 /* Blocks the thread until a message arrives in the mailbox, but does
@@ -176,16 +191,38 @@ static void do_mbox_fetch(sys_mbox_t mbox, void **msg)
  * timeout. */
 uint32_t sys_arch_mbox_fetch(sys_mbox_t mbox, void **msg, uint32_t timeout)
 {
-    uint32_t rv;
+    int64_t then, deadline;
+    int fetched = 0;
+
     if (mbox == SYS_MBOX_NULL)
         return SYS_ARCH_TIMEOUT;
+    if (do_mbox_fetch(mbox, msg))
+        return 0;
+
+    then = NOW();
+    if (timeout == 0)
+	deadline = 0;
+    else
+	deadline = then + MILLISECS(timeout);
+
+    wait_event_deadline(mbox->read_wait,
+                        (fetched = do_mbox_fetch(mbox, msg)), deadline);
+    if (!fetched)
+        return SYS_ARCH_TIMEOUT;
+    return NSEC_TO_MSEC(NOW() - then);
+}
 
-    rv = sys_arch_sem_wait(&mbox->read_sem, timeout);
-    if ( rv == SYS_ARCH_TIMEOUT )
-        return rv;
+int sys_arch_mbox_fetch_batch(sys_mbox_t mbox, void **msgs, int max,
+                              uint32_t timeout)
+{
+    int n;
 
-    do_mbox_fetch(mbox, msg);
-    return 0;
+    if (max <= 0 || sys_arch_mbox_fetch(mbox, msgs, timeout) == SYS_ARCH_TIMEOUT)
+        return 0;
+    /* Whatever was posted meanwhile comes without another wakeup */
+    for (n = 1; n < max && do_mbox_fetch(mbox, &msgs[n]); n++)
+        ;
+    return n;
 }
 
 /* This is similar to sys_arch_mbox_fetch, however if a message is not
@@ -203,10 +240,9 @@ uint32_t sys_arch_mbox_tryfetch(sys_mbox_t mbox, void **msg) {
     if (mbox == SYS_MBOX_NULL)
         return SYS_ARCH_TIMEOUT;
 
-    if (!trydown(&mbox->read_sem))
+    if (!do_mbox_fetch(mbox, msg))
 	return SYS_MBOX_EMPTY;
 
-    do_mbox_fetch(mbox, msg);
     return 0;
 }
 
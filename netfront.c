@@ -16,6 +16,7 @@
 #include <mini-os/netfront.h>
 #include <mini-os/lib.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/tasklet.h>
 
 DECLARE_WAIT_QUEUE_HEAD(netfront_queue);
 
@@ -49,6 +50,7 @@ struct netfront_dev {
     grant_ref_t tx_ring_ref;
     grant_ref_t rx_ring_ref;
     evtchn_port_t evtchn;
+    struct tasklet tasklet;
 
     char *nodename;
     char *backend;
@@ -219,7 +221,7 @@ void network_tx_buf_gc(struct netfront_dev *dev)
 
 }
 
-void netfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+static void netfront_tasklet(void *data)
 {
     int flags;
     struct netfront_dev *dev = data;
@@ -232,6 +234,14 @@ void netfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
     local_irq_restore(flags);
 }
 
+/* Ring processing and the netif_rx callback run in the tasklet */
+void netfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+{
+    struct netfront_dev *dev = data;
+
+    tasklet_schedule(&dev->tasklet);
+}
+
 #ifdef HAVE_LIBC
 void netfront_select_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
@@ -257,6 +267,7 @@ static void free_netfront(struct netfront_dev *dev)
 	down(&dev->tx_sem);
 
     mask_evtchn(dev->evtchn);
+    tasklet_kill(&dev->tasklet);
 
     free(dev->mac);
     free(dev->backend);
@@ -285,6 +296,7 @@ static void free_netfront(struct netfront_dev *dev)
 struct netfront_dev *init_netfront(char *_nodename, void (*thenetif_rx)(unsigned char* data, int len), unsigned char rawmac[6], char **ip)
 {
     xenbus_transaction_t xbt;
+    struct xenbus_batch batch;
     char* err;
     char* message=NULL;
     struct netif_tx_sring *txs;
@@ -320,6 +332,7 @@ struct netfront_dev *init_netfront(char *_nodename, void (*thenetif_rx)(unsigned
     printk("net TX ring size %lu\n", (unsigned long) NET_TX_RING_SIZE);
     printk("net RX ring size %lu\n", (unsigned long) NET_RX_RING_SIZE);
     init_SEMAPHORE(&dev->tx_sem, NET_TX_RING_SIZE);
+    tasklet_init(&dev->tasklet, "netfront", netfront_tasklet, dev);
     for(i=0;i<NET_TX_RING_SIZE;i++)
     {
 	add_id_to_freelist(i,dev->tx_freelist);
@@ -368,29 +381,18 @@ again:
         free(err);
     }
 
-    err = xenbus_printf(xbt, nodename, "tx-ring-ref","%u",
+    xenbus_batch_init(&batch, xbt);
+    xenbus_batch_printf(&batch, nodename, "tx-ring-ref","%u",
                 dev->tx_ring_ref);
-    if (err) {
-        message = "writing tx ring-ref";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename, "rx-ring-ref","%u",
+    xenbus_batch_printf(&batch, nodename, "rx-ring-ref","%u",
                 dev->rx_ring_ref);
-    if (err) {
-        message = "writing rx ring-ref";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, nodename,
+    xenbus_batch_printf(&batch, nodename,
                 "event-channel", "%u", dev->evtchn);
+    xenbus_batch_printf(&batch, nodename, "request-rx-copy", "%u", 1);
+    err = xenbus_batch_submit(&batch);
+    xenbus_batch_free(&batch);
     if (err) {
-        message = "writing event-channel";
-        goto abort_transaction;
-    }
-
-    err = xenbus_printf(xbt, nodename, "request-rx-copy", "%u", 1);
-
-    if (err) {
-        message = "writing request-rx-copy";
+        message = "writing ring-refs and event-channel";
         goto abort_transaction;
     }
 
@@ -418,10 +420,15 @@ abort_transaction:
 
 done:
 
+    xenbus_batch_init(&batch, XBT_NIL);
     snprintf(path, sizeof(path), "%s/backend", nodename);
-    msg = xenbus_read(XBT_NIL, path, &dev->backend);
+    xenbus_batch_read(&batch, path);
     snprintf(path, sizeof(path), "%s/mac", nodename);
-    msg = xenbus_read(XBT_NIL, path, &dev->mac);
+    xenbus_batch_read(&batch, path);
+    free(xenbus_batch_submit(&batch));
+    free(xenbus_batch_result(&batch, 0, &dev->backend));
+    free(xenbus_batch_result(&batch, 1, &dev->mac));
+    xenbus_batch_free(&batch);
 
     if ((dev->backend == NULL) || (dev->mac == NULL)) {
         printk("%s: backend/mac failed\n", __func__);
@@ -20,6 +20,21 @@
 DECLARE_WAIT_QUEUE_HEAD(pcifront_queue);
 static struct pcifront_dev *pcidev;
 
+/* Config space bytes we shadow: vendor and device id, revision and class,
+ * header type, subsystem ids, capability pointer and interrupt pin. These
+ * are read-only so reading them again always gives the same answer. */
+#define PCI_SHADOW_SIZE 64
+#define PCI_SHADOW_RO 0x2010f00000004f0fULL
+
+/* A device exported by the backend, with its physical and virtual address */
+struct pcifront_bdf {
+    unsigned int dom, bus, slot, fun;
+    unsigned int vdom, vbus, vslot, vfun;
+
+    uint64_t shadow_valid;
+    uint8_t shadow[PCI_SHADOW_SIZE];
+};
+
 struct pcifront_dev {
     domid_t dom;
 
@@ -31,6 +46,14 @@ struct pcifront_dev {
     char *backend;
 
     xenbus_event_queue events;
+
+    /* The shared page only holds one op, so callers take turns */
+    int busy;
+
+    /* Cached from xenstore the first time a device is looked up */
+    struct pcifront_bdf *bdfs;
+    int nr_bdfs;
+    int bdfs_stale;
 };
 
 void pcifront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
@@ -50,6 +73,7 @@ static void free_pcifront(struct pcifront_dev *dev)
 
     unbind_evtchn(dev->evtchn);
 
+    free(dev->bdfs);
     free(dev->backend);
     free(dev->nodename);
     free(dev);
@@ -109,6 +133,8 @@ void pcifront_watches(void *opaque)
                     }
                 }
             } else if (state == XenbusStateReconfigured) {
+                /* Devices may have been added or removed */
+                pcidev->bdfs_stale = 1;
                 printk("pcifront_watches: writing %s %d\n", fe_state, XenbusStateConnected);
                 printk("pcifront_watches: changing state to %d\n", XenbusStateConnected);
                 if ((err = xenbus_switch_state(XBT_NIL, fe_state, XenbusStateConnected)) != NULL) {
@@ -168,6 +194,7 @@ struct pcifront_dev *init_pcifront(char *_nodename)
     memset(dev, 0, sizeof(*dev));
     dev->nodename = strdup(nodename);
     dev->dom = dom;
+    dev->bdfs_stale = 1;
 
     evtchn_alloc_unbound(dev->dom, pcifront_handler, dev, &dev->evtchn);
 
@@ -380,67 +407,117 @@ close_pcifront:
         free_pcifront(dev);
 }
 
-int pcifront_physical_to_virtual (struct pcifront_dev *dev,
-                                  unsigned int *dom,
-                                  unsigned int *bus,
-                                  unsigned int *slot,
-                                  unsigned int *fun)
+static void pcifront_lock(struct pcifront_dev *dev)
+{
+    while (dev->busy)
+        wait_event(pcifront_queue, !dev->busy);
+    dev->busy = 1;
+}
+
+static void pcifront_unlock(struct pcifront_dev *dev)
+{
+    dev->busy = 0;
+    wake_up(&pcifront_queue);
+}
+
+static int read_bdf(const char *path, unsigned int *dom, unsigned int *bus,
+                    unsigned int *slot, unsigned int *fun)
+{
+    char buf[32];
+    char *msg;
+
+    msg = xenbus_read_into(XBT_NIL, path, buf, sizeof(buf));
+    if (msg) {
+        printk("Error %s when reading the PCI root name at %s\n", msg, path);
+        free(msg);
+        return -1;
+    }
+    if (sscanf(buf, "%x:%x:%x.%x", dom, bus, slot, fun) != 4) {
+        printk("\"%s\" does not look like a PCI device address\n", buf);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reload the device list from xenstore. Called with the device locked. */
+static void pcifront_load_bdfs(struct pcifront_dev *dev)
 {
     /* FIXME: the buffer sizing is a little lazy here. 10 extra bytes
        should be enough to hold the paths we need to construct, even
        if the number of devices is large */
     char path[strlen(dev->backend) + strlen("/num_devs") + 10 + 1];
+    struct pcifront_bdf *bdf;
     int i, n;
-    char *s, *msg = NULL;
-    unsigned int dom1, bus1, slot1, fun1;
 
-    if (!dev)
-        dev = pcidev;
+    free(dev->bdfs);
+    dev->bdfs = NULL;
+    dev->nr_bdfs = 0;
+    dev->bdfs_stale = 0;
 
     snprintf(path, sizeof(path), "%s/num_devs", dev->backend);
     n = xenbus_read_integer(path);
+    if (n <= 0)
+        return;
+    dev->bdfs = malloc(n * sizeof(*dev->bdfs));
 
     for (i = 0; i < n; i++) {
+        bdf = &dev->bdfs[dev->nr_bdfs];
         snprintf(path, sizeof(path), "%s/dev-%d", dev->backend, i);
-        msg = xenbus_read(XBT_NIL, path, &s);
-        if (msg) {
-            printk("Error %s when reading the PCI root name at %s\n", msg, path);
-            free(msg);
+        if (read_bdf(path, &bdf->dom, &bdf->bus, &bdf->slot, &bdf->fun))
             continue;
-        }
-
-        if (sscanf(s, "%x:%x:%x.%x", &dom1, &bus1, &slot1, &fun1) != 4) {
-            printk("\"%s\" does not look like a PCI device address\n", s);
-            free(s);
+        snprintf(path, sizeof(path), "%s/vdev-%d", dev->backend, i);
+        if (read_bdf(path, &bdf->vdom, &bdf->vbus, &bdf->vslot, &bdf->vfun))
             continue;
-        }
-        free(s);
+        bdf->shadow_valid = 0;
+        dev->nr_bdfs++;
+    }
+}
 
-        if (dom1 == *dom && bus1 == *bus && slot1 == *slot && fun1 == *fun) {
-            snprintf(path, sizeof(path), "%s/vdev-%d", dev->backend, i);
-            msg = xenbus_read(XBT_NIL, path, &s);
-            if (msg) {
-                printk("Error %s when reading the PCI root name at %s\n", msg, path);
-                continue;
-            }
-
-            if (sscanf(s, "%x:%x:%x.%x", dom, bus, slot, fun) != 4) {
-                printk("\"%s\" does not look like a PCI device address\n", s);
-                free(s);
-                continue;
-            }
-            free(s);
+/* Called with the device locked */
+static struct pcifront_bdf *pcifront_find_bdf(struct pcifront_dev *dev,
+                                              unsigned int dom, unsigned int bus,
+                                              unsigned int slot, unsigned int fun)
+{
+    int i;
 
-            return 0;
-        }
+    if (dev->bdfs_stale)
+        pcifront_load_bdfs(dev);
+
+    for (i = 0; i < dev->nr_bdfs; i++) {
+        struct pcifront_bdf *bdf = &dev->bdfs[i];
+        if (bdf->dom == dom && bdf->bus == bus && bdf->slot == slot && bdf->fun == fun)
+            return bdf;
     }
-    return -1;
+    return NULL;
 }
 
-void pcifront_op(struct pcifront_dev *dev, struct xen_pci_op *op)
+int pcifront_physical_to_virtual (struct pcifront_dev *dev,
+                                  unsigned int *dom,
+                                  unsigned int *bus,
+                                  unsigned int *slot,
+                                  unsigned int *fun)
 {
+    struct pcifront_bdf *bdf;
+
     if (!dev)
         dev = pcidev;
+
+    pcifront_lock(dev);
+    bdf = pcifront_find_bdf(dev, *dom, *bus, *slot, *fun);
+    if (bdf) {
+        *dom = bdf->vdom;
+        *bus = bdf->vbus;
+        *slot = bdf->vslot;
+        *fun = bdf->vfun;
+    }
+    pcifront_unlock(dev);
+
+    return bdf ? 0 : -1;
+}
+
+/* Called with the device locked */
+static void __pcifront_op(struct pcifront_dev *dev, struct xen_pci_op *op)
+{
     dev->info->op = *op;
     /* Make sure info is written before the flag */
     wmb();
@@ -454,32 +531,108 @@ void pcifront_op(struct pcifront_dev *dev, struct xen_pci_op *op)
     *op = dev->info->op;
 }
 
-int pcifront_conf_read(struct pcifront_dev *dev,
-                       unsigned int dom,
-                       unsigned int bus, unsigned int slot, unsigned int fun,
-                       unsigned int off, unsigned int size, unsigned int *val)
+void pcifront_op(struct pcifront_dev *dev, struct xen_pci_op *op)
+{
+    if (!dev)
+        dev = pcidev;
+    pcifront_lock(dev);
+    __pcifront_op(dev, op);
+    pcifront_unlock(dev);
+}
+
+/* Mask of the shadow bytes covered by an access, 0 if it is not entirely
+ * within the read-only shadowed bytes */
+static uint64_t shadow_mask(unsigned int off, unsigned int size)
+{
+    uint64_t mask;
+
+    if (size == 0 || size > 4 || off + size > PCI_SHADOW_SIZE)
+        return 0;
+    mask = ((1ULL << size) - 1) << off;
+    if ((mask & PCI_SHADOW_RO) != mask)
+        return 0;
+    return mask;
+}
+
+static void pcifront_conf_op(struct pcifront_dev *dev, struct pcifront_bdf *bdf,
+                             struct pcifront_conf_op *cop)
 {
     struct xen_pci_op op;
+    uint64_t mask = cop->write ? 0 : shadow_mask(cop->off, cop->size);
+    unsigned int i;
+
+    if (mask && (bdf->shadow_valid & mask) == mask) {
+        cop->val = 0;
+        for (i = 0; i < cop->size; i++)
+            cop->val |= bdf->shadow[cop->off + i] << (8 * i);
+        cop->err = 0;
+        return;
+    }
+
+    memset(&op, 0, sizeof(op));
+    op.cmd = cop->write ? XEN_PCI_OP_conf_write : XEN_PCI_OP_conf_read;
+    op.domain = bdf->vdom;
+    op.bus = bdf->vbus;
+    op.devfn = PCI_DEVFN(bdf->vslot, bdf->vfun);
+    op.offset = cop->off;
+    op.size = cop->size;
+    op.value = cop->val;
+
+    __pcifront_op(dev, &op);
+
+    cop->err = op.err;
+    if (op.err || cop->write)
+        return;
+    cop->val = op.value;
+
+    if (mask) {
+        for (i = 0; i < cop->size; i++)
+            bdf->shadow[cop->off + i] = op.value >> (8 * i);
+        bdf->shadow_valid |= mask;
+    }
+}
+
+int pcifront_conf_batch(struct pcifront_dev *dev,
+                        unsigned int dom,
+                        unsigned int bus, unsigned int slot, unsigned int fun,
+                        struct pcifront_conf_op *ops, int n)
+{
+    struct pcifront_bdf *bdf;
+    int i, err = 0;
 
     if (!dev)
         dev = pcidev;
-    if (pcifront_physical_to_virtual(dev, &dom, &bus, &slot, &fun) < 0)
+
+    pcifront_lock(dev);
+    bdf = pcifront_find_bdf(dev, dom, bus, slot, fun);
+    if (!bdf) {
+        pcifront_unlock(dev);
         return XEN_PCI_ERR_dev_not_found;
-    memset(&op, 0, sizeof(op));
+    }
 
-    op.cmd = XEN_PCI_OP_conf_read;
-    op.domain = dom;
-    op.bus = bus;
-    op.devfn = PCI_DEVFN(slot, fun);
-    op.offset = off;
-    op.size = size;
+    for (i = 0; i < n; i++) {
+        pcifront_conf_op(dev, bdf, &ops[i]);
+        if (ops[i].err && !err)
+            err = ops[i].err;
+    }
+    pcifront_unlock(dev);
 
-    pcifront_op(dev, &op);
+    return err;
+}
 
-    if (op.err)
-        return op.err;
+int pcifront_conf_read(struct pcifront_dev *dev,
+                       unsigned int dom,
+                       unsigned int bus, unsigned int slot, unsigned int fun,
+                       unsigned int off, unsigned int size, unsigned int *val)
+{
+    struct pcifront_conf_op op = { .write = 0, .off = off, .size = size };
+    int err;
+
+    err = pcifront_conf_batch(dev, dom, bus, slot, fun, &op, 1);
+    if (err)
+        return err;
 
-    *val = op.value;
+    *val = op.val;
 
     return 0;
 }
@@ -489,26 +642,9 @@ int pcifront_conf_write(struct pcifront_dev *dev,
                         unsigned int bus, unsigned int slot, unsigned int fun,
                         unsigned int off, unsigned int size, unsigned int val)
 {
-    struct xen_pci_op op;
+    struct pcifront_conf_op op = { .write = 1, .off = off, .size = size, .val = val };
 
-    if (!dev)
-        dev = pcidev;
-    if (pcifront_physical_to_virtual(dev, &dom, &bus, &slot, &fun) < 0)
-        return XEN_PCI_ERR_dev_not_found;
-    memset(&op, 0, sizeof(op));
-
-    op.cmd = XEN_PCI_OP_conf_write;
-    op.domain = dom;
-    op.bus = bus;
-    op.devfn = PCI_DEVFN(slot, fun);
-    op.offset = off;
-    op.size = size;
-
-    op.value = val;
-
-    pcifront_op(dev, &op);
-
-    return op.err;
+    return pcifront_conf_batch(dev, dom, bus, slot, fun, &op, 1);
 }
 
 int pcifront_enable_msi(struct pcifront_dev *dev,
@@ -37,6 +37,7 @@
 
 #include <mini-os/os.h>
 #include <mini-os/hypervisor.h>
+#include <mini-os/events.h>
 #include <mini-os/time.h>
 #include <mini-os/mm.h>
 #include <mini-os/types.h>
@@ -54,6 +55,10 @@
 #define DEBUG(_f, _a...)    ((void)0)
 #endif
 
+#ifndef THREAD_POOL_MAX
+#define THREAD_POOL_MAX 16
+#endif
+
 MINIOS_TAILQ_HEAD(thread_list, struct thread);
 
 struct thread *idle_thread = NULL;
@@ -61,8 +66,58 @@ static struct thread_list exited_threads = MINIOS_TAILQ_HEAD_INITIALIZER(exited_
 static struct thread_list thread_list = MINIOS_TAILQ_HEAD_INITIALIZER(thread_list);
 static int threads_started;
 
+/* Exited threads are kept here, stack included, for reuse by create_thread */
+static struct thread_list free_threads = MINIOS_TAILQ_HEAD_INITIALIZER(free_threads);
+static unsigned int nr_free_threads;
+static unsigned int thread_pool_max = THREAD_POOL_MAX;
+static int threads_quiet;
+
 struct thread *main_thread;
 
+static void free_thread(struct thread *thread)
+{
+    free_pages(thread->stack, STACK_SIZE_PAGE_ORDER);
+    xfree(thread);
+}
+
+/* Return a thread (and its stack) to the pool, or free it if the pool is full */
+static void put_thread(struct thread *thread)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (nr_free_threads < thread_pool_max) {
+        MINIOS_TAILQ_INSERT_HEAD(&free_threads, thread, thread_list);
+        nr_free_threads++;
+        thread = NULL;
+    }
+    local_irq_restore(flags);
+
+    if (thread)
+        free_thread(thread);
+}
+
+static struct thread *get_thread(void)
+{
+    struct thread *thread;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    thread = MINIOS_TAILQ_FIRST(&free_threads);
+    if (thread) {
+        MINIOS_TAILQ_REMOVE(&free_threads, thread, thread_list);
+        nr_free_threads--;
+    }
+    local_irq_restore(flags);
+
+    if (!thread) {
+        thread = xmalloc(struct thread);
+        /* We can't use lazy allocation here since the trap handler runs on the stack */
+        thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+    }
+    return thread;
+}
+
 void schedule(void)
 {
     struct thread *prev, *next, *thread, *tmp;
@@ -81,6 +136,9 @@ void schedule(void)
         BUG();
     }
 
+    /* Whoever we switch to may wait for the other end to act on these */
+    notify_flush();
+
     do {
         /* Examine all threads.
            Find a runnable thread, but also wake up expired ones and find the
@@ -123,21 +181,52 @@ void schedule(void)
         if(thread != prev)
         {
             MINIOS_TAILQ_REMOVE(&exited_threads, thread, thread_list);
-            free_pages(thread->stack, STACK_SIZE_PAGE_ORDER);
-            xfree(thread);
+            put_thread(thread);
         }
     }
 }
 
+/* Set the maximum number of exited threads kept for reuse, trimming the pool */
+void set_thread_pool_max(unsigned int max)
+{
+    struct thread *thread;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    thread_pool_max = max;
+    while (nr_free_threads > thread_pool_max) {
+        thread = MINIOS_TAILQ_FIRST(&free_threads);
+        MINIOS_TAILQ_REMOVE(&free_threads, thread, thread_list);
+        nr_free_threads--;
+        local_irq_restore(flags);
+        free_thread(thread);
+        local_irq_save(flags);
+    }
+    local_irq_restore(flags);
+}
+
+/* Don't log thread creation and exit when quiet is set */
+void set_thread_quiet(int quiet)
+{
+    threads_quiet = quiet;
+}
+
 struct thread* create_thread(char *name, void (*function)(void *), void *data)
 {
     struct thread *thread;
     unsigned long flags;
+
+    thread = get_thread();
+    thread->name = name;
+    if (!threads_quiet)
+        printk("Thread \"%s\": pointer: 0x%p, stack: 0x%p\n", name, thread,
+               thread->stack);
     /* Call architecture specific setup. */
-    thread = arch_create_thread(name, function, data);
+    arch_init_thread(thread, function, data);
     /* Not runable, not exited, not sleeping */
     thread->flags = 0;
     thread->wakeup_time = 0LL;
+    thread->pthread = NULL;
 #ifdef HAVE_LIBC
     _REENT_INIT_PTR((&thread->reent))
 #endif
@@ -190,7 +279,10 @@ void exit_thread(void)
 {
     unsigned long flags;
     struct thread *thread = current;
-    printk("Thread \"%s\" exited.\n", thread->name);
+    if (!threads_quiet)
+        printk("Thread \"%s\" exited.\n", thread->name);
+    if (thread->pthread)
+        pthread_release(thread);
     local_irq_save(flags);
     /* Remove from the thread list */
     MINIOS_TAILQ_REMOVE(&thread_list, thread, thread_list);
@@ -222,8 +314,16 @@ void msleep(uint32_t millisecs)
 
 void wake(struct thread *thread)
 {
+    unsigned long flags;
+
     thread->wakeup_time = 0LL;
     set_runnable(thread);
+    if (is_urgent(thread)) {
+        local_irq_save(flags);
+        MINIOS_TAILQ_REMOVE(&thread_list, thread, thread_list);
+        MINIOS_TAILQ_INSERT_HEAD(&thread_list, thread, thread_list);
+        local_irq_restore(flags);
+    }
 }
 
 void idle_thread_fn(void *unused)
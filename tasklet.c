@@ -0,0 +1,158 @@
+/* -*-  Mode:C; c-basic-offset:4; tab-width:4 -*-
+ *
+ * Deferred work for event channel handlers
+ *
+ * Mini-OS runs on a single vCPU, so there is one tasklet queue, drained by
+ * one thread. That thread is marked urgent, which makes the scheduler pick
+ * it before any other runnable thread, so handlers can return quickly
+ * without delaying the deferred work behind ordinary threads.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/sched.h>
+#include <mini-os/events.h>
+#include <mini-os/tasklet.h>
+
+/* Tasklets run before the tasklet thread yields to other threads */
+#ifndef TASKLET_BUDGET
+#define TASKLET_BUDGET 16
+#endif
+
+static MINIOS_STAILQ_HEAD(, struct tasklet) tasklet_queue =
+    MINIOS_STAILQ_HEAD_INITIALIZER(tasklet_queue);
+static MINIOS_TAILQ_HEAD(, struct tasklet) tasklet_list =
+    MINIOS_TAILQ_HEAD_INITIALIZER(tasklet_list);
+static struct thread *tasklet_thread;
+
+void tasklet_init(struct tasklet *t, const char *name,
+                  void (*func)(void *data), void *data)
+{
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->func = func;
+    t->data = data;
+}
+
+void tasklet_schedule(struct tasklet *t)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if (!(t->state & TASKLET_STATE_SCHED)) {
+        t->state |= TASKLET_STATE_SCHED;
+        t->queued = NOW();
+        MINIOS_STAILQ_INSERT_TAIL(&tasklet_queue, t, queue);
+        if (tasklet_thread)
+            wake(tasklet_thread);
+    }
+    local_irq_restore(flags);
+}
+
+void tasklet_kill(struct tasklet *t)
+{
+    unsigned long flags;
+
+    /* The tasklet thread is urgent, so it runs before we get back here */
+    while (t->state & (TASKLET_STATE_SCHED | TASKLET_STATE_RUN))
+        schedule();
+
+    local_irq_save(flags);
+    if (t->state & TASKLET_STATE_LISTED) {
+        MINIOS_TAILQ_REMOVE(&tasklet_list, t, list);
+        t->state &= ~TASKLET_STATE_LISTED;
+    }
+    local_irq_restore(flags);
+}
+
+static void run_tasklet(struct tasklet *t)
+{
+    struct tasklet_stats *st = &t->stats;
+    s_time_t start, latency, time;
+
+    start = NOW();
+    t->func(t->data);
+    time = NOW() - start;
+    latency = start - t->queued;
+
+    st->runs++;
+    st->latency_total += latency;
+    if (latency > st->latency_max)
+        st->latency_max = latency;
+    st->time_total += time;
+    if (time > st->time_max)
+        st->time_max = time;
+}
+
+static void tasklet_thread_fn(void *unused)
+{
+    struct tasklet *t;
+    unsigned long flags;
+    int n;
+
+    for (;;) {
+        local_irq_save(flags);
+        notify_batch_begin();
+        for (n = 0; n < TASKLET_BUDGET; n++) {
+            t = MINIOS_STAILQ_FIRST(&tasklet_queue);
+            if (!t)
+                break;
+            MINIOS_STAILQ_REMOVE_HEAD(&tasklet_queue, queue);
+            /* Clear SCHED first so that the tasklet can requeue itself */
+            t->state &= ~TASKLET_STATE_SCHED;
+            t->state |= TASKLET_STATE_RUN;
+            if (!(t->state & TASKLET_STATE_LISTED)) {
+                MINIOS_TAILQ_INSERT_TAIL(&tasklet_list, t, list);
+                t->state |= TASKLET_STATE_LISTED;
+            }
+            local_irq_restore(flags);
+
+            run_tasklet(t);
+
+            local_irq_save(flags);
+            t->state &= ~TASKLET_STATE_RUN;
+        }
+        /* Send the pass's ring notifications, one per port */
+        notify_batch_end();
+        /* Sleep if the queue is empty, otherwise just let others run */
+        if (MINIOS_STAILQ_EMPTY(&tasklet_queue))
+            block(current);
+        local_irq_restore(flags);
+        schedule();
+    }
+}
+
+void tasklet_dump_stats(void)
+{
+    struct tasklet *t;
+    struct tasklet_stats *st;
+
+    printk("tasklets:\n");
+    MINIOS_TAILQ_FOREACH(t, &tasklet_list, list) {
+        st = &t->stats;
+        if (!st->runs)
+            continue;
+        printk("  %s: %llu runs, latency avg %llu max %llu us, time avg %llu max %llu us\n",
+               t->name, (unsigned long long)st->runs,
+               (unsigned long long)NSEC_TO_USEC(st->latency_total / st->runs),
+               (unsigned long long)NSEC_TO_USEC(st->latency_max),
+               (unsigned long long)NSEC_TO_USEC(st->time_total / st->runs),
+               (unsigned long long)NSEC_TO_USEC(st->time_max));
+    }
+}
+
+void init_tasklets(void)
+{
+    tasklet_thread = create_thread("tasklet", tasklet_thread_fn, NULL);
+    set_urgent(tasklet_thread);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
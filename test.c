@@ -34,14 +34,19 @@
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/sched.h>
+#include <mini-os/semaphore.h>
+#include <mini-os/timer.h>
 #include <mini-os/xenbus.h>
 #include <mini-os/gnttab.h>
 #include <mini-os/netfront.h>
 #include <mini-os/blkfront.h>
 #include <mini-os/fbfront.h>
 #include <mini-os/pcifront.h>
+#include <mini-os/tpm_tis.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/errno.h>
 #include <fcntl.h>
+#include <mini-os/posix/pthread.h>
 #include <xen/features.h>
 #include <xen/version.h>
 
@@ -85,6 +90,399 @@ static void periodic_thread(void *p)
     }
 }
 
+#define PTHREAD_TEST_THREADS 8
+#define PTHREAD_TEST_ITERS 1000
+
+static pthread_mutex_t ptest_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ptest_cond = PTHREAD_COND_INITIALIZER;
+static pthread_rwlock_t ptest_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_key_t ptest_key, ptest_destr_key;
+static unsigned long ptest_counter, ptest_turn, ptest_rw_value;
+static int ptest_errors, ptest_destroyed;
+
+static void *pthread_worker(void *arg)
+{
+    long id = (long) arg;
+    unsigned long value;
+    int i;
+
+    pthread_setspecific(ptest_key, arg);
+
+    for (i = 0; i < PTHREAD_TEST_ITERS; i++) {
+        /* Yield with the mutex held so other workers pile up on it */
+        pthread_mutex_lock(&ptest_mutex);
+        value = ptest_counter;
+        if (!(i % 16))
+            schedule();
+        ptest_counter = value + 1;
+        pthread_mutex_unlock(&ptest_mutex);
+
+        /* Writers keep the value even whenever they release the lock */
+        if (i % 4 == id % 4) {
+            pthread_rwlock_wrlock(&ptest_rwlock);
+            ptest_rw_value++;
+            schedule();
+            ptest_rw_value++;
+            pthread_rwlock_unlock(&ptest_rwlock);
+        } else {
+            pthread_rwlock_rdlock(&ptest_rwlock);
+            if (ptest_rw_value & 1)
+                ptest_errors++;
+            schedule();
+            pthread_rwlock_unlock(&ptest_rwlock);
+        }
+    }
+
+    /* Pass a token around the workers in order */
+    pthread_mutex_lock(&ptest_mutex);
+    while (ptest_turn % PTHREAD_TEST_THREADS != id)
+        pthread_cond_wait(&ptest_cond, &ptest_mutex);
+    ptest_turn++;
+    pthread_cond_broadcast(&ptest_cond);
+    pthread_mutex_unlock(&ptest_mutex);
+
+    if (pthread_getspecific(ptest_key) != arg)
+        ptest_errors++;
+    return arg;
+}
+
+static void pthread_destr(void *value)
+{
+    ptest_destroyed++;
+}
+
+/* A plain thread which picks up a pthread through its keys */
+static void pthread_plain_worker(void *p)
+{
+    pthread_setspecific(ptest_destr_key, p);
+}
+
+static void pthread_tester(void *p)
+{
+    pthread_t threads[PTHREAD_TEST_THREADS];
+    struct timeval tv;
+    struct timespec abstime;
+    void *ret;
+    long i;
+    int rc;
+
+    printk("pthread test started.\n");
+    pthread_key_create(&ptest_key, NULL);
+
+    for (i = 0; i < PTHREAD_TEST_THREADS; i++)
+        pthread_create(&threads[i], NULL, pthread_worker, (void *) i);
+    for (i = 0; i < PTHREAD_TEST_THREADS; i++) {
+        pthread_join(threads[i], &ret);
+        if (ret != (void *) i)
+            ptest_errors++;
+    }
+    if (ptest_counter != PTHREAD_TEST_THREADS * PTHREAD_TEST_ITERS ||
+        ptest_turn != PTHREAD_TEST_THREADS)
+        ptest_errors++;
+
+    /* Nobody signals, so this has to time out */
+    gettimeofday(&tv, NULL);
+    abstime.tv_sec = tv.tv_sec;
+    abstime.tv_nsec = tv.tv_usec * 1000 + 10000000;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&ptest_mutex);
+    rc = pthread_cond_timedwait(&ptest_cond, &ptest_mutex, &abstime);
+    pthread_mutex_unlock(&ptest_mutex);
+    if (rc != ETIMEDOUT)
+        ptest_errors++;
+
+    /* exit_thread() has to run its key destructors */
+    pthread_key_create(&ptest_destr_key, pthread_destr);
+    create_thread("pthread_plain", pthread_plain_worker, &ptest_destroyed);
+    for (i = 0; i < 100 && !ptest_destroyed; i++)
+        msleep(1);
+    if (ptest_destroyed != 1)
+        ptest_errors++;
+    pthread_key_delete(ptest_destr_key);
+
+    pthread_key_delete(ptest_key);
+    printk("pthread test %s: counter %lu, %d errors\n",
+           ptest_errors ? "FAILED" : "passed", ptest_counter, ptest_errors);
+}
+
+#define TIMER_TEST_TICKS 100
+#define TIMER_TEST_PERIOD MILLISECS(10)
+
+static struct timer test_timer;
+static unsigned int timer_ticks;
+static s_time_t timer_late_max;
+static struct semaphore timer_sem = __SEMAPHORE_INITIALIZER(timer_sem, 0);
+
+static void timer_test_fn(void *data)
+{
+    s_time_t late = NOW() - test_timer.expires;
+
+    if (late > timer_late_max)
+        timer_late_max = late;
+    if (++timer_ticks < TIMER_TEST_TICKS)
+        timer_add(&test_timer, test_timer.expires + TIMER_TEST_PERIOD);
+    else
+        up(&timer_sem);
+}
+
+static void timer_tester(void *p)
+{
+    printk("timer test started.\n");
+    init_timer(&test_timer, timer_test_fn, NULL);
+    timer_add(&test_timer, NOW() + TIMER_TEST_PERIOD);
+    down(&timer_sem);
+    printk("timer test: %u ticks, at most %lu us late\n",
+           timer_ticks, (unsigned long)NSEC_TO_USEC(timer_late_max));
+}
+
+#define CLOCK_TEST_READS 100000
+
+static void clock_tester(void *p)
+{
+    s_time_t start, precise, coarse, sink = 0;
+    int i;
+
+    start = NOW();
+    for (i = 0; i < CLOCK_TEST_READS; i++)
+        sink += NOW();
+    precise = NOW() - start;
+
+    start = NOW();
+    for (i = 0; i < CLOCK_TEST_READS; i++)
+        sink += NOW_COARSE();
+    coarse = NOW() - start;
+
+    printk("clock test: NOW() %lu ns, NOW_COARSE() %lu ns per read (%lx)\n",
+           (unsigned long)(precise / CLOCK_TEST_READS),
+           (unsigned long)(coarse / CLOCK_TEST_READS), (unsigned long)sink);
+}
+
+#define STRING_TEST_MAX 300
+#define STRING_TEST_ALIGN 8
+#define STRING_TEST_BUF (STRING_TEST_MAX + 2 * STRING_TEST_ALIGN + 16)
+#define STRING_TEST_LOOPS 1000
+
+static unsigned char str_src[STRING_TEST_BUF] __attribute__((aligned(16)));
+static unsigned char str_dst[STRING_TEST_BUF] __attribute__((aligned(16)));
+static int string_errors;
+
+static inline unsigned char str_pattern(size_t i)
+{
+    return 0x81 + (i * 7) % 126;    /* never 0, and room to step by 1 */
+}
+
+static void string_error(const char *fn, size_t len, int d, int s)
+{
+    if (string_errors++ < 10)
+        printk("string test: %s len %lu dst+%d src+%d wrong\n",
+               fn, (unsigned long)len, d, s);
+}
+
+/* Every length up to STRING_TEST_MAX at every head alignment of each
+ * buffer, so word loops, heads, tails and the rep paths are all hit */
+static void string_check(void)
+{
+    size_t len, i;
+    int d, s, bad;
+    unsigned char *dst, *src;
+
+    for (i = 0; i < STRING_TEST_BUF; i++)
+        str_src[i] = str_pattern(i);
+
+    for (len = 0; len <= STRING_TEST_MAX; len++)
+        for (d = 0; d < STRING_TEST_ALIGN; d++)
+            for (s = 0; s < STRING_TEST_ALIGN; s++) {
+                dst = str_dst + d;
+                src = str_src + s;
+
+                memset(str_dst, 0x55, sizeof(str_dst));
+                memcpy(dst, src, len);
+                bad = 0;
+                for (i = 0; i < sizeof(str_dst); i++)
+                    if (str_dst[i] != (i >= d && i < d + len ?
+                                       str_pattern(i - d + s) : 0x55))
+                        bad = 1;
+                if (bad)
+                    string_error("memcpy", len, d, s);
+
+                /* Equal, then differing in the first and the last byte */
+                if (memcmp(dst, src, len))
+                    string_error("memcmp", len, d, s);
+                if (len) {
+                    dst[0]--;
+                    if (memcmp(dst, src, len) >= 0)
+                        string_error("memcmp head", len, d, s);
+                    dst[0]++;
+                    dst[len - 1]++;
+                    if (memcmp(dst, src, len) <= 0)
+                        string_error("memcmp tail", len, d, s);
+                    dst[len - 1]--;
+                }
+
+                /* NUL terminated copies for strlen and strcmp */
+                dst[len] = 0;
+                src[len] = 0;
+                if (len)
+                    dst[len - 1]--;
+                if (strlen((char *)dst) != len)
+                    string_error("strlen", len, d, s);
+                if (len && strcmp((char *)dst, (char *)src) >= 0)
+                    string_error("strcmp", len, d, s);
+                if (len)
+                    dst[len - 1]++;
+                if (strcmp((char *)dst, (char *)src))
+                    string_error("strcmp equal", len, d, s);
+                src[len] = 'a';
+                if (strcmp((char *)dst, (char *)src) >= 0)
+                    string_error("strcmp prefix", len, d, s);
+                src[len] = str_pattern(len + s);
+
+                if (s == 0) {
+                    memset(str_dst, 0x55, sizeof(str_dst));
+                    memset(dst, 0xa5, len);
+                    bad = 0;
+                    for (i = 0; i < sizeof(str_dst); i++)
+                        if (str_dst[i] != (i >= d && i < d + len ? 0xa5 : 0x55))
+                            bad = 1;
+                    if (bad)
+                        string_error("memset", len, d, s);
+                }
+            }
+}
+
+static void string_tester(void *p)
+{
+    static char big_src[4096], big_dst[4096];
+    s_time_t start, time;
+    size_t total;
+    int i;
+
+    string_check();
+    printk("string test %s: %d errors\n",
+           string_errors ? "FAILED" : "passed", string_errors);
+
+    total = (size_t)STRING_TEST_LOOPS * sizeof(big_dst);
+    start = NOW();
+    for (i = 0; i < STRING_TEST_LOOPS; i++)
+        memcpy(big_dst, big_src, sizeof(big_dst));
+    time = NOW() - start;
+    printk("string test: memcpy %lu MB/s\n",
+           (unsigned long)(time ? total * 1000 / time : 0));
+
+    start = NOW();
+    for (i = 0; i < STRING_TEST_LOOPS; i++)
+        memset(big_dst, i, sizeof(big_dst));
+    time = NOW() - start;
+    printk("string test: memset %lu MB/s\n",
+           (unsigned long)(time ? total * 1000 / time : 0));
+
+    memset(big_src, 'x', sizeof(big_src) - 1);
+    memset(big_dst, 'x', sizeof(big_dst) - 1);
+    big_src[sizeof(big_src) - 1] = big_dst[sizeof(big_dst) - 1] = 0;
+    start = NOW();
+    for (i = 0; i < STRING_TEST_LOOPS; i++)
+        total += memcmp(big_dst, big_src, sizeof(big_dst)) +
+                 strcmp(big_dst, big_src) + strlen(big_dst);
+    time = NOW() - start;
+    printk("string test: memcmp+strcmp+strlen of 4k, %lu ns (%lx)\n",
+           (unsigned long)(time / STRING_TEST_LOOPS), (unsigned long)total);
+}
+
+#ifdef CONFIG_TPM_TIS
+static void tpm_tis_tester(void *p)
+{
+    int errors = tpm_tis_selftest();
+
+    printk("tpm_tis test %s: %d errors\n", errors ? "FAILED" : "passed",
+           errors);
+}
+#endif
+
+static int printf_errors;
+
+/* Format into a buffer of the given size and compare against the output
+ * and return value of a correct vsnprintf */
+static void printf_check(const char *expect, int expect_ret, size_t size,
+                         const char *fmt, ...)
+{
+    char buf[72];
+    va_list ap;
+    int ret;
+
+    memset(buf, '#', sizeof(buf));
+    va_start(ap, fmt);
+    ret = vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    if (ret != expect_ret || (size && strcmp(buf, expect)) ||
+        (!size && buf[0] != '#') || buf[size] != '#') {
+        printk("printf test: \"%s\" size %lu gave \"%s\" (%d), wanted \"%s\" (%d)\n",
+               fmt, (unsigned long)size, size ? buf : "", ret, expect,
+               expect_ret);
+        printf_errors++;
+    }
+}
+
+#define PRINTF_TEST_CALLS 10000
+
+static void printf_tester(void *p)
+{
+    char buf[128];
+    s_time_t start, time;
+    int i;
+
+    /* The short path: %s, %d, %u, %x and their l variants */
+    printf_check("abc", 3, 64, "%s", "abc");
+    printf_check("(null)", 6, 64, "%s", (char *)NULL);
+    printf_check("<>", 2, 64, "<%s>", "");
+    printf_check("0 -1 2147483647", 15, 64, "%d %d %d", 0, -1, INT_MAX);
+    printf_check("-2147483648", 11, 64, "%d", INT_MIN);
+    printf_check("4294967295", 10, 64, "%u", UINT_MAX);
+    printf_check("deadbeef", 8, 64, "%x", 0xdeadbeefU);
+    printf_check("-1234567890", 11, 64, "%ld", -1234567890L);
+    printf_check("4294967295", 10, 64, "%lu", 4294967295UL);
+    printf_check("abcdef", 6, 64, "%lx", 0xabcdefUL);
+    printf_check("a%b", 3, 64, "a%%b");
+
+    /* Digit pairs: odd and even lengths, and values above ULONG_MAX on
+     * 32-bit */
+    printf_check("9 10 99 100 1000000", 19, 64, "%d %d %d %d %d",
+                 9, 10, 99, 100, 1000000);
+    printf_check("18446744073709551615", 20, 64, "%llu", ~0ULL);
+    printf_check("12345678901234567890", 20, 64, "%llu",
+                 12345678901234567890ULL);
+    printf_check("-9223372036854775808", 20, 64, "%lld", (-9223372036854775807LL - 1));
+
+    /* The flag parser, which the short path must leave alone */
+    printf_check("00042|  -7|x   |", 16, 64, "%05d|%4d|%-4s|", 42, -7, "x");
+    printf_check("ABCDEF 17 0x1f", 14, 64, "%X %o %#x", 0xabcdef, 15, 31);
+
+    /* Truncation: the return value counts everything, the buffer keeps
+     * what fits and is always terminated */
+    printf_check("", 5, 1, "%d", 12345);
+    printf_check("abc", 6, 4, "%s", "abcdef");
+    printf_check("12", 5, 3, "%u", 12345U);
+    printf_check("lit", 8, 4, "literal%d", 7);
+    printf_check("", 5, 0, "%d", 12345);
+    /* %c is consumed even when it does not fit */
+    printf_check("x", 2, 2, "%c%d", 'x', 7);
+    printf_check("x7", 2, 64, "%c%d", 'x', 7);
+
+    printk("printf test %s: %d errors\n",
+           printf_errors ? "FAILED" : "passed", printf_errors);
+
+    start = NOW();
+    for (i = 0; i < PRINTF_TEST_CALLS; i++)
+        snprintf(buf, sizeof(buf), "port %u: %lu events, %s %d%% %lx",
+                 i, (unsigned long)i * 1000, "handler", i % 100,
+                 (unsigned long)i);
+    time = NOW() - start;
+    printk("printf test: %lu ns per snprintf\n",
+           (unsigned long)(time / PRINTF_TEST_CALLS));
+}
+
 #ifdef CONFIG_NETFRONT
 static struct netfront_dev *net_dev;
 static struct semaphore net_sem = __SEMAPHORE_INITIALIZER(net_sem, 0);
@@ -547,6 +945,7 @@ static void shutdown_thread(void *p)
     }
 
     shutdown_frontends();
+    evtchn_dump_stats();
 
     HYPERVISOR_shutdown(shutdown_reason);
 }
@@ -559,6 +958,14 @@ int app_main(void *p)
     create_thread("xenbus_tester", xenbus_tester, p);
 #endif
     create_thread("periodic_thread", periodic_thread, p);
+    create_thread("pthread_tester", pthread_tester, p);
+    create_thread("timer_tester", timer_tester, p);
+    create_thread("clock_tester", clock_tester, p);
+    create_thread("printf_tester", printf_tester, p);
+    create_thread("string_tester", string_tester, p);
+#ifdef CONFIG_TPM_TIS
+    create_thread("tpm_tis_tester", tpm_tis_tester, p);
+#endif
 #ifdef CONFIG_NETFRONT
     create_thread("netfront", netfront_thread, p);
 #endif
@@ -0,0 +1,116 @@
+/* -*-  Mode:C; c-basic-offset:4; tab-width:4 -*-
+ *
+ * Callback timers
+ *
+ * Pending timers are kept on a list sorted by expiry. There are rarely
+ * more than a handful, and most new timers expire after the ones already
+ * pending, so insertion scans from the back. Keeping the timers intrusive
+ * means arming one never allocates, which is what allows it from event
+ * handlers.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/time.h>
+#include <mini-os/timer.h>
+
+MINIOS_TAILQ_HEAD(timer_list, struct timer);
+static struct timer_list timers = MINIOS_TAILQ_HEAD_INITIALIZER(timers);
+/* Expired timers whose callbacks timer_run_expired() has yet to call */
+static struct timer_list expired_timers = MINIOS_TAILQ_HEAD_INITIALIZER(expired_timers);
+
+#define TIMER_PENDING 1
+#define TIMER_EXPIRED 2
+
+static void timer_unlink(struct timer *t)
+{
+    if (t->pending == TIMER_PENDING)
+        MINIOS_TAILQ_REMOVE(&timers, t, list);
+    else if (t->pending == TIMER_EXPIRED)
+        MINIOS_TAILQ_REMOVE(&expired_timers, t, list);
+    t->pending = 0;
+}
+
+void init_timer(struct timer *t, void (*func)(void *data), void *data)
+{
+    t->expires = 0;
+    t->func = func;
+    t->data = data;
+    t->pending = 0;
+}
+
+void timer_add(struct timer *t, s_time_t expires)
+{
+    struct timer *prev;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    timer_unlink(t);
+    t->expires = expires;
+    t->pending = TIMER_PENDING;
+
+    MINIOS_TAILQ_FOREACH_REVERSE(prev, &timers, timer_list, list) {
+        if (prev->expires <= expires)
+            break;
+    }
+    if (prev) {
+        MINIOS_TAILQ_INSERT_AFTER(&timers, prev, t, list);
+    } else {
+        MINIOS_TAILQ_INSERT_HEAD(&timers, t, list);
+        arch_program_timer(expires);
+    }
+    local_irq_restore(flags);
+}
+
+/* A deleted first timer is left programmed; it fires once for nothing,
+ * which is cheaper than a hypercall to reprogram it here */
+int timer_del(struct timer *t)
+{
+    unsigned long flags;
+    int ret;
+
+    local_irq_save(flags);
+    ret = t->pending != 0;
+    timer_unlink(t);
+    local_irq_restore(flags);
+    return ret;
+}
+
+s_time_t timer_next_expiry(void)
+{
+    struct timer *t = MINIOS_TAILQ_FIRST(&timers);
+
+    return t ? t->expires : 0;
+}
+
+void timer_run_expired(void)
+{
+    struct timer *t;
+    unsigned long flags;
+    s_time_t now = NOW();
+
+    local_irq_save(flags);
+    /* Move the expired timers aside first, so that one re-armed by its
+     * callback for now or earlier waits for the next run */
+    while ((t = MINIOS_TAILQ_FIRST(&timers)) && t->expires <= now) {
+        MINIOS_TAILQ_REMOVE(&timers, t, list);
+        MINIOS_TAILQ_INSERT_TAIL(&expired_timers, t, list);
+        t->pending = TIMER_EXPIRED;
+    }
+    while ((t = MINIOS_TAILQ_FIRST(&expired_timers))) {
+        timer_unlink(t);
+        t->func(t->data);
+    }
+    arch_program_timer(timer_next_expiry());
+    local_irq_restore(flags);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
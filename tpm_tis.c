@@ -27,6 +27,7 @@
 #include <mini-os/wait.h>
 #include <mini-os/xmalloc.h>
 #include <mini-os/lib.h>
+#include <mini-os/timer.h>
 #include <errno.h>
 #include <stdbool.h>
 
@@ -533,6 +534,17 @@ enum tis_defaults {
 
 #define TPM_TIMEOUT 5
 
+/* Without an IRQ, status is polled by spinning for TPM_POLL_SPIN and then
+ * sleeping, starting at TPM_POLL_MIN_DELAY and doubling up to TPM_TIMEOUT ms */
+#define TPM_POLL_SPIN MICROSECS(50)
+#define TPM_POLL_MIN_DELAY MICROSECS(20)
+
+/* TPM_INTF_CAPS bits 9-10, TIS 1.3: 0 means byte sized FIFO accesses only */
+#define TPM_INTF_DATA_TRANSFER_SIZE(caps) (((caps) >> 9) & 3)
+
+/* Number of distinct ordinals we keep latency statistics for */
+#define TPM_ORDINAL_STATS 64
+
 #define TPM_ACCESS(t, l)                   (((uint8_t*)t->pages[l]) + 0x0000)
 #define TPM_INT_ENABLE(t, l)               ((uint32_t*)(((uint8_t*)t->pages[l]) + 0x0008))
 #define TPM_INT_VECTOR(t, l)               (((uint8_t*)t->pages[l]) + 0x000C)
@@ -544,6 +556,18 @@ enum tis_defaults {
 #define TPM_DID_VID(t, l)                  ((uint32_t*)(((uint8_t*)t->pages[l]) + 0x0F00))
 #define TPM_RID(t, l)                      (((uint8_t*)t->pages[l]) + 0x0F04)
 
+struct tpm_ordinal_stat {
+   uint32_t ordinal;
+   uint32_t count;      /* 0 if the slot is unused */
+   s_time_t total;
+   s_time_t max;
+};
+
+struct tpm_poll {
+   s_time_t start;
+   s_time_t delay;
+};
+
 struct tpm_chip {
    int enabled_localities;
    int locality;
@@ -551,6 +575,9 @@ struct tpm_chip {
    uint8_t* pages[5];
    int did, vid, rid;
 
+   /* Data FIFO can be accessed 32 bits at a time */
+   int fifo_wide;
+
    uint8_t data_buffer[TPM_BUFSIZE];
    int data_len;
 
@@ -564,6 +591,8 @@ struct tpm_chip {
    unsigned int irq;
    struct wait_queue_head read_queue;
    struct wait_queue_head int_queue;
+
+   struct tpm_ordinal_stat stats[TPM_ORDINAL_STATS];
 };
 
 
@@ -575,6 +604,8 @@ static void __init_tpm_chip(struct tpm_chip* tpm) {
    tpm->vid = 0;
    tpm->did = 0;
    tpm->irq = 0;
+   tpm->fifo_wide = 0;
+   memset(tpm->stats, 0, sizeof(tpm->stats));
    init_waitqueue_head(&tpm->read_queue);
    init_waitqueue_head(&tpm->int_queue);
 
@@ -616,6 +647,67 @@ s_time_t tpm_calc_ordinal_duration(struct tpm_chip *chip,
 }
 
 
+static void tpm_poll_init(struct tpm_poll* poll) {
+   poll->start = NOW();
+   poll->delay = TPM_POLL_MIN_DELAY;
+}
+
+/* Back off between two reads of a status register. Most commands finish
+ * in well under a millisecond, so a short spin catches them without
+ * paying for a whole msleep(TPM_TIMEOUT) */
+static void tpm_poll_wait(struct tpm_poll* poll) {
+   struct thread* thread;
+
+   if(NOW() - poll->start < TPM_POLL_SPIN) {
+      barrier();
+      return;
+   }
+
+   thread = get_current();
+   thread->wakeup_time = NOW() + poll->delay;
+   clear_runnable(thread);
+   schedule();
+
+   if(poll->delay < MILLISECS(TPM_TIMEOUT)) {
+      poll->delay *= 2;
+   }
+}
+
+static void tpm_account_ordinal(struct tpm_chip* tpm, uint32_t ordinal, s_time_t elapsed) {
+   struct tpm_ordinal_stat* st;
+   int i, slot;
+
+   slot = ordinal % TPM_ORDINAL_STATS;
+   for(i = 0; i < TPM_ORDINAL_STATS; ++i) {
+      st = &tpm->stats[(slot + i) % TPM_ORDINAL_STATS];
+      if(st->count == 0 || st->ordinal == ordinal) {
+	 st->ordinal = ordinal;
+	 st->count++;
+	 st->total += elapsed;
+	 if(elapsed > st->max) {
+	    st->max = elapsed;
+	 }
+	 return;
+      }
+   }
+   /* Table is full, drop it */
+}
+
+void tpm_tis_dump_stats(struct tpm_chip* tpm) {
+   struct tpm_ordinal_stat* st;
+   int i;
+
+   printk("tpm_tis: command latencies\n");
+   for(i = 0; i < TPM_ORDINAL_STATS; ++i) {
+      st = &tpm->stats[i];
+      if(st->count == 0) {
+	 continue;
+      }
+      printk("  ordinal 0x%x: %u commands, avg %lu max %lu us\n", st->ordinal, st->count,
+	    (unsigned long) (st->total / st->count / 1000), (unsigned long) (st->max / 1000));
+   }
+}
+
 static int locality_enabled(struct tpm_chip* tpm, int l) {
    return l >= 0 && tpm->enabled_localities & (1 << l);
 }
@@ -641,6 +733,7 @@ void release_locality(struct tpm_chip* tpm, int l, int force)
 int tpm_tis_request_locality(struct tpm_chip* tpm, int l) {
 
    s_time_t stop;
+   struct tpm_poll poll;
    /*Make sure locality is valid */
    if(!locality_enabled(tpm, l)) {
       printk("tpm_tis_change_locality() Tried to change to locality %d, but it is disabled or invalid!\n", l);
@@ -662,11 +755,12 @@ int tpm_tis_request_locality(struct tpm_chip* tpm, int l) {
    } else {
       /* Wait for burstcount */
       stop = NOW() + tpm->timeout_a;
+      tpm_poll_init(&poll);
       do {
 	 if(check_locality(tpm, l) >= 0) {
 	    return tpm->locality = l;
 	 }
-	 msleep(TPM_TIMEOUT);
+	 tpm_poll_wait(&poll);
       } while(NOW() < stop);
    }
 
@@ -686,9 +780,11 @@ static void tpm_tis_ready(struct tpm_chip* tpm) {
 
 static int get_burstcount(struct tpm_chip* tpm) {
    s_time_t stop;
+   struct tpm_poll poll;
    int burstcnt;
 
    stop = NOW() + tpm->timeout_d;
+   tpm_poll_init(&poll);
    do {
       burstcnt = ioread8((TPM_STS(tpm, tpm->locality) + 1));
       burstcnt += ioread8(TPM_STS(tpm, tpm->locality) + 2) << 8;
@@ -696,7 +792,7 @@ static int get_burstcount(struct tpm_chip* tpm) {
       if (burstcnt) {
 	 return burstcnt;
       }
-      msleep(TPM_TIMEOUT);
+      tpm_poll_wait(&poll);
    } while(NOW() < stop);
    return -EBUSY;
 }
@@ -704,6 +800,7 @@ static int get_burstcount(struct tpm_chip* tpm) {
 static int wait_for_stat(struct tpm_chip* tpm, uint8_t mask,
       unsigned long timeout, struct wait_queue_head* queue) {
    s_time_t stop;
+   struct tpm_poll poll;
    uint8_t status;
 
    status = tpm_tis_status(tpm);
@@ -717,8 +814,9 @@ static int wait_for_stat(struct tpm_chip* tpm, uint8_t mask,
       return 0;
    } else {
       stop = NOW() + timeout;
+      tpm_poll_init(&poll);
       do {
-	 msleep(TPM_TIMEOUT);
+	 tpm_poll_wait(&poll);
 	 status = tpm_tis_status(tpm);
 	 if((status & mask) == mask)
 	    return 0;
@@ -727,6 +825,41 @@ static int wait_for_stat(struct tpm_chip* tpm, uint8_t mask,
    return -ETIME;
 }
 
+/* Data FIFO accesses, 4 bytes at a time when the interface allows it */
+static int fifo_read(struct tpm_chip* tpm, uint8_t* buf, int len) {
+   int n = 0;
+   uint32_t v;
+
+   if(tpm->fifo_wide) {
+      for(; len - n >= 4; n += 4) {
+	 v = ioread32((uint32_t*) TPM_DATA_FIFO(tpm, tpm->locality));
+	 buf[n] = v;
+	 buf[n + 1] = v >> 8;
+	 buf[n + 2] = v >> 16;
+	 buf[n + 3] = v >> 24;
+      }
+   }
+   for(; n < len; ++n) {
+      buf[n] = ioread8(TPM_DATA_FIFO(tpm, tpm->locality));
+   }
+   return n;
+}
+
+static int fifo_write(struct tpm_chip* tpm, const uint8_t* buf, int len) {
+   int n = 0;
+
+   if(tpm->fifo_wide) {
+      for(; len - n >= 4; n += 4) {
+	 iowrite32((uint32_t*) TPM_DATA_FIFO(tpm, tpm->locality),
+	       buf[n] | buf[n + 1] << 8 | buf[n + 2] << 16 | (uint32_t) buf[n + 3] << 24);
+      }
+   }
+   for(; n < len; ++n) {
+      iowrite8(TPM_DATA_FIFO(tpm, tpm->locality), buf[n]);
+   }
+   return n;
+}
+
 static int recv_data(struct tpm_chip* tpm, uint8_t* buf, size_t count) {
    int size = 0;
    int burstcnt;
@@ -737,9 +870,8 @@ static int recv_data(struct tpm_chip* tpm, uint8_t* buf, size_t count) {
 	    &tpm->read_queue)
 	 == 0) {
       burstcnt = get_burstcount(tpm);
-      for(; burstcnt > 0 && size < count; --burstcnt)
-      {
-	 buf[size++] = ioread8(TPM_DATA_FIFO(tpm, tpm->locality));
+      if(burstcnt > 0) {
+	 size += fifo_read(tpm, buf + size, min(burstcnt, (int) (count - size)));
       }
    }
    return size;
@@ -808,8 +940,8 @@ int tpm_tis_send(struct tpm_chip* tpm, uint8_t* buf, size_t len) {
 
    while(count < len - 1) {
       burstcnt = get_burstcount(tpm);
-      for(;burstcnt > 0 && count < len -1; --burstcnt) {
-	 iowrite8(TPM_DATA_FIFO(tpm, tpm->locality), buf[count++]);
+      if(burstcnt > 0) {
+	 count += fifo_write(tpm, buf + count, min(burstcnt, (int) (len - 1 - count)));
       }
 
       wait_for_stat(tpm, TPM_STS_VALID, tpm->timeout_c, &tpm->int_queue);
@@ -834,7 +966,7 @@ int tpm_tis_send(struct tpm_chip* tpm, uint8_t* buf, size_t len) {
 
    if(tpm->irq) {
       /*Wait for interrupt */
-      ordinal = be32_to_cpu(*(buf + 6));
+      ordinal = be32_to_cpu(*((uint32_t *) (buf + 6)));
       if(wait_for_stat(tpm,
 	       TPM_STS_DATA_AVAIL | TPM_STS_VALID,
 	       tpm_calc_ordinal_duration(tpm, ordinal),
@@ -898,7 +1030,8 @@ static ssize_t tpm_transmit(struct tpm_chip *chip, const uint8_t *buf,
 {
    ssize_t rc;
    uint32_t count, ordinal;
-   s_time_t stop;
+   s_time_t start, stop;
+   struct tpm_poll poll;
 
    count = be32_to_cpu(*((uint32_t *) (buf + 2)));
    ordinal = be32_to_cpu(*((uint32_t *) (buf + 6)));
@@ -911,6 +1044,7 @@ static ssize_t tpm_transmit(struct tpm_chip *chip, const uint8_t *buf,
 
    //down(&chip->tpm_mutex);
 
+   start = NOW();
    if ((rc = tpm_tis_send(chip, (uint8_t *) buf, count)) < 0) {
       printk("tpm_transmit: tpm_send: error %ld\n", (long) rc);
       goto out;
@@ -920,6 +1054,7 @@ static ssize_t tpm_transmit(struct tpm_chip *chip, const uint8_t *buf,
       goto out_recv;
 
    stop = NOW() + tpm_calc_ordinal_duration(chip, ordinal);
+   tpm_poll_init(&poll);
    do {
       uint8_t status = tpm_tis_status(chip);
       if ((status & (TPM_STS_DATA_AVAIL | TPM_STS_VALID)) ==
@@ -932,7 +1067,7 @@ static ssize_t tpm_transmit(struct tpm_chip *chip, const uint8_t *buf,
 	 goto out;
       }
 
-      msleep(TPM_TIMEOUT);    /* CHECK */
+      tpm_poll_wait(&poll);
       rmb();
    } while (NOW() < stop);
 
@@ -945,6 +1080,8 @@ static ssize_t tpm_transmit(struct tpm_chip *chip, const uint8_t *buf,
 out_recv:
    if((rc = tpm_tis_recv(chip, (uint8_t *) buf, bufsiz)) < 0) {
       printk("tpm_transmit: tpm_recv: error %d\n", (int) rc);
+   } else {
+      tpm_account_ordinal(chip, ordinal, NOW() - start);
    }
 out:
    //up(&chip->tpm_mutex);
@@ -1192,6 +1329,10 @@ struct tpm_chip* init_tpm_tis(unsigned long baseaddr, int localities, unsigned i
       printk("\tSts Valid Int Support\n");
    if (intfcaps & TPM_INTF_DATA_AVAIL_INT)
       printk("\tData Avail Int Support\n");
+   if (TPM_INTF_DATA_TRANSFER_SIZE(intfcaps)) {
+      printk("\tWide Data FIFO Access\n");
+      tpm->fifo_wide = 1;
+   }
 
    /*Interupt setup */
    intmask = ioread32(TPM_INT_ENABLE(tpm, tpm->locality));
@@ -1279,6 +1420,109 @@ int tpm_tis_cmd(struct tpm_chip* tpm, uint8_t* req, size_t reqlen, uint8_t** res
    return 0;
 }
 
+#ifdef CONFIG_TEST
+/*
+ * Runs the FIFO accessors and status polling against a plain page standing
+ * in for the register window: FIFO reads return the register bytes as they
+ * are, writes leave the last value behind, and a timer plays the TPM
+ * setting status bits.
+ */
+#define TPM_TEST_CHECK(cond) do { \
+   if(!(cond)) { \
+      printk("tpm_tis self test: %s failed at line %d\n", #cond, __LINE__); \
+      ++errors; \
+   } \
+} while(0)
+
+static void tpm_tis_test_set_sts(void* data)
+{
+   struct tpm_chip* tpm = data;
+   iowrite8(TPM_STS(tpm, 0), TPM_STS_VALID | TPM_STS_DATA_AVAIL);
+}
+
+int tpm_tis_selftest(void)
+{
+   struct tpm_chip* tpm;
+   struct tpm_poll poll;
+   struct timer timer;
+   uint8_t buf[10];
+   s_time_t start, t, delay;
+   int errors = 0, i;
+
+   tpm = malloc(sizeof(struct tpm_chip));
+   __init_tpm_chip(tpm);
+   tpm->pages[0] = (uint8_t*) alloc_page();
+   memset(tpm->pages[0], 0, PAGE_SIZE);
+   tpm->locality = 0;
+
+   /* Wide reads take the four FIFO bytes in address order */
+   memcpy(TPM_DATA_FIFO(tpm, 0), "\1\2\3\4", 4);
+   tpm->fifo_wide = 1;
+   TPM_TEST_CHECK(fifo_read(tpm, buf, 10) == 10);
+   TPM_TEST_CHECK(!memcmp(buf, "\1\2\3\4\1\2\3\4\1\1", 10));
+   tpm->fifo_wide = 0;
+   TPM_TEST_CHECK(fifo_read(tpm, buf, 10) == 10);
+   TPM_TEST_CHECK(!memcmp(buf, "\1\1\1\1\1\1\1\1\1\1", 10));
+
+   /* Wide writes go a word at a time, then the tail a byte at a time */
+   tpm->fifo_wide = 1;
+   TPM_TEST_CHECK(fifo_write(tpm, (const uint8_t*) "abcdefg", 7) == 7);
+   TPM_TEST_CHECK(!memcmp(TPM_DATA_FIFO(tpm, 0), "gbcd", 4));
+   tpm->fifo_wide = 0;
+   TPM_TEST_CHECK(fifo_write(tpm, (const uint8_t*) "xyzw", 4) == 4);
+   TPM_TEST_CHECK(!memcmp(TPM_DATA_FIFO(tpm, 0), "wbcd", 4));
+
+   /* The burst count sits in the two bytes after the status byte */
+   TPM_STS(tpm, 0)[1] = 0x34;
+   TPM_STS(tpm, 0)[2] = 0x12;
+   tpm->timeout_d = MILLISECS(10);
+   TPM_TEST_CHECK(get_burstcount(tpm) == 0x1234);
+
+   /* Polling spins at first, without sleeping or backing off... */
+   tpm_poll_init(&poll);
+   for(i = 0; NOW() - poll.start < TPM_POLL_SPIN / 2; ++i) {
+      tpm_poll_wait(&poll);
+   }
+   TPM_TEST_CHECK(i > 0 && poll.delay == TPM_POLL_MIN_DELAY);
+
+   /* ...then sleeps at least as long as the delay, which doubles up to
+    * TPM_TIMEOUT */
+   while(NOW() - poll.start < TPM_POLL_SPIN) {
+      barrier();
+   }
+   for(i = 0; i < 12; ++i) {
+      delay = poll.delay;
+      t = NOW();
+      tpm_poll_wait(&poll);
+      TPM_TEST_CHECK(NOW() - t >= delay);
+      TPM_TEST_CHECK(poll.delay == (delay < MILLISECS(TPM_TIMEOUT) ? 2 * delay : delay));
+   }
+
+   /* wait_for_stat() notices a status change soon after it happens... */
+   iowrite8(TPM_STS(tpm, 0), 0);
+   init_timer(&timer, tpm_tis_test_set_sts, tpm);
+   start = NOW();
+   timer_add(&timer, start + MILLISECS(2));
+   TPM_TEST_CHECK(wait_for_stat(tpm, TPM_STS_VALID | TPM_STS_DATA_AVAIL,
+            MILLISECS(100), &tpm->read_queue) == 0);
+   t = NOW() - start;
+   TPM_TEST_CHECK(t >= MILLISECS(2) && t < MILLISECS(2 + 2 * TPM_TIMEOUT));
+   timer_del(&timer);
+
+   /* ...and gives up at the deadline */
+   iowrite8(TPM_STS(tpm, 0), 0);
+   start = NOW();
+   TPM_TEST_CHECK(wait_for_stat(tpm, TPM_STS_VALID, MILLISECS(10),
+            &tpm->read_queue) == -ETIME);
+   TPM_TEST_CHECK(NOW() - start >= MILLISECS(10));
+
+   free_page(tpm->pages[0]);
+   free(tpm);
+   return errors;
+}
+#undef TPM_TEST_CHECK
+#endif
+
 #ifdef HAVE_LIBC
 int tpm_tis_open(struct tpm_chip* tpm)
 {
@@ -1474,6 +1718,10 @@ struct tpm_chip* init_tpm2_tis(unsigned long baseaddr, int localities, unsigned
         printk("\tSts Valid Int Support\n");
     if (intfcaps & TPM_INTF_DATA_AVAIL_INT)
         printk("\tData Avail Int Support\n");
+    if (TPM_INTF_DATA_TRANSFER_SIZE(intfcaps)) {
+        printk("\tWide Data FIFO Access\n");
+        tpm->fifo_wide = 1;
+    }
 
     /*Interupt setup */
     intmask = ioread32(TPM_INT_ENABLE(tpm, tpm->locality));
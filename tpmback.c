@@ -64,12 +64,19 @@
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 
-/* Default size of the tpmif array at initialization */
-#define DEF_ARRAY_SIZE 1
+/* Number of buckets in the domid/handle -> tpmif hash */
+#define TPMIF_HASH_SIZE 64
 
 /* tpmif and tpmdev flags */
 #define TPMIF_CLOSED 1
 #define TPMIF_REQ_READY 2
+/* tpmif is on the ready queue, waiting for a handler to pick it up */
+#define TPMIF_REQ_QUEUED 4
+/* Hand requests out in place, see tpmback_set_zero_copy() */
+#define TPMIF_ZERO_COPY 8
+
+/* Most extra pages (tpmif nr_extra_pages) we map for a frontend */
+#define TPMIF_MAX_EXTRA_PAGES 15
 
 struct tpmif {
    domid_t domid;
@@ -81,8 +88,11 @@ struct tpmif {
    /* Locally bound event channel*/
    evtchn_port_t evtchn;
 
-   /* Shared page */
+   /* Shared page, followed by nr_extra_pages extra pages */
    tpmif_shared_page_t *page;
+   grant_ref_t ring_ref;
+   unsigned int nr_extra_pages;
+   grant_ref_t extra_refs[TPMIF_MAX_EXTRA_PAGES];
 
    enum xenbus_state state;
    enum { DISCONNECTED, DISCONNECTING, CONNECTED } status;
@@ -92,18 +102,36 @@ struct tpmif {
 
    /* state flags */
    int flags;
+
+   /* Hash chain, list of all interfaces and ready queue linkage */
+   struct tpmif* hash_next;
+   MINIOS_TAILQ_ENTRY(struct tpmif) list;
+   MINIOS_STAILQ_ENTRY(struct tpmif) ready;
+
+   /* When the pending request was submitted and picked up */
+   s_time_t submitted;
+   s_time_t picked;
+   struct tpmback_stats stats;
 };
 typedef struct tpmif tpmif_t;
 
 struct tpmback_dev {
 
-   tpmif_t** tpmlist;
+   tpmif_t* hash[TPMIF_HASH_SIZE];
+   MINIOS_TAILQ_HEAD(, struct tpmif) tpmlist;
    unsigned long num_tpms;
-   unsigned long num_alloc;
+   /* Held for writing while frontends come and go, and for reading by
+    * walks of tpmlist that may sleep */
+   struct rw_semaphore tpmlist_sem;
+
+   /* Interfaces with a request nobody has picked up yet, oldest first.
+    * A frontend has at most one request in flight, so serving this in
+    * order is round robin across frontends. */
+   MINIOS_STAILQ_HEAD(, struct tpmif) readyq;
 
    struct gntmap map;
 
-   /* True if at least one tpmif has a request to be handled */
+   /* TPMIF_REQ_READY if the ready queue is not empty */
    int flags;
 
    xenbus_event_queue events;
@@ -119,9 +147,10 @@ enum { EV_NONE, EV_NEWFE, EV_STCHNG } tpm_ev_enum;
 /* Global objects */
 static struct thread* eventthread = NULL;
 static tpmback_dev_t gtpmdev = {
-   .tpmlist = NULL,
+   .tpmlist = MINIOS_TAILQ_HEAD_INITIALIZER(gtpmdev.tpmlist),
    .num_tpms = 0,
-   .num_alloc = 0,
+   .tpmlist_sem = __RWSEM_INITIALIZER(gtpmdev.tpmlist_sem),
+   .readyq = MINIOS_STAILQ_HEAD_INITIALIZER(gtpmdev.readyq),
    .flags = TPMIF_CLOSED,
    .events = NULL,
    .open_callback = NULL,
@@ -131,78 +160,81 @@ struct wait_queue_head waitq;
 int globalinit = 0;
 
 /************************************
- * TPMIF SORTED ARRAY FUNCTIONS
- * tpmback_dev_t.tpmlist is a sorted array, sorted by domid and then handle number
+ * TPMIF LOOKUP AND READY QUEUE
+ * Interfaces are hashed by domid and handle number and also kept on
+ * tpmback_dev_t.tpmlist in the order they were created.
  * Duplicates are not allowed
  * **********************************/
 
+static inline unsigned int tpmif_hash(domid_t domid, unsigned int handle)
+{
+   return ((unsigned int) domid * 31 + handle) % TPMIF_HASH_SIZE;
+}
+
+/* Called from the event channel handler */
 static void tpmif_req_ready(tpmif_t* tpmif) {
-   tpmif->flags |= TPMIF_REQ_READY;
+   tpmif->flags |= TPMIF_REQ_READY | TPMIF_REQ_QUEUED;
+   tpmif->submitted = NOW();
+   MINIOS_STAILQ_INSERT_TAIL(&gtpmdev.readyq, tpmif, ready);
    gtpmdev.flags |= TPMIF_REQ_READY;
 }
 
-static void tpmdev_check_req(void) {
-   int i;
+/* Take tpmif off the ready queue, if it is on it */
+static void tpmif_dequeue(tpmif_t* tpmif) {
    int flags;
    local_irq_save(flags);
-   for(i = 0; i < gtpmdev.num_tpms; ++i) {
-      if(gtpmdev.tpmlist[i]->flags & TPMIF_REQ_READY) {
-	 gtpmdev.flags |= TPMIF_REQ_READY;
-	 local_irq_restore(flags);
-	 return;
-      }
+   if(tpmif->flags & TPMIF_REQ_QUEUED) {
+      MINIOS_STAILQ_REMOVE(&gtpmdev.readyq, tpmif, struct tpmif, ready);
+      tpmif->flags &= ~TPMIF_REQ_QUEUED;
+      tpmif->picked = NOW();
+   }
+   if(MINIOS_STAILQ_EMPTY(&gtpmdev.readyq)) {
+      gtpmdev.flags &= ~TPMIF_REQ_READY;
    }
-   gtpmdev.flags &= ~TPMIF_REQ_READY;
    local_irq_restore(flags);
 }
 
-static void tpmif_req_finished(tpmif_t* tpmif) {
-   tpmif->flags &= ~TPMIF_REQ_READY;
-   tpmdev_check_req();
+/* Pops the oldest ready interface, NULL if there is none */
+static tpmif_t* tpmdev_next_ready(void) {
+   tpmif_t* tpmif;
+   int flags;
+   local_irq_save(flags);
+   tpmif = MINIOS_STAILQ_FIRST(&gtpmdev.readyq);
+   if(tpmif != NULL) {
+      tpmif_dequeue(tpmif);
+   }
+   local_irq_restore(flags);
+   return tpmif;
 }
 
-int __get_tpmif_index(int st, int n, domid_t domid, unsigned int handle)
-{
-   int i = st + n /2;
-   tpmif_t* tmp;
+static void tpmif_req_finished(tpmif_t* tpmif) {
+   s_time_t now = NOW();
+   s_time_t wait = tpmif->picked - tpmif->submitted;
+   s_time_t service = now - tpmif->picked;
 
-   if( n <= 0 )
-      return -1;
+   tpmif->flags &= ~TPMIF_REQ_READY;
 
-   tmp = gtpmdev.tpmlist[i];
-   if(domid == tmp->domid && tmp->handle == handle) {
-      return i;
-   } else if ( (domid < tmp->domid) ||
-	 (domid == tmp->domid && handle < tmp->handle)) {
-      return __get_tpmif_index(st, n/2, domid, handle);
-   } else {
-      return __get_tpmif_index(i + 1, n/2 - ((n +1) % 2), domid, handle);
+   tpmif->stats.requests++;
+   tpmif->stats.wait_total += wait;
+   tpmif->stats.service_total += service;
+   if(wait > tpmif->stats.wait_max) {
+      tpmif->stats.wait_max = wait;
+   }
+   if(service > tpmif->stats.service_max) {
+      tpmif->stats.service_max = service;
    }
-}
-
-/* Returns the array index of the tpmif domid/handle. Returns -1 if no such tpmif exists */
-int get_tpmif_index(domid_t domid, unsigned int handle)
-{
-   int flags;
-   int index;
-   local_irq_save(flags);
-   index = __get_tpmif_index(0, gtpmdev.num_tpms, domid, handle);
-   local_irq_restore(flags);
-   return index;
 }
 
 /* Returns the tpmif domid/handle or NULL if none exists */
 tpmif_t* get_tpmif(domid_t domid, unsigned int handle)
 {
    int flags;
-   int i;
    tpmif_t* ret;
    local_irq_save(flags);
-   i = get_tpmif_index(domid, handle);
-   if (i < 0) {
-      ret = NULL;
-   } else {
-      ret = gtpmdev.tpmlist[i];
+   for(ret = gtpmdev.hash[tpmif_hash(domid, handle)]; ret != NULL; ret = ret->hash_next) {
+      if(ret->domid == domid && ret->handle == handle) {
+	 break;
+      }
    }
    local_irq_restore(flags);
    return ret;
@@ -211,28 +243,28 @@ tpmif_t* get_tpmif(domid_t domid, unsigned int handle)
 /* Remove the given tpmif. Returns 0 if it was removed, -1 if it was not removed */
 int remove_tpmif(tpmif_t* tpmif)
 {
-   int i, j;
+   tpmif_t** pp;
    char* err;
    int flags;
+   down_write(&gtpmdev.tpmlist_sem);
    local_irq_save(flags);
 
-   /* Find the index in the array if it exists */
-   i = get_tpmif_index(tpmif->domid, tpmif->handle);
-   if (i < 0) {
-      goto error;
+   /* Find it in its hash chain if it exists */
+   for(pp = &gtpmdev.hash[tpmif_hash(tpmif->domid, tpmif->handle)]; *pp != tpmif; pp = &(*pp)->hash_next) {
+      if(*pp == NULL) {
+	 goto error;
+      }
    }
 
-   /* Remove the interface from the list */
-   for(j = i; j < gtpmdev.num_tpms - 1; ++j) {
-      gtpmdev.tpmlist[j] = gtpmdev.tpmlist[j+1];
-   }
-   gtpmdev.tpmlist[j] = NULL;
+   /* Remove the interface from the hash, the list and the ready queue */
+   *pp = tpmif->hash_next;
+   tpmif->hash_next = NULL;
+   MINIOS_TAILQ_REMOVE(&gtpmdev.tpmlist, tpmif, list);
    --gtpmdev.num_tpms;
-
-   /* If removed tpm was the only ready tpm, then we need to check and turn off the ready flag */
-   tpmdev_check_req();
+   tpmif_dequeue(tpmif);
 
    local_irq_restore(flags);
+   up_write(&gtpmdev.tpmlist_sem);
 
    /* Stop listening for events on this tpm interface */
    if((err = xenbus_unwatch_path_token(XBT_NIL, tpmif->fe_state_path, tpmif->fe_state_path))) {
@@ -243,56 +275,41 @@ int remove_tpmif(tpmif_t* tpmif)
    return 0;
 error:
    local_irq_restore(flags);
+   up_write(&gtpmdev.tpmlist_sem);
    return -1;
 }
 
-/* Insert tpmif into dev->tpmlist. Returns 0 on success and non zero on error.
+/* Insert tpmif into the device. Returns 0 on success and non zero on error.
  * It is an error to insert a tpmif with the same domid and handle
  * number
  * as something already in the list */
 int insert_tpmif(tpmif_t* tpmif)
 {
    int flags;
-   unsigned int i, j;
+   unsigned int bucket;
    tpmif_t* tmp;
    char* err;
    char path[512];
 
+   down_write(&gtpmdev.tpmlist_sem);
    local_irq_save(flags);
 
-   /*Check if we need to allocate more space */
-   if (gtpmdev.num_tpms == gtpmdev.num_alloc) {
-      gtpmdev.num_alloc *= 2;
-      gtpmdev.tpmlist = realloc(gtpmdev.tpmlist, gtpmdev.num_alloc);
-   }
-
-   /*Find where to put the new interface */
-   for(i = 0; i < gtpmdev.num_tpms; ++i)
-   {
-      tmp = gtpmdev.tpmlist[i];
+   bucket = tpmif_hash(tpmif->domid, tpmif->handle);
+   for(tmp = gtpmdev.hash[bucket]; tmp != NULL; tmp = tmp->hash_next) {
       if(tpmif->domid == tmp->domid && tpmif->handle == tmp->handle) {
 	 TPMBACK_ERR("Tried to insert duplicate tpm interface %u/%u\n", (unsigned int) tpmif->domid, tpmif->handle);
 	 goto error;
       }
-      if((tpmif->domid < tmp->domid) ||
-	    (tpmif->domid == tmp->domid && tpmif->handle < tmp->handle)) {
-	 break;
-      }
-   }
-
-   /*Shift all the tpm pointers past i down one */
-   for(j = gtpmdev.num_tpms; j > i; --j) {
-      gtpmdev.tpmlist[j] = gtpmdev.tpmlist[j-1];
    }
 
    /*Add the new interface */
-   gtpmdev.tpmlist[i] = tpmif;
+   tpmif->hash_next = gtpmdev.hash[bucket];
+   gtpmdev.hash[bucket] = tpmif;
+   MINIOS_TAILQ_INSERT_TAIL(&gtpmdev.tpmlist, tpmif, list);
    ++gtpmdev.num_tpms;
 
-   /*Should not be needed, anything inserted with ready flag is probably an error */
-   tpmdev_check_req();
-
    local_irq_restore(flags);
+   up_write(&gtpmdev.tpmlist_sem);
 
    snprintf(path, 512, "backend/vtpm/%u/%u/feature-protocol-v2", (unsigned int) tpmif->domid, tpmif->handle);
    if ((err = xenbus_write(XBT_NIL, path, "1")))
@@ -316,6 +333,7 @@ int insert_tpmif(tpmif_t* tpmif)
    return 0;
 error:
    local_irq_restore(flags);
+   up_write(&gtpmdev.tpmlist_sem);
 error_post_irq:
    return -1;
 }
@@ -389,7 +407,10 @@ static tpmif_t* __init_tpmif(domid_t domid, unsigned int handle)
    tpmif->state = XenbusStateInitialising;
    tpmif->status = DISCONNECTED;
    tpmif->page = NULL;
+   tpmif->nr_extra_pages = 0;
    tpmif->flags = 0;
+   tpmif->hash_next = NULL;
+   memset(&tpmif->stats, 0, sizeof(tpmif->stats));
    tpmif->opaque = NULL;
    memset(tpmif->uuid, 0, sizeof(tpmif->uuid));
    return tpmif;
@@ -405,7 +426,7 @@ void __free_tpmif(tpmif_t* tpmif)
    }
    free(tpmif);
 }
-/* Creates a new tpm interface, adds it to the sorted array and returns it.
+/* Creates a new tpm interface, adds it to the device and returns it.
  * returns NULL on error
  * If the tpm interface already exists, it is returned*/
 tpmif_t* new_tpmif(domid_t domid, unsigned int handle)
@@ -460,7 +481,7 @@ error:
 
 }
 
-/* Removes tpmif from dev->tpmlist and frees it's memory usage */
+/* Removes tpmif from the device and frees it's memory usage */
 void free_tpmif(tpmif_t* tpmif)
 {
    char* err;
@@ -479,7 +500,7 @@ void free_tpmif(tpmif_t* tpmif)
       tpmif->status = DISCONNECTING;
       mask_evtchn(tpmif->evtchn);
 
-      if(gntmap_munmap(&gtpmdev.map, (unsigned long)tpmif->page, 1)) {
+      if(gntmap_munmap(&gtpmdev.map, (unsigned long)tpmif->page, 1 + tpmif->nr_extra_pages)) {
 	 TPMBACK_ERR("%u/%u Error occured while trying to unmap shared page\n", (unsigned int) tpmif->domid, tpmif->handle);
       }
 
@@ -528,6 +549,9 @@ void tpmback_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
    {
    case TPMIF_STATE_SUBMIT:
       TPMBACK_DEBUG("EVENT CHANNEL FIRE %u/%u\n", (unsigned int) tpmif->domid, tpmif->handle);
+      /* Duplicate notifications for a request we already have are ignored */
+      if (tpmif->flags & TPMIF_REQ_READY)
+         return;
       tpmif_req_ready(tpmif);
       wake_up(&waitq);
       break;
@@ -605,6 +629,8 @@ int connect_fe(tpmif_t* tpmif)
    free(value);
 
    domid = tpmif->domid;
+   tpmif->ring_ref = ringref;
+   tpmif->nr_extra_pages = 0;
    if((tpmif->page = gntmap_map_grant_refs(&gtpmdev.map, 1, &domid, 0, &ringref, PROT_READ | PROT_WRITE)) == NULL) {
       TPMBACK_ERR("Failed to map grant reference %u/%u\n", (unsigned int) tpmif->domid, tpmif->handle);
       return -1;
@@ -647,7 +673,7 @@ static void disconnect_fe(tpmif_t* tpmif)
       tpmif->status = DISCONNECTING;
       mask_evtchn(tpmif->evtchn);
 
-      if(gntmap_munmap(&gtpmdev.map, (unsigned long)tpmif->page, 1)) {
+      if(gntmap_munmap(&gtpmdev.map, (unsigned long)tpmif->page, 1 + tpmif->nr_extra_pages)) {
 	 TPMBACK_ERR("%u/%u Error occured while trying to unmap shared page\n", (unsigned int) tpmif->domid, tpmif->handle);
       }
 
@@ -817,6 +843,22 @@ int tpmback_set_opaque(domid_t domid, unsigned int handle, void *opaque)
    return 0;
 }
 
+int tpmback_set_zero_copy(domid_t domid, unsigned int handle, int enable)
+{
+   tpmif_t* tpmif;
+   if((tpmif = get_tpmif(domid, handle)) == NULL) {
+      TPMBACK_DEBUG("set_zero_copy() failed, %u/%u is an invalid frontend\n", (unsigned int) domid, handle);
+      return -1;
+   }
+
+   if(enable) {
+      tpmif->flags |= TPMIF_ZERO_COPY;
+   } else {
+      tpmif->flags &= ~TPMIF_ZERO_COPY;
+   }
+   return 0;
+}
+
 unsigned char* tpmback_get_uuid(domid_t domid, unsigned int handle)
 {
    tpmif_t* tpmif;
@@ -861,16 +903,16 @@ static void event_listener(void)
 
    /* Wait and listen for changes in frontend connections */
    while(1) {
-      path = xenbus_wait_for_watch_return(&gtpmdev.events);
+      path = xenbus_wait_for_watch_borrow(&gtpmdev.events);
 
       /*If quit flag was set then exit */
       if(gtpmdev.flags & TPMIF_CLOSED) {
 	 TPMBACK_DEBUG("listener thread got quit event. Exiting..\n");
-	 free(path);
+	 xenbus_free_event(path);
 	 break;
       }
       handle_backend_event(*path);
-      free(path);
+      xenbus_free_event(path);
 
    }
 
@@ -892,8 +934,6 @@ void init_tpmback(void (*open_cb)(domid_t, unsigned int), void (*close_cb)(domid
       globalinit = 1;
    }
    printk("============= Init TPM BACK ================\n");
-   gtpmdev.tpmlist = malloc(sizeof(tpmif_t*) * DEF_ARRAY_SIZE);
-   gtpmdev.num_alloc = DEF_ARRAY_SIZE;
    gtpmdev.num_tpms = 0;
    gtpmdev.flags = 0;
 
@@ -913,11 +953,8 @@ void shutdown_tpmback(void)
    //printk("num tpms is %d\n", gtpmdev.num_tpms);
    /*Free all backend instances */
    while(gtpmdev.num_tpms) {
-      free_tpmif(gtpmdev.tpmlist[0]);
+      free_tpmif(MINIOS_TAILQ_FIRST(&gtpmdev.tpmlist));
    }
-   free(gtpmdev.tpmlist);
-   gtpmdev.tpmlist = NULL;
-   gtpmdev.num_alloc = 0;
 
    /* Wake up anyone possibly waiting on the device and let them exit */
    wake_up(&waitq);
@@ -936,10 +973,119 @@ static void init_tpmcmd(tpmcmd_t* tpmcmd, domid_t domid, unsigned int handle, vo
    tpmcmd->resp_len = 0;
 }
 
+/* Command objects and their request buffers are recycled rather than
+ * malloc'd for every request */
+struct tpmcmd_slot {
+   tpmcmd_t cmd;
+   struct tpmcmd_slot* next;
+   uint8_t* buf;
+   unsigned int buf_size;
+};
+static struct tpmcmd_slot* free_cmds = NULL;
+
+static tpmcmd_t* alloc_tpmcmd(void)
+{
+   struct tpmcmd_slot* slot;
+
+   if((slot = free_cmds) != NULL) {
+      free_cmds = slot->next;
+   } else if((slot = malloc(sizeof(*slot))) == NULL) {
+      return NULL;
+   } else {
+      slot->buf = NULL;
+      slot->buf_size = 0;
+   }
+   return &slot->cmd;
+}
+
+/* Private request buffer of at least len bytes for cmd */
+static uint8_t* tpmcmd_buf(tpmcmd_t* cmd, unsigned int len)
+{
+   struct tpmcmd_slot* slot = (struct tpmcmd_slot*) cmd;
+
+   if(len > slot->buf_size) {
+      free(slot->buf);
+      if((slot->buf = malloc(len)) == NULL) {
+         slot->buf_size = 0;
+         return NULL;
+      }
+      slot->buf_size = len;
+   }
+   return slot->buf;
+}
+
+static void free_tpmcmd(tpmcmd_t* cmd)
+{
+   struct tpmcmd_slot* slot = (struct tpmcmd_slot*) cmd;
+
+   slot->next = free_cmds;
+   free_cmds = slot;
+}
+
+/* Make sure the extra pages the frontend lists are mapped right after
+ * the shared page. The mapping is kept for as long as the frontend keeps
+ * using the same grants, which is normally for the whole connection. */
+static int map_extra_pages(tpmif_t* tpmif)
+{
+   grant_ref_t refs[1 + TPMIF_MAX_EXTRA_PAGES];
+   unsigned int nr_extra;
+   uint32_t domid;
+
+   nr_extra = tpmif->page->nr_extra_pages;
+   if(nr_extra > TPMIF_MAX_EXTRA_PAGES) {
+      TPMBACK_ERR("%u/%u Too many extra pages (%u)\n", (unsigned int) tpmif->domid, tpmif->handle, nr_extra);
+      return -1;
+   }
+   if(nr_extra == tpmif->nr_extra_pages &&
+         !memcmp(tpmif->page->extra_pages, tpmif->extra_refs, nr_extra * sizeof(grant_ref_t))) {
+      return 0;
+   }
+
+   refs[0] = tpmif->ring_ref;
+   memcpy(&refs[1], tpmif->page->extra_pages, nr_extra * sizeof(grant_ref_t));
+
+   if(gntmap_munmap(&gtpmdev.map, (unsigned long)tpmif->page, 1 + tpmif->nr_extra_pages)) {
+      TPMBACK_ERR("%u/%u Error occured while trying to unmap shared pages\n", (unsigned int) tpmif->domid, tpmif->handle);
+   }
+
+   domid = tpmif->domid;
+   tpmif->page = gntmap_map_grant_refs(&gtpmdev.map, 1 + nr_extra, &domid, 0, refs, PROT_READ | PROT_WRITE);
+   if(tpmif->page == NULL && nr_extra) {
+      /* Fall back to the shared page alone */
+      TPMBACK_ERR("%u/%u Failed to map %u extra pages\n", (unsigned int) tpmif->domid, tpmif->handle, nr_extra);
+      nr_extra = 0;
+      tpmif->page = gntmap_map_grant_refs(&gtpmdev.map, 1, &domid, 0, refs, PROT_READ | PROT_WRITE);
+   }
+   if(tpmif->page == NULL) {
+      /* Only this frontend is affected: cut it off, get_request() closes it */
+      TPMBACK_ERR("%u/%u Failed to remap shared page\n", (unsigned int) tpmif->domid, tpmif->handle);
+      tpmif->nr_extra_pages = 0;
+      tpmif->status = DISCONNECTING;
+      mask_evtchn(tpmif->evtchn);
+      unbind_evtchn(tpmif->evtchn);
+      tpmif->status = DISCONNECTED;
+      return -1;
+   }
+   tpmif->nr_extra_pages = nr_extra;
+   memcpy(tpmif->extra_refs, &refs[1], nr_extra * sizeof(grant_ref_t));
+   return tpmif->page->nr_extra_pages == nr_extra ? 0 : -1;
+}
+
+/* Offset of the packet data and the room for it in the mapped pages */
+static inline unsigned int tpmif_data_offset(tpmif_t* tpmif)
+{
+   return sizeof(tpmif_shared_page_t) + 4 * tpmif->nr_extra_pages;
+}
+
+static inline unsigned int tpmif_data_max(tpmif_t* tpmif)
+{
+   return (1 + tpmif->nr_extra_pages) * PAGE_SIZE - tpmif_data_offset(tpmif);
+}
+
 tpmcmd_t* get_request(tpmif_t* tpmif) {
    tpmcmd_t* cmd;
    tpmif_shared_page_t *shr;
-   unsigned int offset;
+   uint8_t* data;
    int flags;
 #ifdef TPMBACK_PRINT_DEBUG
    int i;
@@ -947,28 +1093,33 @@ tpmcmd_t* get_request(tpmif_t* tpmif) {
 
    local_irq_save(flags);
 
-   /* Allocate the cmd object to hold the data */
-   if((cmd = malloc(sizeof(*cmd))) == NULL) {
+   if((cmd = alloc_tpmcmd()) == NULL) {
       goto error;
    }
    init_tpmcmd(cmd, tpmif->domid, tpmif->handle, tpmif->opaque);
 
+   if(map_extra_pages(tpmif)) {
+      goto error;
+   }
+
    shr = tpmif->page;
    cmd->req_len = shr->length;
    cmd->locality = shr->locality;
-   offset = sizeof(*shr) + 4*shr->nr_extra_pages;
-   if (offset > PAGE_SIZE || offset + cmd->req_len > PAGE_SIZE) {
-      TPMBACK_ERR("%u/%u Command size too long for shared page!\n", (unsigned int) tpmif->domid, tpmif->handle);
+   if (cmd->req_len > tpmif_data_max(tpmif)) {
+      TPMBACK_ERR("%u/%u Command size too long for shared pages!\n", (unsigned int) tpmif->domid, tpmif->handle);
       goto error;
    }
-   /* Allocate the buffer */
-   if(cmd->req_len) {
-      if((cmd->req = malloc(cmd->req_len)) == NULL) {
+   data = tpmif_data_offset(tpmif) + (uint8_t*)shr;
+   if(tpmif->flags & TPMIF_ZERO_COPY) {
+      cmd->req = data;
+   } else {
+      /* The frontend can still write to its pages, so handlers must not
+       * parse the command there */
+      if(cmd->req_len && (cmd->req = tpmcmd_buf(cmd, cmd->req_len)) == NULL) {
 	 goto error;
       }
+      memcpy(cmd->req, data, cmd->req_len);
    }
-   /* Copy the bits from the shared page(s) */
-   memcpy(cmd->req, offset + (uint8_t*)shr, cmd->req_len);
 
 #ifdef TPMBACK_PRINT_DEBUG
    TPMBACK_DEBUG("Received Tpm Command from %u/%u of size %u", (unsigned int) tpmif->domid, tpmif->handle, cmd->req_len);
@@ -985,14 +1136,17 @@ tpmcmd_t* get_request(tpmif_t* tpmif) {
    return cmd;
 error:
    if(cmd != NULL) {
-      if (cmd->req != NULL) {
-	 free(cmd->req);
-	 cmd->req = NULL;
-      }
-      free(cmd);
+      free_tpmcmd(cmd);
       cmd = NULL;
    }
+   /* Drop the request so a later submission is not ignored */
+   tpmif->flags &= ~TPMIF_REQ_READY;
    local_irq_restore(flags);
+   if(tpmif->status == DISCONNECTED) {
+      /* The frontend has to connect again to get a new shared page */
+      tpmif_change_state(tpmif, XenbusStateClosed);
+      TPMBACK_LOG("Frontend %u/%u disconnected after a mapping failure\n", (unsigned int) tpmif->domid, tpmif->handle);
+   }
    return NULL;
 
 }
@@ -1000,7 +1154,7 @@ error:
 void send_response(tpmcmd_t* cmd, tpmif_t* tpmif)
 {
    tpmif_shared_page_t *shr;
-   unsigned int offset;
+   uint8_t* data;
    int flags;
 #ifdef TPMBACK_PRINT_DEBUG
 int i;
@@ -1011,12 +1165,15 @@ int i;
    shr = tpmif->page;
    shr->length = cmd->resp_len;
 
-   offset = sizeof(*shr) + 4*shr->nr_extra_pages;
-   if (offset > PAGE_SIZE || offset + cmd->resp_len > PAGE_SIZE) {
-      TPMBACK_ERR("%u/%u Command size too long for shared page!\n", (unsigned int) tpmif->domid, tpmif->handle);
+   if (cmd->resp_len > tpmif_data_max(tpmif)) {
+      TPMBACK_ERR("%u/%u Command size too long for shared pages!\n", (unsigned int) tpmif->domid, tpmif->handle);
       goto error;
    }
-   memcpy(offset + (uint8_t*)shr, cmd->resp, cmd->resp_len);
+   /* The handler may have built the response in place */
+   data = tpmif_data_offset(tpmif) + (uint8_t*)shr;
+   if (cmd->resp != data) {
+      memcpy(data, cmd->resp, cmd->resp_len);
+   }
 
 #ifdef TPMBACK_PRINT_DEBUG
    TPMBACK_DEBUG("Sent response to %u/%u of size %u", (unsigned int) tpmif->domid, tpmif->handle, cmd->resp_len);
@@ -1024,7 +1181,7 @@ int i;
       if (!(i % 30)) {
 	 TPMBACK_DEBUG_MORE("\n");
       }
-      TPMBACK_DEBUG_MORE("%02hhX ", cmd->resp[i]);
+      TPMBACK_DEBUG_MORE("%02hhX ", data[i]);
    }
    TPMBACK_DEBUG_MORE("\n\n");
 #endif
@@ -1041,7 +1198,7 @@ error:
 
 tpmcmd_t* tpmback_req_any(void)
 {
-   int i;
+   tpmif_t* tpmif;
    /* Block until something has a request */
    wait_event(waitq, (gtpmdev.flags & (TPMIF_REQ_READY | TPMIF_CLOSED)));
 
@@ -1052,14 +1209,11 @@ tpmcmd_t* tpmback_req_any(void)
       return NULL;
    }
 
-   for(i = 0; i < gtpmdev.num_tpms; ++i) {
-      if(gtpmdev.tpmlist[i]->flags & TPMIF_REQ_READY) {
-	 return get_request(gtpmdev.tpmlist[i]);
-      }
+   if((tpmif = tpmdev_next_ready()) == NULL) {
+      TPMBACK_ERR("backend request ready flag was set but no interfaces were actually ready\n");
+      return NULL;
    }
-
-   TPMBACK_ERR("backend request ready flag was set but no interfaces were actually ready\n");
-   return NULL;
+   return get_request(tpmif);
 }
 
 tpmcmd_t* tpmback_req(domid_t domid, unsigned int handle)
@@ -1070,7 +1224,7 @@ tpmcmd_t* tpmback_req(domid_t domid, unsigned int handle)
       return NULL;
    }
 
-   wait_event(waitq, (tpmif->flags & (TPMIF_REQ_READY | TPMIF_CLOSED) || gtpmdev.flags & TPMIF_CLOSED));
+   wait_event(waitq, (tpmif->flags & (TPMIF_REQ_QUEUED | TPMIF_CLOSED) || gtpmdev.flags & TPMIF_CLOSED));
 
    /* Check if were shutting down */
    if(tpmif->flags & TPMIF_CLOSED || gtpmdev.flags & TPMIF_CLOSED) {
@@ -1079,6 +1233,7 @@ tpmcmd_t* tpmback_req(domid_t domid, unsigned int handle)
       return NULL;
    }
 
+   tpmif_dequeue(tpmif);
    return get_request(tpmif);
 }
 
@@ -1102,10 +1257,7 @@ void tpmback_resp(tpmcmd_t* tpmcmd)
    send_response(tpmcmd, tpmif);
 
 end:
-   if(tpmcmd->req != NULL) {
-      free(tpmcmd->req);
-   }
-   free(tpmcmd);
+   free_tpmcmd(tpmcmd);
    return;
 }
 
@@ -1118,7 +1270,7 @@ int tpmback_wait_for_frontend_connect(domid_t *domid, unsigned int *handle)
       return -1;
    }
    local_irq_save(flags);
-   tpmif = gtpmdev.tpmlist[0];
+   tpmif = MINIOS_TAILQ_FIRST(&gtpmdev.tpmlist);
    *domid = tpmif->domid;
    *handle = tpmif->handle;
    local_irq_restore(flags);
@@ -1130,3 +1282,38 @@ int tpmback_num_frontends(void)
 {
    return gtpmdev.num_tpms;
 }
+
+int tpmback_get_stats(domid_t domid, unsigned int handle, struct tpmback_stats* stats)
+{
+   tpmif_t* tpmif;
+   int flags;
+   local_irq_save(flags);
+   if((tpmif = get_tpmif(domid, handle)) != NULL) {
+      *stats = tpmif->stats;
+   }
+   local_irq_restore(flags);
+   return tpmif == NULL ? -1 : 0;
+}
+
+void tpmback_dump_stats(void)
+{
+   tpmif_t* tpmif;
+   struct tpmback_stats* st;
+
+   down_read(&gtpmdev.tpmlist_sem);
+   printk("tpmback: %lu frontends\n", gtpmdev.num_tpms);
+   MINIOS_TAILQ_FOREACH(tpmif, &gtpmdev.tpmlist, list) {
+      st = &tpmif->stats;
+      if(!st->requests) {
+	 continue;
+      }
+      printk("  %u/%u: %llu requests, wait avg %llu max %llu us, service avg %llu max %llu us\n",
+	    (unsigned int) tpmif->domid, tpmif->handle,
+	    (unsigned long long) st->requests,
+	    (unsigned long long) (st->wait_total / st->requests / 1000),
+	    (unsigned long long) (st->wait_max / 1000),
+	    (unsigned long long) (st->service_total / st->requests / 1000),
+	    (unsigned long long) (st->service_max / 1000));
+   }
+   up_read(&gtpmdev.tpmlist_sem);
+}
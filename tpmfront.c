@@ -46,6 +46,10 @@
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 
+/* Offset of the packet data and the room for it in the shared pages */
+#define TPMFRONT_DATA_OFFSET (sizeof(tpmif_shared_page_t) + 4 * TPMFRONT_NR_EXTRA_PAGES)
+#define TPMFRONT_DATA_MAX ((PAGE_SIZE << TPMFRONT_PAGE_ORDER) - TPMFRONT_DATA_OFFSET)
+
 void tpmfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data) {
    struct tpmfront_dev* dev = (struct tpmfront_dev*) data;
    tpmif_shared_page_t *shr = dev->page;
@@ -200,18 +204,35 @@ static int wait_for_backend_state_changed(struct tpmfront_dev* dev, XenbusState
    return ret;
 }
 
+static void tpmfront_end_access(struct tpmfront_dev* dev)
+{
+   int i;
+
+   gnttab_end_access(dev->ring_ref);
+   for(i = 0; i < TPMFRONT_NR_EXTRA_PAGES; ++i) {
+      gnttab_end_access(dev->extra_refs[i]);
+   }
+}
+
 static int tpmfront_connect(struct tpmfront_dev* dev)
 {
    char* err;
-   /* Create shared page */
-   dev->page = (tpmif_shared_page_t *)alloc_page();
+   int i;
+   /* Create the shared page and the extra pages following it */
+   dev->page = (tpmif_shared_page_t *)alloc_pages(TPMFRONT_PAGE_ORDER);
    if(dev->page == NULL) {
       TPMFRONT_ERR("Unable to allocate page for shared memory\n");
       goto error;
    }
-   memset(dev->page, 0, PAGE_SIZE);
+   memset(dev->page, 0, PAGE_SIZE << TPMFRONT_PAGE_ORDER);
    dev->ring_ref = gnttab_grant_access(dev->bedomid, virt_to_mfn(dev->page), 0);
    TPMFRONT_DEBUG("grant ref is %lu\n", (unsigned long) dev->ring_ref);
+   for(i = 0; i < TPMFRONT_NR_EXTRA_PAGES; ++i) {
+      dev->extra_refs[i] = gnttab_grant_access(dev->bedomid,
+            virt_to_mfn((char *)dev->page + (i + 1) * PAGE_SIZE), 0);
+      dev->page->extra_pages[i] = dev->extra_refs[i];
+   }
+   dev->page->nr_extra_pages = TPMFRONT_NR_EXTRA_PAGES;
 
    /*Create event channel */
    if(evtchn_alloc_unbound(dev->bedomid, tpmfront_handler, dev, &dev->evtchn)) {
@@ -241,8 +262,8 @@ error_postevtchn:
       mask_evtchn(dev->evtchn);
       unbind_evtchn(dev->evtchn);
 error_postmap:
-      gnttab_end_access(dev->ring_ref);
-      free_page(dev->page);
+      tpmfront_end_access(dev);
+      free_pages(dev->page, TPMFRONT_PAGE_ORDER);
 error:
    return -1;
 }
@@ -268,6 +289,7 @@ struct tpmfront_dev* init_tpmfront(const char* _nodename)
    dev->nodename = strdup(nodename);
 
    init_waitqueue_head(&dev->waitq);
+   init_waitqueue_head(&dev->busyq);
 
    /* Get backend domid */
    snprintf(path, 512, "%s/backend-id", dev->nodename);
@@ -380,9 +402,9 @@ void shutdown_tpmfront(struct tpmfront_dev* dev)
       /* Close event channel and unmap shared page */
       mask_evtchn(dev->evtchn);
       unbind_evtchn(dev->evtchn);
-      gnttab_end_access(dev->ring_ref);
+      tpmfront_end_access(dev);
 
-      free_page(dev->page);
+      free_pages(dev->page, TPMFRONT_PAGE_ORDER);
    }
 
    /* Cleanup memory usage */
@@ -424,9 +446,9 @@ int tpmfront_send(struct tpmfront_dev* dev, const uint8_t* msg, size_t length)
 #endif
 
    /* Copy to shared pages now */
-   offset = sizeof(*shr);
-   if (length + offset > PAGE_SIZE) {
-      TPMFRONT_ERR("Message too long for shared page\n");
+   offset = TPMFRONT_DATA_OFFSET;
+   if (length > TPMFRONT_DATA_MAX) {
+      TPMFRONT_ERR("Message too long for shared pages\n");
       return -1;
    }
    memcpy(offset + (uint8_t*)shr, msg, length);
@@ -465,15 +487,15 @@ int i;
    /* Initialize */
    *msg = NULL;
    *length = 0;
-   offset = sizeof(*shr);
+   offset = TPMFRONT_DATA_OFFSET;
 
    if (shr->state != TPMIF_STATE_FINISH)
       goto quit;
 
    *length = shr->length;
 
-   if (*length + offset > PAGE_SIZE) {
-      TPMFRONT_ERR("Reply too long for shared page\n");
+   if (*length > TPMFRONT_DATA_MAX) {
+      TPMFRONT_ERR("Reply too long for shared pages\n");
       return -1;
    }
 
@@ -509,14 +531,18 @@ quit:
 int tpmfront_cmd(struct tpmfront_dev* dev, uint8_t* req, size_t reqlen, uint8_t** resp, size_t* resplen)
 {
    int rc;
-   if((rc = tpmfront_send(dev, req, reqlen))) {
-      return rc;
-   }
-   if((rc = tpmfront_recv(dev, resp, resplen))) {
-      return rc;
+
+   /* Queue up behind any command from another thread */
+   wait_event(dev->busyq, !dev->busy);
+   dev->busy = 1;
+
+   if((rc = tpmfront_send(dev, req, reqlen)) == 0) {
+      rc = tpmfront_recv(dev, resp, resplen);
    }
 
-   return 0;
+   dev->busy = 0;
+   wake_up(&dev->busyq);
+   return rc;
 }
 
 int tpmfront_set_locality(struct tpmfront_dev* dev, int locality)
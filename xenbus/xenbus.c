@@ -48,21 +48,53 @@ static DECLARE_WAIT_QUEUE_HEAD(xb_waitq);
 DECLARE_WAIT_QUEUE_HEAD(xenbus_watch_queue);
 
 xenbus_event_queue xenbus_events;
+
+/* Watches hashed by token */
+#define WATCH_HASH_SIZE 64
 static struct watch {
     char *token;
+    unsigned int hash;
     xenbus_event_queue *events;
     struct watch *next;
-} *watches;
+} *watches[WATCH_HASH_SIZE];
+
+/* Queued events hashed by queue and path, to coalesce duplicates */
+#define PENDING_HASH_SIZE 64
+static struct xenbus_event *pending_events[PENDING_HASH_SIZE];
 struct xenbus_req_info 
 {
     int in_use:1;
     struct wait_queue_head waitq;
     void *reply;
+    /* Replies are received in place, XENSTORE_PAYLOAD_MAX sized */
+    struct xsd_sockmsg *buf;
+    int type;
+    s_time_t sent;
 };
 
-#define NR_REQS 32
+/* Maximum number of requests in flight; may be overridden at build time */
+#ifndef NR_REQS
+#define NR_REQS 128
+#endif
 static struct xenbus_req_info req_info[NR_REQS];
 
+/* Round-trip time histograms per request type, log2 microsecond buckets */
+#define XENBUS_STAT_TYPES (XS_RESET_WATCHES + 1)
+#define XENBUS_STAT_BUCKETS 20
+static unsigned long req_latency[XENBUS_STAT_TYPES][XENBUS_STAT_BUCKETS];
+
+/* Watch events small enough for the pool don't touch the heap */
+#define XENBUS_EVENT_POOL 64
+#define XENBUS_EVENT_DATA 256
+
+struct xenbus_event_slot {
+    struct xenbus_event event;
+    char data[XENBUS_EVENT_DATA];
+};
+
+static struct xenbus_event_slot event_pool[XENBUS_EVENT_POOL];
+static struct xenbus_event *free_events;
+
 uint32_t xenbus_evtchn;
 
 #ifdef CONFIG_PARAVIRT
@@ -102,29 +134,165 @@ static void memcpy_from_ring(const void *Ring,
     memcpy(dest + c1, ring, c2);
 }
 
-char **xenbus_wait_for_watch_return(xenbus_event_queue *queue)
+static int event_pooled(struct xenbus_event *event)
+{
+    return (void *)event >= (void *)event_pool &&
+           (void *)event < (void *)&event_pool[XENBUS_EVENT_POOL];
+}
+
+static struct xenbus_event *alloc_event(int len)
+{
+    struct xenbus_event *event;
+
+    if (len <= XENBUS_EVENT_DATA && free_events) {
+        event = free_events;
+        free_events = event->next;
+        return event;
+    }
+    return malloc(sizeof(*event) + len);
+}
+
+static char *event_data(struct xenbus_event *event)
+{
+    if (event_pooled(event))
+        return ((struct xenbus_event_slot *)event)->data;
+    return (char *)event + sizeof(*event);
+}
+
+/* Free an event returned by xenbus_wait_for_watch_borrow */
+void xenbus_free_event(char **path)
+{
+    struct xenbus_event *event = (struct xenbus_event *)path;
+
+    if (event_pooled(event)) {
+        event->next = free_events;
+        free_events = event;
+    } else
+        free(event);
+}
+
+/* Turn an event into one which can be released with free() */
+char **xenbus_event_unpool(char **path)
+{
+    struct xenbus_event *event = (struct xenbus_event *)path, *copy;
+    int len;
+
+    if (!event_pooled(event))
+        return path;
+
+    len = strlen(event->path) + 1;
+    len += strlen(event->path + len) + 1;
+    copy = malloc(sizeof(*copy) + len);
+    copy->path = (char *)copy + sizeof(*copy);
+    memcpy(copy->path, event->path, len);
+    copy->token = copy->path + (event->token - event->path);
+    copy->next = NULL;
+    copy->queue = NULL;
+    copy->hash_next = NULL;
+    xenbus_free_event(path);
+
+    return &copy->path;
+}
+
+static unsigned int xenbus_hash(const char *str)
+{
+    unsigned int h = 5381;
+
+    while (*str)
+        h = h * 33 + *str++;
+    return h;
+}
+
+/*
+ * An event queue points at its newest event, whose next pointer wraps
+ * around to the oldest one, so that both ends are reachable in O(1)
+ * and events are delivered in the order they arrived.  An event whose
+ * path and token are already pending on the same queue is dropped: the
+ * consumer is going to look at that path anyway.
+ */
+static unsigned int pending_hash(xenbus_event_queue *queue, const char *path)
+{
+    return (xenbus_hash(path) ^ (unsigned long)queue) % PENDING_HASH_SIZE;
+}
+
+/* Queue event, or free it if an identical one is pending.  Returns 1 if
+   the event was queued. */
+static int queue_event(xenbus_event_queue *queue, struct xenbus_event *event)
+{
+    struct xenbus_event *pending;
+    unsigned int h = pending_hash(queue, event->path);
+
+    for (pending = pending_events[h]; pending; pending = pending->hash_next)
+        if (pending->queue == queue && !strcmp(pending->path, event->path) &&
+            !strcmp(pending->token, event->token)) {
+            xenbus_free_event(&event->path);
+            return 0;
+        }
+
+    event->queue = queue;
+    event->hash_next = pending_events[h];
+    pending_events[h] = event;
+
+    if (*queue) {
+        event->next = (*queue)->next;
+        (*queue)->next = event;
+    } else
+        event->next = event;
+    *queue = event;
+
+    return 1;
+}
+
+struct xenbus_event *xenbus_dequeue_event(xenbus_event_queue *queue)
+{
+    struct xenbus_event *event, **prev;
+
+    if (!*queue)
+        return NULL;
+
+    event = (*queue)->next;
+    if (event == *queue)
+        *queue = NULL;
+    else
+        (*queue)->next = event->next;
+    event->next = NULL;
+
+    prev = &pending_events[pending_hash(queue, event->path)];
+    while (*prev != event)
+        prev = &(*prev)->hash_next;
+    *prev = event->hash_next;
+
+    return event;
+}
+
+char **xenbus_wait_for_watch_borrow(xenbus_event_queue *queue)
 {
     struct xenbus_event *event;
     DEFINE_WAIT(w);
     if (!queue)
         queue = &xenbus_events;
-    while (!(event = *queue)) {
+    while (!*queue) {
         add_waiter(w, xenbus_watch_queue);
         schedule();
     }
     remove_waiter(w, xenbus_watch_queue);
-    *queue = event->next;
+    event = xenbus_dequeue_event(queue);
     return &event->path;
 }
 
+char **xenbus_wait_for_watch_return(xenbus_event_queue *queue)
+{
+    return xenbus_event_unpool(xenbus_wait_for_watch_borrow(queue));
+}
+
 void xenbus_wait_for_watch(xenbus_event_queue *queue)
 {
     char **ret;
     if (!queue)
         queue = &xenbus_events;
-    ret = xenbus_wait_for_watch_return(queue);
+    ret = xenbus_wait_for_watch_borrow(queue);
     if (ret)
-        free(ret);
+        xenbus_free_event(ret);
     else
         printk("unexpected path returned by watch\n");
 }
@@ -198,14 +366,13 @@ char *xenbus_wait_for_state_change(const char* path, XenbusState *state, xenbus_
         queue = &xenbus_events;
     for(;;)
     {
-        char *res, *msg;
+        char res[16], *msg;
         XenbusState rs;
 
-        msg = xenbus_read(XBT_NIL, path, &res);
+        msg = xenbus_read_into(XBT_NIL, path, res, sizeof(res));
         if(msg) return msg;
 
         rs = (XenbusState) (res[0] - 48);
-        free(res);
 
         if (rs == *state)
             xenbus_wait_for_watch(queue);
@@ -218,6 +385,201 @@ char *xenbus_wait_for_state_change(const char* path, XenbusState *state, xenbus_
 }
 
 
+/*
+ * Client-side read cache.  Subtrees are opted in with
+ * xenbus_cache_subtree(), which places a watch on them; XBT_NIL reads
+ * below a cached subtree are then answered locally until a watch event,
+ * or a write or rm of our own, invalidates the entry.  A reply which
+ * raced with an invalidation is not cached (see cache_generation).
+ * Entries are keyed by absolute path, so that "device/vbd/768" and
+ * "/local/domain/<domid>/device/vbd/768" name the same node.
+ */
+#define XENBUS_CACHE_BUCKETS 64
+#define XENBUS_CACHE_MAX 256
+#define XENBUS_CACHE_TOKEN "xenbus_cache"
+
+struct cache_entry {
+    struct cache_entry *next;
+    char *value;
+    char path[];
+};
+
+struct cache_subtree {
+    struct cache_subtree *next;
+    char path[];
+};
+
+static struct cache_entry *cache_table[XENBUS_CACHE_BUCKETS];
+static struct cache_subtree *cache_subtrees;
+static int nr_cache_entries;
+static unsigned long cache_generation;
+/* "/local/domain/<domid>", which relative paths are resolved against.
+   Set when the first subtree is cached. */
+static char *cache_home;
+
+/* Size of the buffer cache_key() needs for path. */
+static int cache_key_len(const char *path)
+{
+    int len = strlen(path) + 1;
+
+    if (path[0] != '/' && cache_home)
+        len += strlen(cache_home) + 1;
+    return len;
+}
+
+/* Write the absolute form of path into key and return key. */
+static char *cache_key(const char *path, char *key)
+{
+    if (path[0] != '/' && cache_home)
+        sprintf(key, "%s/%s", cache_home, path);
+    else
+        strcpy(key, path);
+    return key;
+}
+
+static unsigned int cache_hash(const char *path)
+{
+    return xenbus_hash(path) % XENBUS_CACHE_BUCKETS;
+}
+
+/* Is path equal to, or below, prefix?  "" is above everything. */
+static int path_below(const char *path, const char *prefix)
+{
+    int len = strlen(prefix);
+
+    return !len || (!strncmp(path, prefix, len) &&
+                    (path[len] == 0 || path[len] == '/'));
+}
+
+static int cache_covers(const char *path)
+{
+    struct cache_subtree *sub;
+
+    for (sub = cache_subtrees; sub; sub = sub->next)
+        if (path_below(path, sub->path))
+            return 1;
+    return 0;
+}
+
+static void cache_free_entry(struct cache_entry *ent)
+{
+    free(ent->value);
+    free(ent);
+    nr_cache_entries--;
+}
+
+/* Drop every cached entry at or below key.  "" drops everything. */
+static void cache_drop_below(const char *key)
+{
+    struct cache_entry *ent, **prev;
+    int i;
+
+    for (i = 0; i < XENBUS_CACHE_BUCKETS; i++) {
+        prev = &cache_table[i];
+        while ((ent = *prev)) {
+            if (path_below(ent->path, key)) {
+                *prev = ent->next;
+                cache_free_entry(ent);
+            } else
+                prev = &ent->next;
+        }
+    }
+}
+
+/* Drop every cached entry at or below path. */
+static void xenbus_cache_invalidate(const char *path)
+{
+    cache_generation++;
+    if (!nr_cache_entries)
+        return;
+
+    {
+        char key[cache_key_len(path)];
+
+        cache_drop_below(cache_key(path, key));
+    }
+}
+
+static struct cache_entry *xenbus_cache_find(const char *path)
+{
+    struct cache_entry *ent;
+
+    if (!nr_cache_entries)
+        return NULL;
+
+    {
+        char key[cache_key_len(path)];
+
+        cache_key(path, key);
+        for (ent = cache_table[cache_hash(key)]; ent; ent = ent->next)
+            if (!strcmp(ent->path, key))
+                return ent;
+    }
+    return NULL;
+}
+
+/* Returns a malloc'd copy of the cached value of path, or NULL. */
+static char *xenbus_cache_lookup(const char *path)
+{
+    struct cache_entry *ent = xenbus_cache_find(path);
+
+    return ent ? strdup(ent->value) : NULL;
+}
+
+/* Remember value for path, unless it was invalidated since generation
+   was sampled or path is not in a cached subtree. */
+static void xenbus_cache_insert(const char *path, const char *value,
+                                unsigned long generation)
+{
+    char key[cache_key_len(path)];
+    struct cache_entry *ent;
+    unsigned int h;
+
+    if (generation != cache_generation || !cache_subtrees)
+        return;
+    cache_key(path, key);
+    if (!cache_covers(key))
+        return;
+
+    if (nr_cache_entries >= XENBUS_CACHE_MAX) {
+        cache_generation++;
+        cache_drop_below("");
+    }
+
+    h = cache_hash(key);
+    ent = malloc(sizeof(*ent) + strlen(key) + 1);
+    strcpy(ent->path, key);
+    ent->value = strdup(value);
+    ent->next = cache_table[h];
+    cache_table[h] = ent;
+    nr_cache_entries++;
+}
+
+static void account_latency(int id)
+{
+    s_time_t us = (NOW() - req_info[id].sent) / 1000;
+    int bucket = 0;
+
+    if (req_info[id].type >= XENBUS_STAT_TYPES)
+        return;
+    while (us > 1 && bucket < XENBUS_STAT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    req_latency[req_info[id].type][bucket]++;
+}
+
+static struct watch *find_watch(const char *token)
+{
+    unsigned int h = xenbus_hash(token);
+    struct watch *watch;
+
+    for (watch = watches[h % WATCH_HASH_SIZE]; watch; watch = watch->next)
+        if (watch->hash == h && !strcmp(watch->token, token))
+            return watch;
+    return NULL;
+}
+
 static void xenbus_thread_func(void *ign)
 {
     struct xsd_sockmsg msg;
@@ -250,9 +612,8 @@ static void xenbus_thread_func(void *ign)
 
             if(msg.type == XS_WATCH_EVENT)
             {
-		struct xenbus_event *event = malloc(sizeof(*event) + msg.len);
-                xenbus_event_queue *events = NULL;
-		char *data = (char*)event + sizeof(*event);
+		struct xenbus_event *event = alloc_event(msg.len);
+		char *data = event_data(event);
                 struct watch *watch;
 
                 memcpy_from_ring(xenstore_buf->rsp,
@@ -266,34 +627,37 @@ static void xenbus_thread_func(void *ign)
                 mb();
                 xenstore_buf->rsp_cons += msg.len + sizeof(msg);
 
-                for (watch = watches; watch; watch = watch->next)
-                    if (!strcmp(watch->token, event->token)) {
-                        events = watch->events;
-                        break;
-                    }
+                xenbus_cache_invalidate(event->path);
+                if (!strcmp(event->token, XENBUS_CACHE_TOKEN)) {
+                    xenbus_free_event(&event->path);
+                    goto next;
+                }
 
-                if (events) {
-                    event->next = *events;
-                    *events = event;
-                    wake_up(&xenbus_watch_queue);
+                watch = find_watch(event->token);
+                if (watch) {
+                    if (queue_event(watch->events, event))
+                        wake_up(&xenbus_watch_queue);
                 } else {
                     printk("unexpected watch token %s\n", event->token);
-                    free(event);
+                    xenbus_free_event(&event->path);
                 }
             }
 
             else
             {
-                req_info[msg.req_id].reply = malloc(sizeof(msg) + msg.len);
+                BUG_ON(msg.len > XENSTORE_PAYLOAD_MAX);
                 memcpy_from_ring(xenstore_buf->rsp,
-                    req_info[msg.req_id].reply,
+                    req_info[msg.req_id].buf,
                     MASK_XENSTORE_IDX(xenstore_buf->rsp_cons),
                     msg.len + sizeof(msg));
+                req_info[msg.req_id].reply = req_info[msg.req_id].buf;
+                account_latency(msg.req_id);
                 mb();
                 xenstore_buf->rsp_cons += msg.len + sizeof(msg);
                 wake_up(&req_info[msg.req_id].waitq);
             }
 
+next:
             wmb();
             notify_remote_via_evtchn(xenbus_evtchn);
         }
@@ -310,6 +674,24 @@ static int nr_live_reqs;
 static DEFINE_SPINLOCK(req_lock);
 static DECLARE_WAIT_QUEUE_HEAD(req_wq);
 
+/* Stack of free request ids */
+static int free_ids[NR_REQS];
+static int nr_free_ids;
+
+/* Threads waiting for an id are served in ticket order */
+static unsigned int req_ticket_next, req_ticket_serving;
+
+static inline int xenbus_id_waiters(void)
+{
+    return req_ticket_serving != req_ticket_next;
+}
+
+/* Can allocate_xenbus_id() succeed without blocking? */
+static inline int xenbus_id_available(void)
+{
+    return nr_free_ids && !xenbus_id_waiters();
+}
+
 /* Release a xenbus identifier */
 static void release_xenbus_id(int id)
 {
@@ -317,8 +699,8 @@ static void release_xenbus_id(int id)
     spin_lock(&req_lock);
     req_info[id].in_use = 0;
     nr_live_reqs--;
-    req_info[id].in_use = 0;
-    if (nr_live_reqs == NR_REQS - 1)
+    free_ids[nr_free_ids++] = id;
+    if (xenbus_id_waiters())
         wake_up(&req_wq);
     spin_unlock(&req_lock);
 }
@@ -327,40 +709,97 @@ static void release_xenbus_id(int id)
    available. */
 static int allocate_xenbus_id(void)
 {
-    static int probe;
-    int o_probe;
+    unsigned int ticket;
+    int id;
 
-    while (1) 
+    spin_lock(&req_lock);
+    if (!xenbus_id_available())
     {
-        spin_lock(&req_lock);
-        if (nr_live_reqs < NR_REQS)
-            break;
+        /* Queue up behind earlier waiters, so nobody starves */
+        ticket = req_ticket_next++;
         spin_unlock(&req_lock);
-        wait_event(req_wq, (nr_live_reqs < NR_REQS));
+        wait_event(req_wq, req_ticket_serving == ticket && nr_free_ids);
+        spin_lock(&req_lock);
+        req_ticket_serving++;
     }
 
-    o_probe = probe;
-    for (;;) 
-    {
-        if (!req_info[o_probe].in_use)
-            break;
-        o_probe = (o_probe + 1) % NR_REQS;
-        BUG_ON(o_probe == probe);
-    }
+    id = free_ids[--nr_free_ids];
     nr_live_reqs++;
-    req_info[o_probe].in_use = 1;
-    probe = (o_probe + 1) % NR_REQS;
+    req_info[id].in_use = 1;
+    req_info[id].reply = NULL;
+    /* Let the next waiter in if there are ids left over */
+    if (xenbus_id_waiters() && nr_free_ids)
+        wake_up(&req_wq);
     spin_unlock(&req_lock);
-    init_waitqueue_head(&req_info[o_probe].waitq);
+    init_waitqueue_head(&req_info[id].waitq);
+    /* The slot keeps its reply buffer for good once it has one */
+    if (!req_info[id].buf)
+        req_info[id].buf = malloc(sizeof(struct xsd_sockmsg) +
+                                  XENSTORE_PAYLOAD_MAX);
 
-    return o_probe;
+    return id;
+}
+
+static const char *const xs_type_names[XENBUS_STAT_TYPES] = {
+    [XS_DEBUG] = "debug",
+    [XS_DIRECTORY] = "directory",
+    [XS_READ] = "read",
+    [XS_GET_PERMS] = "get_perms",
+    [XS_WATCH] = "watch",
+    [XS_UNWATCH] = "unwatch",
+    [XS_TRANSACTION_START] = "transaction_start",
+    [XS_TRANSACTION_END] = "transaction_end",
+    [XS_INTRODUCE] = "introduce",
+    [XS_RELEASE] = "release",
+    [XS_GET_DOMAIN_PATH] = "get_domain_path",
+    [XS_WRITE] = "write",
+    [XS_MKDIR] = "mkdir",
+    [XS_RM] = "rm",
+    [XS_SET_PERMS] = "set_perms",
+    [XS_WATCH_EVENT] = "watch_event",
+    [XS_ERROR] = "error",
+    [XS_IS_DOMAIN_INTRODUCED] = "is_domain_introduced",
+    [XS_RESUME] = "resume",
+    [XS_SET_TARGET] = "set_target",
+    [XS_RESTRICT] = "restrict",
+    [XS_RESET_WATCHES] = "reset_watches",
+};
+
+/* Print the round-trip time histogram of every request type used */
+void xenbus_dump_stats(void)
+{
+    unsigned long total;
+    int t, b;
+
+    printk("xenbus: %d of %d request ids in use\n", nr_live_reqs, NR_REQS);
+    for (t = 0; t < XENBUS_STAT_TYPES; t++) {
+        for (total = b = 0; b < XENBUS_STAT_BUCKETS; b++)
+            total += req_latency[t][b];
+        if (!total)
+            continue;
+        printk("xenbus %s: %lu requests\n", xs_type_names[t], total);
+        for (b = 0; b < XENBUS_STAT_BUCKETS; b++)
+            if (req_latency[t][b])
+                printk("  < %8luus: %lu\n", 2UL << b, req_latency[t][b]);
+    }
+}
+
+void xenbus_reset_stats(void)
+{
+    memset(req_latency, 0, sizeof(req_latency));
 }
 
 /* Initialise xenbus. */
 void init_xenbus(void)
 {
-    int err;
+    int err, i;
     DEBUG("init_xenbus called.\n");
+    for (i = NR_REQS - 1; i >= 0; i--)
+        free_ids[nr_free_ids++] = i;
+    for (i = 0; i < XENBUS_EVENT_POOL; i++) {
+        event_pool[i].event.next = free_events;
+        free_events = &event_pool[i].event;
+    }
     create_thread("xenstore", xenbus_thread_func, NULL);
     DEBUG("buf at %p.\n", xenstore_buf);
     err = bind_evtchn(xenbus_evtchn, xenbus_evtchn_handler, NULL);
@@ -450,6 +889,67 @@ static void xb_write(int type, int req_id, xenbus_transaction_t trans_id,
     notify_remote_via_evtchn(xenbus_evtchn);
 }
 
+/* Send a message to xenbus, in the same fashion as xb_write, without
+   waiting for the reply.  Returns the request id to pass to
+   xenbus_msg_wait(). */
+int xenbus_msg_send(int type,
+                    xenbus_transaction_t trans,
+                    struct write_req *io,
+                    int nr_reqs)
+{
+    int id;
+
+    id = allocate_xenbus_id();
+    req_info[id].type = type;
+    req_info[id].sent = NOW();
+    xb_write(type, id, trans, io, nr_reqs);
+
+    return id;
+}
+
+/* Has the reply to request id arrived? */
+int xenbus_msg_ready(int id)
+{
+    return req_info[id].reply != NULL;
+}
+
+/* Block until the reply to request id arrives.  The reply stays in
+   the slot's buffer until the id is released. */
+static struct xsd_sockmsg *xenbus_msg_borrow_wait(int id)
+{
+    struct xsd_sockmsg *rep;
+
+    wait_event(req_info[id].waitq, req_info[id].reply != NULL);
+
+    rep = req_info[id].reply;
+    BUG_ON(rep->req_id != id);
+    return rep;
+}
+
+/* Block until the reply to request id arrives and release the id.
+   The reply is malloced and should be freed by the caller. */
+struct xsd_sockmsg *xenbus_msg_wait(int id)
+{
+    struct xsd_sockmsg *rep, *copy;
+
+    rep = xenbus_msg_borrow_wait(id);
+    copy = malloc(sizeof(*rep) + rep->len);
+    memcpy(copy, rep, sizeof(*rep) + rep->len);
+    release_xenbus_id(id);
+    return copy;
+}
+
+/* As xenbus_msg_reply, but without copying the reply out of the
+   request slot.  The caller must release_xenbus_id(*id) when done. */
+static struct xsd_sockmsg *xenbus_msg_borrow(int type,
+                                             xenbus_transaction_t trans,
+                                             struct write_req *io,
+                                             int nr_reqs, int *id)
+{
+    *id = xenbus_msg_send(type, trans, io, nr_reqs);
+    return xenbus_msg_borrow_wait(*id);
+}
+
 /* Send a mesasge to xenbus, in the same fashion as xb_write, and
    block waiting for a reply.  The reply is malloced and should be
    freed by the caller. */
@@ -459,23 +959,24 @@ xenbus_msg_reply(int type,
 		 struct write_req *io,
 		 int nr_reqs)
 {
-    int id;
-    DEFINE_WAIT(w);
-    struct xsd_sockmsg *rep;
-
-    id = allocate_xenbus_id();
-    add_waiter(w, req_info[id].waitq);
+    return xenbus_msg_wait(xenbus_msg_send(type, trans, io, nr_reqs));
+}
 
-    xb_write(type, id, trans, io, nr_reqs);
+static char *reply_strdup(struct xsd_sockmsg *rep)
+{
+    char *res = malloc(rep->len + 1);
 
-    schedule();
-    remove_waiter(w, req_info[id].waitq);
-    wake(current);
+    memcpy(res, rep + 1, rep->len);
+    res[rep->len] = 0;
+    return res;
+}
 
-    rep = req_info[id].reply;
-    BUG_ON(rep->req_id != id);
-    release_xenbus_id(id);
-    return rep;
+/* As errmsg, but leaves the reply alone */
+static char *reply_errmsg(struct xsd_sockmsg *rep)
+{
+    if (rep->type != XS_ERROR)
+        return NULL;
+    return reply_strdup(rep);
 }
 
 static char *errmsg(struct xsd_sockmsg *rep)
@@ -517,12 +1018,13 @@ char *xenbus_ls(xenbus_transaction_t xbt, const char *pre, char ***contents)
 {
     struct xsd_sockmsg *reply, *repmsg;
     struct write_req req[] = { { pre, strlen(pre)+1 } };
-    int nr_elems, x, i;
+    int nr_elems, x, i, id;
     char **res, *msg;
 
-    repmsg = xenbus_msg_reply(XS_DIRECTORY, xbt, req, ARRAY_SIZE(req));
-    msg = errmsg(repmsg);
+    repmsg = xenbus_msg_borrow(XS_DIRECTORY, xbt, req, ARRAY_SIZE(req), &id);
+    msg = reply_errmsg(repmsg);
     if (msg) {
+	release_xenbus_id(id);
 	*contents = NULL;
 	return msg;
     }
@@ -537,30 +1039,93 @@ char *xenbus_ls(xenbus_transaction_t xbt, const char *pre, char ***contents)
         x += l + 1;
     }
     res[i] = NULL;
-    free(repmsg);
+    release_xenbus_id(id);
     *contents = res;
     return NULL;
 }
 
+/* Call fn on each entry of a directory, straight from the reply
+   buffer, until it returns non-zero.  Returns a malloc'd error string
+   on failure.  May block. */
+char *xenbus_ls_iter(xenbus_transaction_t xbt, const char *pre,
+                     int (*fn)(const char *name, void *arg), void *arg)
+{
+    struct xsd_sockmsg *rep;
+    struct write_req req[] = { { pre, strlen(pre)+1 } };
+    char *names, *msg;
+    int x, id;
+
+    rep = xenbus_msg_borrow(XS_DIRECTORY, xbt, req, ARRAY_SIZE(req), &id);
+    msg = reply_errmsg(rep);
+    if (!msg) {
+        names = (char *)(rep + 1);
+        for (x = 0; x < rep->len; x += strlen(names + x) + 1)
+            if (fn(names + x, arg))
+                break;
+    }
+    release_xenbus_id(id);
+    return msg;
+}
+
 char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
 {
     struct write_req req[] = { {path, strlen(path) + 1} };
     struct xsd_sockmsg *rep;
     char *res, *msg;
-    rep = xenbus_msg_reply(XS_READ, xbt, req, ARRAY_SIZE(req));
-    msg = errmsg(rep);
+    unsigned long generation = cache_generation;
+    int id;
+
+    if (xbt == XBT_NIL && (res = xenbus_cache_lookup(path))) {
+        *value = res;
+        return NULL;
+    }
+
+    rep = xenbus_msg_borrow(XS_READ, xbt, req, ARRAY_SIZE(req), &id);
+    msg = reply_errmsg(rep);
     if (msg) {
+	release_xenbus_id(id);
 	*value = NULL;
 	return msg;
     }
-    res = malloc(rep->len + 1);
-    memcpy(res, rep + 1, rep->len);
-    res[rep->len] = 0;
-    free(rep);
+    res = reply_strdup(rep);
+    release_xenbus_id(id);
+    if (xbt == XBT_NIL)
+        xenbus_cache_insert(path, res, generation);
     *value = res;
     return NULL;
 }
 
+char *xenbus_read_into(xenbus_transaction_t xbt, const char *path,
+                       char *buf, unsigned len)
+{
+    struct write_req req[] = { {path, strlen(path) + 1} };
+    struct cache_entry *ent;
+    struct xsd_sockmsg *rep;
+    char *msg;
+    unsigned long generation = cache_generation;
+    int id;
+
+    if (xbt == XBT_NIL && (ent = xenbus_cache_find(path))) {
+        if (strlen(ent->value) >= len)
+            return strdup("E2BIG");
+        strcpy(buf, ent->value);
+        return NULL;
+    }
+
+    rep = xenbus_msg_borrow(XS_READ, xbt, req, ARRAY_SIZE(req), &id);
+    msg = reply_errmsg(rep);
+    if (!msg && rep->len >= len)
+        msg = strdup("E2BIG");
+    if (!msg) {
+        memcpy(buf, rep + 1, rep->len);
+        buf[rep->len] = 0;
+    }
+    release_xenbus_id(id);
+    if (!msg && xbt == XBT_NIL)
+        xenbus_cache_insert(path, buf, generation);
+    return msg;
+}
+
 char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value)
 {
     struct write_req req[] = { 
@@ -569,11 +1134,12 @@ char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value
     };
     struct xsd_sockmsg *rep;
     char *msg;
-    rep = xenbus_msg_reply(XS_WRITE, xbt, req, ARRAY_SIZE(req));
-    msg = errmsg(rep);
-    if (msg) return msg;
-    free(rep);
-    return NULL;
+    int id;
+    rep = xenbus_msg_borrow(XS_WRITE, xbt, req, ARRAY_SIZE(req), &id);
+    xenbus_cache_invalidate(path);
+    msg = reply_errmsg(rep);
+    release_xenbus_id(id);
+    return msg;
 }
 
 char* xenbus_watch_path_token( xenbus_transaction_t xbt, const char *path, const char *token, xenbus_event_queue *events)
@@ -593,9 +1159,10 @@ char* xenbus_watch_path_token( xenbus_transaction_t xbt, const char *path, const
         events = &xenbus_events;
 
     watch->token = strdup(token);
+    watch->hash = xenbus_hash(token);
     watch->events = events;
-    watch->next = watches;
-    watches = watch;
+    watch->next = watches[watch->hash % WATCH_HASH_SIZE];
+    watches[watch->hash % WATCH_HASH_SIZE] = watch;
 
     rep = xenbus_msg_reply(XS_WATCH, xbt, req, ARRAY_SIZE(req));
 
@@ -606,6 +1173,27 @@ char* xenbus_watch_path_token( xenbus_transaction_t xbt, const char *path, const
     return NULL;
 }
 
+/* Drop the events for a watch which is going away, so that none are
+   left pending against a queue which may be freed next. */
+static void purge_events(xenbus_event_queue *queue, const char *path,
+                         const char *token)
+{
+    struct xenbus_event *event, *keep = NULL, **tail = &keep;
+
+    while ((event = xenbus_dequeue_event(queue))) {
+        if (!strcmp(event->token, token) && path_below(event->path, path))
+            xenbus_free_event(&event->path);
+        else {
+            *tail = event;
+            tail = &event->next;
+        }
+    }
+    while ((event = keep)) {
+        keep = event->next;
+        queue_event(queue, event);
+    }
+}
+
 char* xenbus_unwatch_path_token( xenbus_transaction_t xbt, const char *path, const char *token)
 {
     struct xsd_sockmsg *rep;
@@ -625,8 +1213,10 @@ char* xenbus_unwatch_path_token( xenbus_transaction_t xbt, const char *path, con
     if (msg) return msg;
     free(rep);
 
-    for (prev = &watches, watch = *prev; watch; prev = &watch->next, watch = *prev)
+    prev = &watches[xenbus_hash(token) % WATCH_HASH_SIZE];
+    for (watch = *prev; watch; prev = &watch->next, watch = *prev)
         if (!strcmp(watch->token, token)) {
+            purge_events(watch->events, path, token);
             free(watch->token);
             *prev = watch->next;
             free(watch);
@@ -636,19 +1226,83 @@ char* xenbus_unwatch_path_token( xenbus_transaction_t xbt, const char *path, con
     return NULL;
 }
 
-char *xenbus_rm(xenbus_transaction_t xbt, const char *path)
+char *xenbus_cache_subtree(const char *path)
 {
-    struct write_req req[] = { {path, strlen(path) + 1} };
+    struct cache_subtree *sub;
     struct xsd_sockmsg *rep;
     char *msg;
-    rep = xenbus_msg_reply(XS_RM, xbt, req, ARRAY_SIZE(req));
+
+    if (!cache_home) {
+        char home[32];
+
+        snprintf(home, sizeof(home), "/local/domain/%d",
+                 xenbus_get_self_id());
+        cache_home = strdup(home);
+    }
+
+    {
+        char key[cache_key_len(path)];
+        struct write_req req[] = {
+            {cache_key(path, key), strlen(key) + 1},
+            {XENBUS_CACHE_TOKEN, sizeof(XENBUS_CACHE_TOKEN)},
+        };
+
+        rep = xenbus_msg_reply(XS_WATCH, XBT_NIL, req, ARRAY_SIZE(req));
+        msg = errmsg(rep);
+        if (msg)
+            return msg;
+        free(rep);
+
+        sub = malloc(sizeof(*sub) + strlen(key) + 1);
+        strcpy(sub->path, key);
+    }
+    sub->next = cache_subtrees;
+    cache_subtrees = sub;
+
+    return NULL;
+}
+
+char *xenbus_uncache_subtree(const char *path)
+{
+    char key[cache_key_len(path)];
+    struct write_req req[] = {
+        {cache_key(path, key), strlen(key) + 1},
+        {XENBUS_CACHE_TOKEN, sizeof(XENBUS_CACHE_TOKEN)},
+    };
+    struct cache_subtree *sub, **prev;
+    struct xsd_sockmsg *rep;
+    char *msg;
+
+    for (prev = &cache_subtrees, sub = *prev; sub; prev = &sub->next, sub = *prev)
+        if (!strcmp(sub->path, key)) {
+            *prev = sub->next;
+            free(sub);
+            break;
+        }
+    xenbus_cache_invalidate(key);
+
+    rep = xenbus_msg_reply(XS_UNWATCH, XBT_NIL, req, ARRAY_SIZE(req));
     msg = errmsg(rep);
     if (msg)
-	return msg;
+        return msg;
     free(rep);
+
     return NULL;
 }
 
+char *xenbus_rm(xenbus_transaction_t xbt, const char *path)
+{
+    struct write_req req[] = { {path, strlen(path) + 1} };
+    struct xsd_sockmsg *rep;
+    char *msg;
+    int id;
+    rep = xenbus_msg_borrow(XS_RM, xbt, req, ARRAY_SIZE(req), &id);
+    xenbus_cache_invalidate(path);
+    msg = reply_errmsg(rep);
+    release_xenbus_id(id);
+    return msg;
+}
+
 char *xenbus_get_perms(xenbus_transaction_t xbt, const char *path, char **value)
 {
     struct write_req req[] = { {path, strlen(path) + 1} };
@@ -733,17 +1387,16 @@ xenbus_transaction_end(xenbus_transaction_t t, int abort, int *retry)
 
 int xenbus_read_integer(const char *path)
 {
-    char *res, *buf;
+    char *res, buf[32];
     int t;
 
-    res = xenbus_read(XBT_NIL, path, &buf);
+    res = xenbus_read_into(XBT_NIL, path, buf, sizeof(buf));
     if (res) {
 	printk("Failed to read %s.\n", path);
 	free(res);
 	return -1;
     }
     sscanf(buf, "%d", &t);
-    free(buf);
     return t;
 }
 
@@ -791,6 +1444,146 @@ char* xenbus_printf(xenbus_transaction_t xbt,
     return xenbus_write(xbt,fullpath,val);
 }
 
+void xenbus_batch_init(struct xenbus_batch *batch, xenbus_transaction_t xbt)
+{
+    batch->xbt = xbt;
+    batch->nr_ops = 0;
+}
+
+static int xenbus_batch_add(struct xenbus_batch *batch, int type,
+                            char *path, char *value)
+{
+    struct xenbus_batch_op *op;
+
+    BUG_ON(batch->nr_ops >= XENBUS_BATCH_MAX);
+    op = &batch->ops[batch->nr_ops];
+    op->type = type;
+    op->id = -1;
+    op->path = path;
+    op->value = value;
+    op->reply = NULL;
+
+    return batch->nr_ops++;
+}
+
+int xenbus_batch_read(struct xenbus_batch *batch, const char *path)
+{
+    return xenbus_batch_add(batch, XS_READ, strdup(path), NULL);
+}
+
+int xenbus_batch_write(struct xenbus_batch *batch, const char *path,
+                       const char *value)
+{
+    return xenbus_batch_add(batch, XS_WRITE, strdup(path), strdup(value));
+}
+
+int xenbus_batch_rm(struct xenbus_batch *batch, const char *path)
+{
+    return xenbus_batch_add(batch, XS_RM, strdup(path), NULL);
+}
+
+int xenbus_batch_printf(struct xenbus_batch *batch, const char *node,
+                        const char *path, const char *fmt, ...)
+{
+    char fullpath[BUFFER_SIZE];
+    char val[BUFFER_SIZE];
+    va_list args;
+
+    BUG_ON(strlen(node) + strlen(path) + 1 >= BUFFER_SIZE);
+    sprintf(fullpath, "%s/%s", node, path);
+    va_start(args, fmt);
+    vsprintf(val, fmt, args);
+    va_end(args);
+    return xenbus_batch_write(batch, fullpath, val);
+}
+
+static void xenbus_batch_send(struct xenbus_batch *batch, int i)
+{
+    struct xenbus_batch_op *op = &batch->ops[i];
+    struct write_req req[] = {
+        { op->path, strlen(op->path) + 1 },
+        { op->value, op->value ? strlen(op->value) : 0 },
+    };
+
+    op->id = xenbus_msg_send(op->type, batch->xbt, req, op->value ? 2 : 1);
+    if (op->type != XS_READ)
+        xenbus_cache_invalidate(op->path);
+}
+
+/* Send every queued operation back-to-back, then collect the replies.
+   Returns a malloc'd copy of the first error, or NULL. */
+char *xenbus_batch_submit(struct xenbus_batch *batch)
+{
+    struct xenbus_batch_op *op;
+    int sent, done = 0;
+
+    for (sent = 0; sent < batch->nr_ops; sent++) {
+        /* Never sit on request ids while waiting for a free one */
+        while (!xenbus_id_available() && done < sent) {
+            op = &batch->ops[done++];
+            op->reply = xenbus_msg_wait(op->id);
+        }
+        xenbus_batch_send(batch, sent);
+    }
+    for (; done < batch->nr_ops; done++) {
+        op = &batch->ops[done];
+        op->reply = xenbus_msg_wait(op->id);
+    }
+
+    for (done = 0; done < batch->nr_ops; done++) {
+        op = &batch->ops[done];
+        if (op->reply->type == XS_ERROR)
+            return reply_strdup(op->reply);
+    }
+    return NULL;
+}
+
+/* Result of operation i of a submitted batch, as xenbus_read() */
+char *xenbus_batch_result(struct xenbus_batch *batch, int i, char **value)
+{
+    struct xsd_sockmsg *rep = batch->ops[i].reply;
+
+    if (value)
+        *value = NULL;
+    if (rep->type == XS_ERROR)
+        return reply_strdup(rep);
+    if (value)
+        *value = reply_strdup(rep);
+    return NULL;
+}
+
+/* Result of read operation i parsed as an integer, as
+   xenbus_read_integer() */
+int xenbus_batch_read_integer(struct xenbus_batch *batch, int i)
+{
+    char *res, *buf;
+    int t;
+
+    res = xenbus_batch_result(batch, i, &buf);
+    if (res) {
+	printk("Failed to read %s.\n", batch->ops[i].path);
+	free(res);
+	return -1;
+    }
+    sscanf(buf, "%d", &t);
+    free(buf);
+    return t;
+}
+
+void xenbus_batch_free(struct xenbus_batch *batch)
+{
+    struct xenbus_batch_op *op;
+    int i;
+
+    for (i = 0; i < batch->nr_ops; i++) {
+        op = &batch->ops[i];
+        free(op->path);
+        free(op->value);
+        free(op->reply);
+    }
+    batch->nr_ops = 0;
+}
+
 domid_t xenbus_get_self_id(void)
 {
     char *dom_id;